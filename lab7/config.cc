@@ -1,11 +1,16 @@
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
 #include "config.h"
 #include "paxos.h"
 #include "handle.h"
+#include "method_thread.h"
 #include "tprintf.h"
 #include "lang/verify.h"
+// after paxos.h: math.h's log() would hide class log
+#include <math.h>
 
 // The config module maintains views. As a node joins or leaves a
 // view, the next view will be the same as previous view, except with
@@ -38,6 +43,64 @@
 // and when it re-joins, it may be many views behind; by remembering
 // all views, the other nodes can bring this re-joined node up to
 // date.
+//
+// The heartbeater probes every node it watches in parallel, every
+// $HEARTBEAT_MS (250) ms, and feeds the replies to a phi-accrual
+// detector per node. A node is suspected, and removed, once its phi
+// passes $HEARTBEAT_PHI (8), so a dead node is found after a couple of
+// intervals of silence while a merely slow one is not.
+
+static double
+now_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static double
+env_or(const char *name, double def)
+{
+  char *env = getenv(name);
+  return env ? atof(env) : def;
+}
+
+phi_detector::phi_detector(double interval_ms, double now_ms)
+  : min_sigma(interval_ms / 4), last(now_ms), sum(0), sumsq(0)
+{
+  // until it has history, a node is expected once per interval
+  gaps.push_back(interval_ms);
+  sum = interval_ms;
+  sumsq = interval_ms * interval_ms;
+}
+
+void
+phi_detector::arrival(double now_ms)
+{
+  double gap = now_ms - last;
+  last = now_ms;
+  gaps.push_back(gap);
+  sum += gap;
+  sumsq += gap * gap;
+  if (gaps.size() > window) {
+    sum -= gaps.front();
+    sumsq -= gaps.front() * gaps.front();
+    gaps.pop_front();
+  }
+}
+
+// the gaps are taken to be normally distributed
+double
+phi_detector::phi(double now_ms) const
+{
+  double mean = sum / gaps.size();
+  double var = sumsq / gaps.size() - mean * mean;
+  double sigma = var > 0 ? sqrt(var) : 0;
+  if (sigma < min_sigma)
+    sigma = min_sigma;
+  double p = 0.5 * erfc((now_ms - last - mean) / (sigma * M_SQRT2));
+  return p > 1e-300 ? -log10(p) : 300;
+}
 
 static void *
 heartbeatthread(void *x)
@@ -48,11 +111,24 @@ heartbeatthread(void *x)
 }
 
 config::config(std::string _first, std::string _me, config_view_change *_vc) 
-  : myvid (0), first (_first), me (_me), vc (_vc)
+  : myvid (0), first (_first), me (_me), vc (_vc),
+    hb_interval ((unsigned) env_or("HEARTBEAT_MS", 250)),
+    hb_phi (env_or("HEARTBEAT_PHI", 8)), lease_ms (0)
 {
   VERIFY (pthread_mutex_init(&cfg_mutex, NULL) == 0);
   VERIFY(pthread_cond_init(&config_cond, NULL) == 0);  
 
+  // The soonest anyone can suspect us is when its detector has seen
+  // perfectly regular replies, one per interval; irregular replies only
+  // widen sigma. Keep a fifth of that back for probe gaps a little
+  // under the interval.
+  phi_detector regular(hb_interval, 0);
+  double t = hb_interval;
+  while (regular.phi(t) <= hb_phi)
+    t += 1;
+  lease_ms = 0.8 * t;
+  tprintf("config: lease %.0f ms\n", lease_ms);
+
   std::ostringstream ost;
   ost << me;
 
@@ -62,6 +138,8 @@ config::config(std::string _first, std::string _me, config_view_change *_vc)
   // XXX hack; maybe should have its own port number
   pxsrpc = acc->get_rpcs();
   pxsrpc->reg(paxos_protocol::heartbeat, this, &config::heartbeat);
+  // a heartbeat stuck behind client requests looks like a dead node
+  pxsrpc->set_prio(paxos_protocol::heartbeat, rpcs::PRIO_CONTROL);
 
   {
       ScopedLock ml(&cfg_mutex);
@@ -154,6 +232,7 @@ config::paxos_commit(unsigned instance, std::string value)
 
   mems = newmem;
   myvid = instance;
+  heard.clear();
   if (vc) {
     unsigned vid = myvid;
     VERIFY(pthread_mutex_unlock(&cfg_mutex)==0);
@@ -197,6 +276,15 @@ config::add(std::string new_m, unsigned vid)
   return r;
 }
 
+bool
+config::remove(std::string m, unsigned vid)
+{
+  ScopedLock ml(&cfg_mutex);
+  if (vid != myvid || !isamember(m, mems))
+    return false;
+  return remove_wo(m);
+}
+
 // caller should hold cfg_mutex
 bool
 config::remove_wo(std::string m)
@@ -226,24 +314,23 @@ config::heartbeater()
   struct timeval now;
   struct timespec next_timeout;
   std::string m;
-  heartbeat_t h;
   bool stable;
   unsigned vid;
   std::vector<std::string> cmems;
+  std::vector<std::string> targets;
   ScopedLock ml(&cfg_mutex);
   
   while (1) {
 
     gettimeofday(&now, NULL);
-    next_timeout.tv_sec = now.tv_sec + 3;
-    next_timeout.tv_nsec = 0;
-    tprintf("heartbeater: go to sleep\n");
+    long long ns = (now.tv_usec + hb_interval * 1000LL) * 1000;
+    next_timeout.tv_sec = now.tv_sec + ns / 1000000000;
+    next_timeout.tv_nsec = ns % 1000000000;
     pthread_cond_timedwait(&config_cond, &cfg_mutex, &next_timeout);
 
     stable = true;
     vid = myvid;
     cmems = get_view_wo(vid);
-    tprintf("heartbeater: current membership %s\n", print_members(cmems).c_str());
 
     if (!isamember(me, cmems)) {
       tprintf("heartbeater: not member yet; skip hearbeat\n");
@@ -257,29 +344,98 @@ config::heartbeater()
 	m = cmems[i];
     }
 
+    //if i am the one with smallest id, watch the rest of the nodes;
+    //the rest of the nodes watch the one with smallest id
+    targets.clear();
     if (m == me) {
-      //if i am the one with smallest id, ping the rest of the nodes
       for (unsigned i = 0; i < cmems.size(); i++) {
-	if (cmems[i] != me) {
-	  if ((h = doheartbeat(cmems[i])) != OK) {
-	    stable = false;
-	    m = cmems[i];
-	    break;
-	  }
-	}
+	if (cmems[i] != me)
+	  targets.push_back(cmems[i]);
       }
     } else {
-      //the rest of the nodes ping the one with smallest id
-	if ((h = doheartbeat(m)) != OK) 
-	    stable = false;
+      targets.push_back(m);
+    }
+
+    for (std::map<std::string, watch>::iterator it = watched.begin();
+	 it != watched.end(); ) {
+      if (isamember(it->first, targets))
+	++it;
+      else
+	watched.erase(it++);
+    }
+
+    double t = now_ms();
+    for (unsigned i = 0; i < targets.size(); i++) {
+      std::map<std::string, watch>::iterator it = watched.find(targets[i]);
+      if (it == watched.end())
+	it = watched.insert(std::make_pair(targets[i], 
+					   watch(hb_interval, t))).first;
+      watch &w = it->second;
+      double phi = w.fd.phi(t);
+      // one probe can cross a view change; two in a row can't
+      if (phi > hb_phi || w.viewerrs >= 2) {
+	tprintf("heartbeater: suspect %s phi %.1f viewerrs %d\n", 
+		targets[i].c_str(), phi, w.viewerrs);
+	stable = false;
+	m = targets[i];
+	break;
+      }
+      if (!w.inflight) {
+	w.inflight = true;
+	method_thread(this, true, &config::probe, targets[i], vid);
+      }
     }
 
     if (!stable && vid == myvid) {
       remove_wo(m);
+      // new view, or a failed attempt: either way start watching afresh
+      watched.clear();
     }
   }
 }
 
+// a probe thread runs this
+void
+config::probe(std::string m, unsigned vid)
+{
+  ScopedLock ml(&cfg_mutex);
+  heartbeat_t h = doheartbeat(m, vid);
+  std::map<std::string, watch>::iterator it = watched.find(m);
+  if (it == watched.end())
+    return;
+  watch &w = it->second;
+  w.inflight = false;
+  if (h != FAILURE)
+    w.fd.arrival(now_ms());
+  if (h == VIEWERR && vid == myvid)
+    w.viewerrs++;
+  else
+    w.viewerrs = 0;
+}
+
+// Whether no other member of our view can have started to remove us,
+// i.e. each one heard from us less than lease_ms ago. Any one suspecting
+// us is enough to propose a view without us, so all of them count.
+// Only the node with the smallest id is probed by all the others; for
+// the rest this is always false. Assumes the clocks run at the same rate.
+bool
+config::has_lease()
+{
+  ScopedLock ml(&cfg_mutex);
+  std::vector<std::string> cmems = get_view_wo(myvid);
+  double t = now_ms();
+  if (!isamember(me, cmems))
+    return false;
+  for (unsigned i = 0; i < cmems.size(); i++) {
+    if (cmems[i] == me)
+      continue;
+    std::map<std::string, double>::iterator it = heard.find(cmems[i]);
+    if (it == heard.end() || t - it->second >= lease_ms)
+      return false;
+  }
+  return true;
+}
+
 paxos_protocol::status
 config::heartbeat(std::string m, unsigned vid, int &r)
 {
@@ -288,6 +444,7 @@ config::heartbeat(std::string m, unsigned vid, int &r)
   r = (int) myvid;
   tprintf("heartbeat from %s(%d) myvid %d\n", m.c_str(), vid, myvid);
   if (vid == myvid) {
+    heard[m] = now_ms();
     ret = paxos_protocol::OK;
   } else if (pro->isrunning()) {
     VERIFY (vid == myvid + 1 || vid + 1 == myvid);
@@ -298,12 +455,12 @@ config::heartbeat(std::string m, unsigned vid, int &r)
   return ret;
 }
 
+// caller should hold cfg_mutex
 config::heartbeat_t
-config::doheartbeat(std::string m)
+config::doheartbeat(std::string m, unsigned vid)
 {
   int ret = rpc_const::timeout_failure;
   int r;
-  unsigned vid = myvid;
   heartbeat_t res = OK;
 
   tprintf("doheartbeater to %s (%d)\n", m.c_str(), vid);
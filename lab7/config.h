@@ -3,6 +3,8 @@
 
 #include <string>
 #include <vector>
+#include <deque>
+#include <map>
 #include "paxos.h"
 
 class config_view_change {
@@ -11,6 +13,26 @@ class config_view_change {
   virtual ~config_view_change() {};
 };
 
+// Phi-accrual failure detector (Hayashibara et al.) for one node.
+// It keeps the gaps between the node's recent heartbeat replies and,
+// given how long the node has now been silent, returns
+// phi = -log10(P(a reply still comes)). phi 1 means a 10% chance of a
+// false suspicion, phi 8 one in 10^8. The threshold then adapts to how
+// regular the node has been rather than being a fixed timeout.
+class phi_detector {
+ public:
+  phi_detector(double interval_ms, double now_ms);
+  void arrival(double now_ms);
+  double phi(double now_ms) const;
+ private:
+  static const unsigned window = 100;
+  double min_sigma;	// keeps a very regular node from a hair trigger
+  double last;
+  double sum;
+  double sumsq;
+  std::deque<double> gaps;
+};
+
 class config : public paxos_change {
  private:
   acceptor *acc;
@@ -35,7 +57,26 @@ class config : public paxos_change {
     VIEWERR,	// response but different view #
     FAILURE,	// no response
   } heartbeat_t;
-  heartbeat_t doheartbeat(std::string m);
+  heartbeat_t doheartbeat(std::string m, unsigned vid);
+
+  // The heartbeater probes all the nodes it watches in parallel, every
+  // hb_interval ms, and suspects a node once its phi exceeds hb_phi.
+  struct watch {
+    phi_detector fd;
+    bool inflight;	// a probe is still waiting for its reply
+    int viewerrs;	// probes in a row that saw another view
+    watch(double interval_ms, double now_ms)
+      : fd(interval_ms, now_ms), inflight(false), viewerrs(0) {}
+  };
+  unsigned hb_interval;
+  double hb_phi;
+  std::map<std::string, watch> watched;
+  void probe(std::string m, unsigned vid);
+  // When we last answered each member's heartbeat in our view. A member
+  // records the reply after that, and suspects us no sooner than
+  // lease_ms later.
+  std::map<std::string, double> heard;
+  double lease_ms;
  public:
   config(std::string _first, std::string _me, config_view_change *_vc);
   unsigned vid() { return myvid; }
@@ -44,8 +85,12 @@ class config : public paxos_change {
   std::vector<std::string> get_view(unsigned instance);
   void restore(std::string s);
   bool add(std::string, unsigned vid);
+  // Propose view vid without m, as the heartbeater does for a failed
+  // node; false if vid is no longer the current view.
+  bool remove(std::string m, unsigned vid);
   bool ismember(std::string m, unsigned vid);
   void heartbeater(void);
+  bool has_lease();
   void paxos_commit(unsigned instance, std::string v);
   rpcs *get_rpcs() { return acc->get_rpcs(); }
   void breakpoint(int b) { pro->breakpoint(b); }
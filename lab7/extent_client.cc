@@ -6,24 +6,258 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
+#include "lang/verify.h"
 
 // The calls assume that the caller holds a lock on the extent
 
 extent_client::extent_client(std::string dst)
+  : m_ring(dst)
 {
+  VERIFY(!m_ring.empty());
+  for (size_t i = 0; i < m_ring.servers().size(); i++)
+    m_servers[m_ring.servers()[i]] = bind_server(m_ring.servers()[i]);
+}
+
+extent_client::~extent_client()
+{
+  for (auto it = m_servers.begin(); it != m_servers.end(); ++it)
+    delete it->second;
+}
+
+extent_client::server *
+extent_client::bind_server(const std::string &dst)
+{
+  server *s = new server();
+  if (dst.compare(0, 4, "rsm:") == 0) {
+    s->rsmc = new rsm_client(dst.substr(4));
+    return s;
+  }
   sockaddr_in dstsock;
-  make_sockaddr(dst.c_str(), &dstsock);
-  cl = new rpcc(dstsock);
-  if (cl->bind() != 0) {
-    printf("extent_client: bind failed\n");
+  rpc_transport t = make_sockaddr(dst.c_str(), &dstsock);
+  s->cl = new rpcc(dstsock, true, 0, t);
+  if (s->cl->bind() != 0) {
+    printf("extent_client: bind %s failed\n", dst.c_str());
+  }
+  // 读写内容的RPC走单独的连接，不挡住getattr、remove这些小请求
+  s->cl->set_bulk(extent_protocol::get);
+  s->cl->set_bulk(extent_protocol::put);
+  s->cl->set_bulk(extent_protocol::multiget);
+  s->cl->set_bulk(extent_protocol::multiput);
+  s->cl->set_bulk(extent_protocol::getall);
+  s->cl->set_bulk(extent_protocol::migrate);
+  return s;
+}
+
+extent_client::server *
+extent_client::route(extent_protocol::extentid_t eid)
+{
+  std::lock_guard<std::mutex> lg(m_ringMutex);
+  return m_servers[m_ring.owner(eid)];
+}
+
+std::map<extent_client::server *, std::vector<extent_protocol::extentid_t> >
+extent_client::partition(const std::vector<extent_protocol::extentid_t> &eids)
+{
+  std::map<server *, std::vector<extent_protocol::extentid_t> > groups;
+  std::lock_guard<std::mutex> lg(m_ringMutex);
+  for (size_t i = 0; i < eids.size(); i++)
+    groups[m_servers[m_ring.owner(eids[i])]].push_back(eids[i]);
+  return groups;
+}
+
+std::vector<std::string>
+extent_client::servers()
+{
+  std::lock_guard<std::mutex> lg(m_ringMutex);
+  return m_ring.servers();
+}
+
+// 连接服务器时不持有m_ringMutex
+void
+extent_client::set_ring(const std::string &servers)
+{
+  extent_ring ring(servers);
+  if (ring.empty())
+    return;
+  std::vector<std::string> missing;
+  {
+    std::lock_guard<std::mutex> lg(m_ringMutex);
+    for (size_t i = 0; i < ring.servers().size(); i++) {
+      if (!m_servers.count(ring.servers()[i]))
+        missing.push_back(ring.servers()[i]);
+    }
+  }
+  std::map<std::string, server *> bound;
+  for (size_t i = 0; i < missing.size(); i++)
+    bound[missing[i]] = bind_server(missing[i]);
+
+  std::lock_guard<std::mutex> lg(m_ringMutex);
+  for (auto it = bound.begin(); it != bound.end(); ++it) {
+    if (m_servers.count(it->first))
+      delete it->second;
+    else
+      m_servers[it->first] = it->second;
+  }
+  m_ring = ring;
+}
+
+bool
+extent_client::redirected(server *s, extent_protocol::status ret)
+{
+  if (ret == extent_protocol::MOVED) {
+    std::string servers;
+    if (s->read(extent_protocol::getring, 0, servers) == extent_protocol::OK
+        && !servers.empty()) {
+      set_ring(servers);
+      return true;
+    }
+  } else if (ret != extent_protocol::RETRY) {
+    return false;
+  }
+  usleep(10000);
+  return true;
+}
+
+void
+extent_client::restore_ring(const extent_ring &ring,
+                            const std::map<std::string, server *> &fenced,
+                            const std::string &dst, server *ncl)
+{
+  int r;
+  // dst不在旧环上，复制过去的extent全部删掉，之后的请求都回复MOVED
+  ncl->call(extent_protocol::setring, ring.str(), dst,
+            (int) extent_protocol::SERVING, r);
+  for (auto it = fenced.begin(); it != fenced.end(); ++it)
+    it->second->call(extent_protocol::setring, ring.str(), it->first,
+                     (int) extent_protocol::SERVING, r);
+  delete ncl;
+}
+
+// 新环上划给dst的extent只可能来自原来的各个服务器。迁移分三步：
+//   1. dst进入IMPORTING，对属于它的extent回复RETRY，直到复制完成；
+//      旧服务器进入HANDOFF，迁出的extent只能读不能写，所以复制的就是最终数据
+//   2. 逐个旧服务器列出extent，把在旧环上归它管、在新环上归dst管的那些
+//      按max_batch_bytes分批用migrate复制到dst
+//   3. 旧服务器进入SERVING，删除迁出的extent，之后对它们回复MOVED；
+//      然后dst进入SERVING开始处理它的extent
+// 第3步之前出错时所有服务器回到旧环。其它客户端在第1步之后就会被旧服务器用MOVED
+// 指到新环上，它们对迁移中的extent的请求会在dst上等到第3步。
+// 整个过程不持有m_ringMutex，本客户端的其它线程和其它客户端一样被重定向。
+// 迁移后extent的时间属性会变成迁移时的时间。
+extent_protocol::status
+extent_client::add_server(std::string dst)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  std::lock_guard<std::mutex> al(m_addMutex);
+
+  extent_ring oring;
+  std::map<std::string, server *> olds;
+  {
+    std::lock_guard<std::mutex> lg(m_ringMutex);
+    if (m_ring.has(dst))
+      return ret;
+    oring = m_ring;
+    for (size_t i = 0; i < oring.servers().size(); i++)
+      olds[oring.servers()[i]] = m_servers[oring.servers()[i]];
+  }
+  extent_ring nring = oring;
+  nring.add(dst);
+  int r;
+
+  server *ncl = bind_server(dst);
+  ret = ncl->call(extent_protocol::setring, nring.str(), dst,
+                  (int) extent_protocol::IMPORTING, r);
+  if (ret != extent_protocol::OK) {
+    delete ncl;
+    return ret;
+  }
+  std::map<std::string, server *> fenced;
+  for (auto it = olds.begin(); it != olds.end(); ++it) {
+    ret = it->second->call(extent_protocol::setring, nring.str(), it->first,
+                           (int) extent_protocol::HANDOFF, r);
+    if (ret != extent_protocol::OK) {
+      restore_ring(oring, fenced, dst, ncl);
+      return ret;
+    }
+    fenced[it->first] = it->second;
   }
+
+  for (auto it = olds.begin(); it != olds.end(); ++it) {
+    std::map<extent_protocol::extentid_t, unsigned int> sizes;
+    ret = it->second->read(extent_protocol::list, 0, sizes);
+    if (ret != extent_protocol::OK) {
+      restore_ring(oring, fenced, dst, ncl);
+      return ret;
+    }
+
+    std::vector<extent_protocol::extentid_t> moving;
+    for (auto s = sizes.begin(); s != sizes.end(); ++s) {
+      // 每个extent_server启动时都会创建根目录，不归它管的这些副本不迁移
+      if (oring.owner(s->first) == it->first && nring.owner(s->first) == dst)
+        moving.push_back(s->first);
+    }
+
+    for (size_t i = 0; i < moving.size(); ) {
+      std::vector<extent_protocol::extentid_t> batch;
+      size_t batch_bytes = 0;
+      while (i < moving.size()
+             && (batch.empty() || batch_bytes + sizes[moving[i]] <= max_batch_bytes)) {
+        batch_bytes += sizes[moving[i]];
+        batch.push_back(moving[i++]);
+      }
+
+      std::vector<extent_protocol::getres> res;
+      ret = it->second->read(extent_protocol::multiget, batch, res);
+      if (ret != extent_protocol::OK) {
+        restore_ring(oring, fenced, dst, ncl);
+        return ret;
+      }
+      std::map<extent_protocol::extentid_t, std::string> bufs;
+      for (size_t j = 0; j < batch.size() && j < res.size(); j++) {
+        if (res[j].ret == extent_protocol::OK)
+          bufs[batch[j]].swap(res[j].data);
+      }
+      ret = ncl->call(extent_protocol::migrate, bufs, r);
+      if (ret != extent_protocol::OK) {
+        restore_ring(oring, fenced, dst, ncl);
+        return ret;
+      }
+    }
+  }
+
+  // 数据已经全在dst上，这里出错也继续，把错误返回给调用者
+  for (auto it = olds.begin(); it != olds.end(); ++it) {
+    extent_protocol::status s =
+        it->second->call(extent_protocol::setring, nring.str(), it->first,
+                         (int) extent_protocol::SERVING, r);
+    if (s != extent_protocol::OK)
+      ret = s;
+  }
+  extent_protocol::status s =
+      ncl->call(extent_protocol::setring, nring.str(), dst,
+                (int) extent_protocol::SERVING, r);
+  if (s != extent_protocol::OK)
+    ret = s;
+
+  std::lock_guard<std::mutex> lg(m_ringMutex);
+  // 本客户端的其它线程被重定向时可能已经连上了dst
+  if (m_servers.count(dst))
+    delete ncl;
+  else
+    m_servers[dst] = ncl;
+  m_ring = nring;
+  return ret;
 }
 
 extent_protocol::status
 extent_client::get(extent_protocol::extentid_t eid, std::string &buf)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  ret = cl->call(extent_protocol::get, eid, buf);
+  server *s;
+  do {
+    s = route(eid);
+    ret = s->read(extent_protocol::get, eid, buf);
+  } while (redirected(s, ret));
   return ret;
 }
 
@@ -32,7 +266,11 @@ extent_client::getattr(extent_protocol::extentid_t eid,
 		       extent_protocol::attr &attr)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  ret = cl->call(extent_protocol::getattr, eid, attr);
+  server *s;
+  do {
+    s = route(eid);
+    ret = s->read(extent_protocol::getattr, eid, attr);
+  } while (redirected(s, ret));
   return ret;
 }
 
@@ -41,7 +279,11 @@ extent_client::put(extent_protocol::extentid_t eid, std::string buf)
 {
   extent_protocol::status ret = extent_protocol::OK;
   int r;
-  ret = cl->call(extent_protocol::put, eid, buf, r);
+  server *s;
+  do {
+    s = route(eid);
+    ret = s->call(extent_protocol::put, eid, buf, r);
+  } while (redirected(s, ret));
   return ret;
 }
 
@@ -50,8 +292,152 @@ extent_client::remove(extent_protocol::extentid_t eid)
 {
   extent_protocol::status ret = extent_protocol::OK;
   int r;
-  ret = cl->call(extent_protocol::remove, eid, r);
+  server *s;
+  do {
+    s = route(eid);
+    ret = s->call(extent_protocol::remove, eid, r);
+  } while (redirected(s, ret));
   return ret;
 }
 
+extent_protocol::status
+extent_client::getall(extent_protocol::extentid_t eid, std::string &buf,
+                      extent_protocol::attr &attr)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  extent_protocol::getres r;
+  server *s;
+  do {
+    s = route(eid);
+    ret = s->read(extent_protocol::getall, eid, r);
+  } while (redirected(s, ret));
+  if (ret == extent_protocol::OK) {
+    buf.swap(r.data);
+    attr = r.a;
+  }
+  return ret;
+}
+
+// 被MOVED或RETRY的extent重新分组后再取
+extent_protocol::status
+extent_client::multiget(const std::vector<extent_protocol::extentid_t> &eids,
+                        std::map<extent_protocol::extentid_t,
+                                 extent_protocol::getres> &res)
+{
+  std::vector<extent_protocol::extentid_t> todo = eids;
+  while (!todo.empty()) {
+    std::map<server *, std::vector<extent_protocol::extentid_t> > groups = partition(todo);
+    todo.clear();
+    for (auto g = groups.begin(); g != groups.end(); ++g) {
+      const std::vector<extent_protocol::extentid_t> &ids = g->second;
+      std::vector<extent_protocol::getres> r;
+      extent_protocol::status s = g->first->read(extent_protocol::multiget, ids, r);
+      if (s != extent_protocol::OK)
+        return s;
+      extent_protocol::status again = extent_protocol::OK;
+      for (size_t i = 0; i < ids.size() && i < r.size(); i++) {
+        if (r[i].ret == extent_protocol::MOVED || r[i].ret == extent_protocol::RETRY) {
+          again = r[i].ret;
+          todo.push_back(ids[i]);
+        } else {
+          extent_protocol::getres &e = res[ids[i]];
+          e.ret = r[i].ret;
+          e.a = r[i].a;
+          e.data.swap(r[i].data);
+        }
+      }
+      if (again != extent_protocol::OK)
+        redirected(g->first, again);
+    }
+  }
+  return extent_protocol::OK;
+}
 
+extent_protocol::status
+extent_client::get_many(const std::vector<extent_protocol::extentid_t> &eids,
+                        std::map<extent_protocol::extentid_t, std::string> &bufs)
+{
+  std::map<extent_protocol::extentid_t, extent_protocol::getres> res;
+  extent_protocol::status ret = multiget(eids, res);
+  if (ret != extent_protocol::OK)
+    return ret;
+  for (auto it = res.begin(); it != res.end(); ++it) {
+    if (it->second.ret == extent_protocol::OK)
+      bufs[it->first].swap(it->second.data);
+    else
+      ret = it->second.ret;
+  }
+  return ret;
+}
+
+// 按服务器分组后，再按max_batch_bytes把每组分成多个multiput，
+// 单个超过上限的extent独占一个RPC。被MOVED或RETRY的整批重新分组后再发
+extent_protocol::status
+extent_client::put_many(const std::map<extent_protocol::extentid_t, std::string> &bufs)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  std::vector<extent_protocol::extentid_t> todo;
+  for (auto it = bufs.begin(); it != bufs.end(); ++it)
+    todo.push_back(it->first);
+
+  while (!todo.empty()) {
+    std::map<server *, std::vector<extent_protocol::extentid_t> > groups = partition(todo);
+    todo.clear();
+    for (auto g = groups.begin(); g != groups.end(); ++g) {
+      std::vector<std::map<extent_protocol::extentid_t, std::string> > batches(1);
+      size_t batch_bytes = 0;
+      for (size_t i = 0; i < g->second.size(); i++) {
+        const std::string &buf = bufs.find(g->second[i])->second;
+        if (!batches.back().empty() && batch_bytes + buf.size() > max_batch_bytes) {
+          batches.push_back(std::map<extent_protocol::extentid_t, std::string>());
+          batch_bytes = 0;
+        }
+        batches.back()[g->second[i]] = buf;
+        batch_bytes += buf.size();
+      }
+
+      for (size_t b = 0; b < batches.size(); b++) {
+        int r;
+        ret = g->first->call(extent_protocol::multiput, batches[b], r);
+        if (redirected(g->first, ret)) {
+          for (auto it = batches[b].begin(); it != batches[b].end(); ++it)
+            todo.push_back(it->first);
+        } else if (ret != extent_protocol::OK) {
+          return ret;
+        }
+      }
+    }
+  }
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+extent_client::remove_many(const std::vector<extent_protocol::extentid_t> &eids)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  std::vector<extent_protocol::extentid_t> todo = eids;
+
+  while (!todo.empty()) {
+    std::map<server *, std::vector<extent_protocol::extentid_t> > groups = partition(todo);
+    todo.clear();
+    for (auto g = groups.begin(); g != groups.end(); ++g) {
+      const std::vector<extent_protocol::extentid_t> &ids = g->second;
+      std::vector<int> r;
+      extent_protocol::status again = extent_protocol::OK;
+      extent_protocol::status s = g->first->call(extent_protocol::multiremove, ids, r);
+      if (s != extent_protocol::OK && r.size() != ids.size())
+        return s;
+      for (size_t i = 0; i < ids.size(); i++) {
+        if (r[i] == extent_protocol::MOVED || r[i] == extent_protocol::RETRY) {
+          again = r[i];
+          todo.push_back(ids[i]);
+        } else if (r[i] != extent_protocol::OK) {
+          ret = r[i];
+        }
+      }
+      if (again != extent_protocol::OK)
+        redirected(g->first, again);
+    }
+  }
+  return ret;
+}
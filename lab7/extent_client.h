@@ -4,17 +4,86 @@
 #define extent_client_h
 
 #include <string>
+#include <vector>
+#include <map>
+#include <mutex>
 #include "extent_protocol.h"
+#include "extent_ring.h"
 #include "rpc.h"
+#include "rsm_client.h"
 
 class extent_client {
 //  private:
 // 为了能让子类访问
 protected:
-  rpcc *cl;
+  // 环上的一个节点：单个extent_server，或者用rsm复制的一组extent_server，
+  // 后者的地址写成rsm:[host:]port，port可以是组里任意一个副本
+  struct server {
+    rpcc *cl;
+    rsm_client *rsmc;
+    server() : cl(0), rsmc(0) {}
+    ~server() { delete cl; delete rsmc; }
+    // 拥有cl和rsmc，不能复制
+    server(const server &) = delete;
+    server &operator=(const server &) = delete;
+
+    // call(proc, a1, ..., an, r)，参数原样转给rsm_client或rpcc
+    template<class... Args>
+      int call(unsigned int proc, Args &&... args) {
+      return rsmc ? rsmc->call(proc, std::forward<Args>(args)...)
+                  : cl->call(proc, std::forward<Args>(args)...);
+    }
+    // 只读操作，复制组里任意一个已同步的副本都可以处理
+    template<class... Args>
+      int read(unsigned int proc, Args &&... args) {
+      return rsmc ? rsmc->read_stale(proc, std::forward<Args>(args)...)
+                  : cl->call(proc, std::forward<Args>(args)...);
+    }
+  };
+
+  // 每个服务器一个multiget，结果按extent放进res，不存在的extent也有一项
+  extent_protocol::status multiget(const std::vector<extent_protocol::extentid_t> &eids,
+                                   std::map<extent_protocol::extentid_t,
+                                            extent_protocol::getres> &res);
+
+ private:
+  std::mutex m_ringMutex;
+  extent_ring m_ring;
+  // 用过的所有服务器，析构时才释放，所以route返回的指针一直有效
+  std::map<std::string, server *> m_servers;
+  // 同一时间只做一个add_server
+  std::mutex m_addMutex;
+
+  // 返回负责这个extent的服务器
+  server *route(extent_protocol::extentid_t eid);
+  // 把eids按所在服务器分组，保持每组内的原有顺序
+  std::map<server *, std::vector<extent_protocol::extentid_t> >
+      partition(const std::vector<extent_protocol::extentid_t> &eids);
+  server *bind_server(const std::string &dst);
+  // 换成servers列出的环，连接还没连过的服务器
+  void set_ring(const std::string &servers);
+  // s对请求的回复是ret。MOVED时环已经变了，从s取新的服务器列表；RETRY时extent
+  // 正在迁入，稍等一会。这两种情况返回true，调用者重新路由后重试
+  bool redirected(server *s, extent_protocol::status ret);
+  // add_server失败时让已经设置了新环的服务器回到旧环
+  void restore_ring(const extent_ring &ring,
+                    const std::map<std::string, server *> &fenced,
+                    const std::string &dst, server *ncl);
 
  public:
+  // dst可以是逗号分隔的多个extent server，extent按id的一致性哈希分布在它们上面。
+  // 环由地址字符串算出，所有客户端要用相同的写法给出同一组服务器。
+  // 写成rsm:[host:]port的是一组用rsm复制的extent_server；
+  // 同一台机器上的服务器可以写成unix:port或shm:port，不走TCP
   extent_client(std::string dst);
+  virtual ~extent_client();
+
+  // 加入一个新的extent server，并把环上划给它的extent从原来的服务器迁移过去。
+  // 迁移期间其它客户端（包括本客户端的其它线程）对这些extent的请求会等到迁移完成，
+  // 之后旧服务器回复MOVED，客户端从它那里取得新的服务器列表，不需要重新启动。
+  // 同一时间只能有一个客户端在加服务器
+  extent_protocol::status add_server(std::string dst);
+  std::vector<std::string> servers();
 
   virtual extent_protocol::status get(extent_protocol::extentid_t eid, 
 			      std::string &buf);
@@ -22,6 +91,22 @@ protected:
 				  extent_protocol::attr &a);
   virtual extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
   virtual extent_protocol::status remove(extent_protocol::extentid_t eid);
+
+  // 一次RPC同时取回数据和属性
+  virtual extent_protocol::status getall(extent_protocol::extentid_t eid,
+                                         std::string &buf,
+                                         extent_protocol::attr &a);
+  // 批量操作。get_many只把存在的extent放进bufs，有extent不存在时返回NOENT
+  virtual extent_protocol::status get_many(
+      const std::vector<extent_protocol::extentid_t> &eids,
+      std::map<extent_protocol::extentid_t, std::string> &bufs);
+  virtual extent_protocol::status put_many(
+      const std::map<extent_protocol::extentid_t, std::string> &bufs);
+  virtual extent_protocol::status remove_many(
+      const std::vector<extent_protocol::extentid_t> &eids);
+
+  // 一次multiput携带的最大数据量，要小于connection的MAX_PDU
+  static const size_t max_batch_bytes = 4 << 20;
 };
 
 #endif 
@@ -3,10 +3,72 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
+#include <vector>
+#include <algorithm>
 #include "extent_client_cache.h"
+#include "lang/verify.h"
 
-extent_client_cache::extent_client_cache(std::string dst) : extent_client(dst)
+static void *
+flusherthread(void *x)
 {
+    extent_client_cache *cc = (extent_client_cache *) x;
+    cc->flusher();
+    return 0;
+}
+
+extent_client_cache::extent_client_cache(std::string dst, size_t dirty_limit,
+                                         int max_age_ms)
+    : extent_client(dst), m_dirtyBytes(0), m_dirtyLimit(dirty_limit),
+      m_maxAge(max_age_ms), m_stop(false), m_hasFlusher(false)
+{
+    if(m_maxAge.count() > 0)
+    {
+        int r = pthread_create(&m_flusherThread, NULL, &flusherthread, (void *) this);
+        VERIFY (r == 0);
+        m_hasFlusher = true;
+    }
+}
+
+extent_client_cache::~extent_client_cache()
+{
+    {
+        std::lock_guard<std::mutex> lg(m_mutex);
+        m_stop = true;
+    }
+    m_flusherCond.notify_one();
+    // 后台线程做完手上的回写才退出
+    if(m_hasFlusher)
+    {
+        VERIFY (pthread_join(m_flusherThread, NULL) == 0);
+    }
+
+    std::vector<extent_protocol::extentid_t> eids;
+    {
+        std::lock_guard<std::mutex> lg(m_mutex);
+        for(auto it = m_cache.begin(); it != m_cache.end(); ++it)
+        {
+            eids.push_back(it->first);
+        }
+    }
+    flush_many(eids);
+}
+
+// 调用者持有m_mutex
+void
+extent_client_cache::mark_modified(extent &e, const std::string &buf)
+{
+    if(e.m_state == MODIFIED)
+    {
+        m_dirtyBytes -= e.data.size();
+    }
+    else
+    {
+        e.dirty_since = std::chrono::steady_clock::now();
+    }
+    e.data = buf;
+    e.m_state = MODIFIED;
+    e.version++;
+    m_dirtyBytes += buf.size();
 }
 
 extent_protocol::status
@@ -28,7 +90,7 @@ extent_client_cache::get(extent_protocol::extentid_t eid, std::string &buf)
                 break;
 
             case NONE:
-                ret = cl->call(extent_protocol::get, eid, buf);
+                ret = extent_client::get(eid, buf);
                 // 更新缓存
                 if(ret == extent_protocol::OK)
                 {
@@ -47,21 +109,91 @@ extent_client_cache::get(extent_protocol::extentid_t eid, std::string &buf)
     // 缓存中没有数据
     else
     {
-        ret = cl->call(extent_protocol::get, eid, buf);
+        // 用getall一次取回数据和属性
+        extent_protocol::attr a;
+        ret = extent_client::getall(eid, buf, a);
         if (ret == extent_protocol::OK)
         {
             m_cache[eid].data = buf;
             m_cache[eid].m_state = UPDATE;
+            m_cache[eid].attr = a;
             m_cache[eid].attr.atime = time(NULL);
-            m_cache[eid].attr.size = buf.size();
-            m_cache[eid].attr.ctime = 0;
-            m_cache[eid].attr.mtime = 0;
         }
     }
 
     return ret;
 }
 
+extent_protocol::status
+extent_client_cache::getall(extent_protocol::extentid_t eid, std::string &buf,
+                            extent_protocol::attr &a)
+{
+    extent_protocol::status ret = get(eid, buf);
+    if(ret == extent_protocol::OK)
+    {
+        ret = getattr(eid, a);
+    }
+    return ret;
+}
+
+// 缓存中已有的直接返回，其余的用一个multiget取回
+extent_protocol::status
+extent_client_cache::get_many(const std::vector<extent_protocol::extentid_t> &eids,
+                              std::map<extent_protocol::extentid_t, std::string> &bufs)
+{
+    extent_protocol::status ret = extent_protocol::OK;
+    std::vector<extent_protocol::extentid_t> misses;
+
+    std::lock_guard<std::mutex> lg(m_mutex);
+
+    for(size_t i = 0; i < eids.size(); i++)
+    {
+        auto it = m_cache.find(eids[i]);
+        if(it == m_cache.end() || it->second.m_state == NONE)
+        {
+            misses.push_back(eids[i]);
+        }
+        else if(it->second.m_state == REMOVED)
+        {
+            ret = extent_protocol::NOENT;
+        }
+        else
+        {
+            bufs[eids[i]] = it->second.data;
+            it->second.attr.atime = time(NULL);
+        }
+    }
+
+    if(misses.empty())
+    {
+        return ret;
+    }
+
+    // 每个extent server一个multiget
+    std::map<extent_protocol::extentid_t, extent_protocol::getres> res;
+    extent_protocol::status r = multiget(misses, res);
+    if(r != extent_protocol::OK)
+    {
+        return r;
+    }
+    for(auto it = res.begin(); it != res.end(); ++it)
+    {
+        if(it->second.ret != extent_protocol::OK)
+        {
+            ret = it->second.ret;
+            continue;
+        }
+        extent &e = m_cache[it->first];
+        e.data = it->second.data;
+        e.m_state = UPDATE;
+        e.attr = it->second.a;
+        e.attr.atime = time(NULL);
+        bufs[it->first].swap(it->second.data);
+    }
+
+    return ret;
+}
+
 extent_protocol::status
 extent_client_cache::getattr(extent_protocol::extentid_t eid,
                              extent_protocol::attr &attr)
@@ -88,7 +220,7 @@ extent_client_cache::getattr(extent_protocol::extentid_t eid,
     else
     {
         m_cache[eid].m_state = NONE;
-        ret = cl->call(extent_protocol::getattr, eid, attr);
+        ret = extent_client::getattr(eid, attr);
         if(ret == extent_protocol::OK)
         {
             m_cache[eid].attr.atime = attr.atime;
@@ -115,8 +247,7 @@ extent_client_cache::put(extent_protocol::extentid_t eid, std::string buf)
             case NONE:
             case UPDATE:
             case MODIFIED:
-                m_cache[eid].data = buf;
-                m_cache[eid].m_state = MODIFIED;
+                mark_modified(m_cache[eid], buf);
                 m_cache[eid].attr.mtime = time(NULL);
                 m_cache[eid].attr.ctime = time(NULL);
                 m_cache[eid].attr.size = buf.size();
@@ -129,13 +260,18 @@ extent_client_cache::put(extent_protocol::extentid_t eid, std::string buf)
     }
     else
     {
-        m_cache[eid].data = buf;
-        m_cache[eid].m_state = MODIFIED;
+        mark_modified(m_cache[eid], buf);
         m_cache[eid].attr.mtime = time(NULL);
         m_cache[eid].attr.ctime = time(NULL);
         m_cache[eid].attr.size = buf.size();
     }
 
+    // 脏数据太多，不等超时直接让后台线程回写
+    if(m_dirtyBytes > m_dirtyLimit)
+    {
+        m_flusherCond.notify_one();
+    }
+
     return ret;
 }
 
@@ -150,9 +286,11 @@ extent_client_cache::remove(extent_protocol::extentid_t eid)
     {
         switch (m_cache[eid].m_state)
         {
+        case MODIFIED:
+            m_dirtyBytes -= m_cache[eid].data.size();
+            // fall through
         case NONE:
         case UPDATE:
-        case MODIFIED:
             m_cache[eid].m_state = REMOVED;
             break;
 
@@ -169,36 +307,185 @@ extent_client_cache::remove(extent_protocol::extentid_t eid)
     return ret;
 }
 
+extent_protocol::status
+extent_client_cache::put_many(const std::map<extent_protocol::extentid_t, std::string> &bufs)
+{
+    extent_protocol::status ret = extent_protocol::OK;
+    for(auto it = bufs.begin(); it != bufs.end(); ++it)
+    {
+        extent_protocol::status r = put(it->first, it->second);
+        if(r != extent_protocol::OK)
+        {
+            ret = r;
+        }
+    }
+    return ret;
+}
+
+extent_protocol::status
+extent_client_cache::remove_many(const std::vector<extent_protocol::extentid_t> &eids)
+{
+    extent_protocol::status ret = extent_protocol::OK;
+    for(size_t i = 0; i < eids.size(); i++)
+    {
+        extent_protocol::status r = remove(eids[i]);
+        if(r != extent_protocol::OK)
+        {
+            ret = r;
+        }
+    }
+    return ret;
+}
+
 extent_protocol::status
 extent_client_cache::flush(extent_protocol::extentid_t eid)
+{
+    return flush_many(std::vector<extent_protocol::extentid_t>(1, eid));
+}
+
+// 把eids中修改过的extent用multiput写回，删除的用一个multiremove，
+// 然后从缓存中去掉这些extent
+extent_protocol::status
+extent_client_cache::flush_many(const std::vector<extent_protocol::extentid_t> &eids)
 {
     extent_protocol::status ret = extent_protocol::OK;
-    int r;
+    std::map<extent_protocol::extentid_t, std::string> dirty;
+    std::vector<extent_protocol::extentid_t> removed;
 
-    std::lock_guard<std::mutex> lg(m_mutex);
+    std::unique_lock<std::mutex> lck(m_mutex);
 
-    if(m_cache.count(eid))
+    for(size_t i = 0; i < eids.size(); i++)
     {
-        switch (m_cache[eid].m_state)
+        extent_protocol::extentid_t eid = eids[i];
+
+        // 等待后台线程对这个extent的回写结束，避免旧数据在flush之后才到达服务器
+        while(m_cache.count(eid) && m_cache[eid].writing_back)
+        {
+            m_writebackDone.wait(lck);
+        }
+
+        auto it = m_cache.find(eid);
+        if(it == m_cache.end())
+        {
+            ret = extent_protocol::NOENT;
+            continue;
+        }
+
+        switch (it->second.m_state)
         {
             case MODIFIED:
-                ret = cl->call(extent_protocol::put, eid, m_cache[eid].data, r);
+                m_dirtyBytes -= it->second.data.size();
+                dirty[eid].swap(it->second.data);
                 break;
 
             case REMOVED:
-                ret = cl->call(extent_protocol::remove, eid);
+                removed.push_back(eid);
                 break;
-            
+
             case NONE:
             case UPDATE:
                 break;
         }
-        m_cache.erase(eid);
+        m_cache.erase(it);
     }
-    else
+
+    if(!dirty.empty())
     {
-        ret = extent_protocol::NOENT;
+        ret = extent_client::put_many(dirty);
+    }
+    if(!removed.empty())
+    {
+        extent_protocol::status r = extent_client::remove_many(removed);
+        if(r != extent_protocol::OK)
+        {
+            ret = r;
+        }
     }
 
     return ret;
-}
\ No newline at end of file
+}
+
+// 把eids当前的数据用multiput写回服务器，写回期间不持有m_mutex。
+// 调用者持有lck，并且eids都处于MODIFIED状态。
+void
+extent_client_cache::writeback(const std::vector<extent_protocol::extentid_t> &eids,
+                               std::unique_lock<std::mutex> &lck)
+{
+    std::map<extent_protocol::extentid_t, std::string> bufs;
+    std::map<extent_protocol::extentid_t, unsigned long long> versions;
+    for(size_t i = 0; i < eids.size(); i++)
+    {
+        extent &e = m_cache[eids[i]];
+        bufs[eids[i]] = e.data;
+        versions[eids[i]] = e.version;
+        e.writing_back = true;
+    }
+
+    lck.unlock();
+    extent_protocol::status ret = extent_client::put_many(bufs);
+    lck.lock();
+
+    for(size_t i = 0; i < eids.size(); i++)
+    {
+        // writing_back为true时flush不会删除这个extent
+        extent &cur = m_cache[eids[i]];
+        cur.writing_back = false;
+        // 回写期间没有被修改过，缓存中的数据已经和服务器一致
+        if(ret == extent_protocol::OK && cur.m_state == MODIFIED &&
+           cur.version == versions[eids[i]])
+        {
+            cur.m_state = UPDATE;
+            m_dirtyBytes -= cur.data.size();
+        }
+    }
+    m_writebackDone.notify_all();
+}
+
+// 后台回写线程：把存在时间超过m_maxAge的脏extent写回服务器，
+// 脏数据总量超过m_dirtyLimit时从最旧的开始回写。这样在锁被收回时
+// flush只需要写回剩下的少量数据。每一轮选出的extent合并成multiput。
+void
+extent_client_cache::flusher()
+{
+    std::unique_lock<std::mutex> lck(m_mutex);
+
+    while(!m_stop)
+    {
+        m_flusherCond.wait_for(lck, m_maxAge / 2);
+        if(m_stop)
+        {
+            break;
+        }
+
+        typedef std::pair<std::chrono::steady_clock::time_point,
+                          extent_protocol::extentid_t> dirty_entry;
+        std::vector<dirty_entry> dirty;
+        for(auto it = m_cache.begin(); it != m_cache.end(); ++it)
+        {
+            if(it->second.m_state == MODIFIED && !it->second.writing_back)
+            {
+                dirty.push_back(dirty_entry(it->second.dirty_since, it->first));
+            }
+        }
+        std::sort(dirty.begin(), dirty.end());
+
+        auto now = std::chrono::steady_clock::now();
+        size_t remaining = m_dirtyBytes;
+        std::vector<extent_protocol::extentid_t> victims;
+        for(size_t i = 0; i < dirty.size(); i++)
+        {
+            bool expired = now - dirty[i].first >= m_maxAge;
+            if(!expired && remaining <= m_dirtyLimit)
+            {
+                break;
+            }
+            victims.push_back(dirty[i].second);
+            remaining -= m_cache[dirty[i].second].data.size();
+        }
+
+        if(!victims.empty())
+        {
+            writeback(victims, lck);
+        }
+    }
+}
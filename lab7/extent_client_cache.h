@@ -2,6 +2,8 @@
 #define extent_client_cache_h
 
 #include <mutex>
+#include <chrono>
+#include <condition_variable>
 #include "extent_client.h"
 
 class extent_client_cache : public extent_client {
@@ -16,22 +18,62 @@ class extent_client_cache : public extent_client {
         std::string data;
         state m_state;
         extent_protocol::attr attr;
-        extent() : m_state(NONE) {}
+        // 变为MODIFIED的时间，后台线程据此按时间回写
+        std::chrono::steady_clock::time_point dirty_since;
+        // 每次put都加一，回写完成时用来判断期间是否又被修改过
+        unsigned long long version;
+        // 后台线程正在把这个extent写回服务器
+        bool writing_back;
+        extent() : m_state(NONE), version(0), writing_back(false) {}
     };
 
 private:
     std::mutex m_mutex;
     std::map<extent_protocol::extentid_t, extent> m_cache;
 
+    // 唤醒后台回写线程
+    std::condition_variable m_flusherCond;
+    // 一次后台回写结束，flush需要等待同一个extent的回写完成
+    std::condition_variable m_writebackDone;
+    // 所有MODIFIED状态extent的数据总字节数
+    size_t m_dirtyBytes;
+    // 脏数据超过这个字节数时立即回写最旧的extent
+    size_t m_dirtyLimit;
+    // 脏数据在缓存中最多停留的时间，0表示关闭后台回写
+    std::chrono::milliseconds m_maxAge;
+    // 析构时置位，让后台线程退出
+    bool m_stop;
+    bool m_hasFlusher;
+    pthread_t m_flusherThread;
+
+    void mark_modified(extent &e, const std::string &buf);
+    void writeback(const std::vector<extent_protocol::extentid_t> &eids,
+                   std::unique_lock<std::mutex> &lck);
+
 public:
-    extent_client_cache(std::string dst);
+    extent_client_cache(std::string dst, size_t dirty_limit = 4 << 20,
+                        int max_age_ms = 1000);
+    // 停掉后台线程，并把还没写回的修改和删除都交给服务器
+    ~extent_client_cache();
     extent_protocol::status get(extent_protocol::extentid_t eid,
                                 std::string &buf);
     extent_protocol::status getattr(extent_protocol::extentid_t eid,
                                     extent_protocol::attr &a);
     extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
     extent_protocol::status remove(extent_protocol::extentid_t eid);
+    extent_protocol::status getall(extent_protocol::extentid_t eid,
+                                   std::string &buf, extent_protocol::attr &a);
+    extent_protocol::status get_many(
+        const std::vector<extent_protocol::extentid_t> &eids,
+        std::map<extent_protocol::extentid_t, std::string> &bufs);
+    extent_protocol::status put_many(
+        const std::map<extent_protocol::extentid_t, std::string> &bufs);
+    extent_protocol::status remove_many(
+        const std::vector<extent_protocol::extentid_t> &eids);
     extent_protocol::status flush(extent_protocol::extentid_t eid);
+    extent_protocol::status flush_many(
+        const std::vector<extent_protocol::extentid_t> &eids);
+    void flusher();
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -9,40 +9,43 @@ class extent_protocol {
  public:
   typedef int status;
   typedef unsigned long long extentid_t;
-  enum xxstatus { OK, RPCERR, NOENT, IOERR };
+  // MOVED: the extent belongs to another server now, fetch the server
+  // list with getring and retry; RETRY: it is being moved to this
+  // server, retry later
+  enum xxstatus { OK, RPCERR, NOENT, IOERR, MOVED, RETRY };
   enum rpc_numbers {
     put = 0x6001,
     get,
     getattr,
-    remove
+    remove,
+    multiget,
+    multiput,
+    multiremove,
+    getall,
+    list,
+    setring,
+    getring,
+    migrate
   };
+  // what a server does with the extents of its ring, see
+  // extent_server::setring
+  enum ringstate { SERVING, HANDOFF, IMPORTING };
 
   struct attr {
     unsigned int atime;
     unsigned int mtime;
     unsigned int ctime;
     unsigned int size;
+    RPC_FIELDS(atime, mtime, ctime, size)
   };
-};
-
-inline unmarshall &
-operator>>(unmarshall &u, extent_protocol::attr &a)
-{
-  u >> a.atime;
-  u >> a.mtime;
-  u >> a.ctime;
-  u >> a.size;
-  return u;
-}
 
-inline marshall &
-operator<<(marshall &m, extent_protocol::attr a)
-{
-  m << a.atime;
-  m << a.mtime;
-  m << a.ctime;
-  m << a.size;
-  return m;
-}
+  // result of getall (getattr+get) and of each extent in multiget
+  struct getres {
+    status ret;
+    attr a;
+    std::string data;
+    RPC_FIELDS(ret, a, data)
+  };
+};
 
 #endif 
@@ -0,0 +1,80 @@
+// consistent hashing of extents over extent servers
+
+#include "extent_ring.h"
+#include <sstream>
+#include "lang/verify.h"
+#include "lang/hash.h"
+
+extent_ring::extent_ring(const std::string &servers)
+{
+  std::stringstream ss(servers);
+  std::string one;
+  while (std::getline(ss, one, ',')) {
+    if (!one.empty())
+      add(one);
+  }
+}
+
+// FNV-1a
+unsigned long long
+extent_ring::hash(const std::string &s)
+{
+  unsigned long long h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < s.size(); i++) {
+    h ^= (unsigned char) s[i];
+    h *= 0x100000001b3ULL;
+  }
+  return mix64(h);
+}
+
+void
+extent_ring::add(const std::string &dst)
+{
+  if (has(dst))
+    return;
+  m_servers.push_back(dst);
+  // unix:和shm:只是同一台机器上换一种连接方式，不影响extent放在哪里
+  std::string where = dst;
+  if (where.compare(0, 5, "unix:") == 0)
+    where = where.substr(5);
+  else if (where.compare(0, 4, "shm:") == 0)
+    where = where.substr(4);
+  for (int i = 0; i < vnodes; i++) {
+    std::ostringstream ost;
+    ost << where << "#" << i;
+    m_ring[hash(ost.str())] = dst;
+  }
+}
+
+bool
+extent_ring::has(const std::string &dst) const
+{
+  for (size_t i = 0; i < m_servers.size(); i++) {
+    if (m_servers[i] == dst)
+      return true;
+  }
+  return false;
+}
+
+const std::string &
+extent_ring::owner(extent_protocol::extentid_t eid) const
+{
+  VERIFY(!m_ring.empty());
+  std::map<unsigned long long, std::string>::const_iterator it =
+      m_ring.lower_bound(mix64(eid));
+  if (it == m_ring.end())
+    it = m_ring.begin();
+  return it->second;
+}
+
+std::string
+extent_ring::str() const
+{
+  std::string s;
+  for (size_t i = 0; i < m_servers.size(); i++) {
+    if (i > 0)
+      s += ",";
+    s += m_servers[i];
+  }
+  return s;
+}
@@ -0,0 +1,38 @@
+// consistent hashing of extents over extent servers
+
+#ifndef extent_ring_h
+#define extent_ring_h
+
+#include <string>
+#include <vector>
+#include <map>
+#include "extent_protocol.h"
+
+// 一致性哈希环：extent属于顺时针方向第一个虚拟节点所在的服务器。
+// 环只由服务器地址字符串算出，客户端和服务器拿到同一个列表就得到同样的划分
+class extent_ring {
+ public:
+  // servers是逗号分隔的服务器列表，空的和重复的跳过
+  extent_ring(const std::string &servers = "");
+
+  void add(const std::string &dst);
+  bool has(const std::string &dst) const;
+  bool empty() const { return m_servers.empty(); }
+  const std::string &owner(extent_protocol::extentid_t eid) const;
+  // 按加入顺序排列的服务器
+  const std::vector<std::string> &servers() const { return m_servers; }
+  // 逗号分隔的服务器列表，可以传给构造函数
+  std::string str() const;
+
+ private:
+  // 每个服务器在环上的虚拟节点数，越多数据分布越均匀
+  static const int vnodes = 64;
+  // 字符串用FNV-1a，extent id直接用mix64打散到整个环上
+  static unsigned long long hash(const std::string &s);
+
+  // 虚拟节点的哈希值 -> 服务器地址
+  std::map<unsigned long long, std::string> m_ring;
+  std::vector<std::string> m_servers;
+};
+
+#endif
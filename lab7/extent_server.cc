@@ -1,6 +1,7 @@
 // the extent server implementation
 
 #include "extent_server.h"
+#include "rsm.h"
 #include <sstream>
 #include <stdio.h>
 #include <unistd.h>
@@ -8,20 +9,56 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
-extent_server::extent_server()
+// 复制时根目录在各副本上各自建立, 第一次写之前它的时间都是 0
+extent_server::extent_server(class rsm *_rsm)
+  : rsm(_rsm), m_ringState(extent_protocol::SERVING),
+    m_stagingState(extent_protocol::SERVING)
 {
   int ret;
   put(1, "", ret);
 }
 
+unsigned int extent_server::now()
+{
+  return rsm ? rsm->stamp() : time(NULL);
+}
+
+
+int extent_server::check(extent_protocol::extentid_t id, bool write)
+{
+  if(m_ring.empty())
+  {
+    return extent_protocol::OK;
+  }
+  bool mine = m_ring.owner(id) == m_self;
+  if(!mine && (write || m_ringState != extent_protocol::HANDOFF))
+  {
+    return extent_protocol::MOVED;
+  }
+  if(mine && m_ringState == extent_protocol::IMPORTING)
+  {
+    return extent_protocol::RETRY;
+  }
+  return extent_protocol::OK;
+}
 
 int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
 {
   // You fill this in for Lab 2.
   std::lock_guard<std::mutex> lg(m_mutex);
 
+  int ret = check(id, true);
+  if(ret == extent_protocol::OK)
+  {
+    put_l(id, buf);
+  }
+  return ret;
+}
+
+void extent_server::put_l(extent_protocol::extentid_t id, const std::string &buf)
+{
   extent_protocol::attr attr;
-  attr.atime = attr.mtime = attr.ctime = time(NULL);
+  attr.atime = attr.mtime = attr.ctime = now();
 
   if(m_dataMap.find(id) != m_dataMap.end())
   {
@@ -30,8 +67,6 @@ int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
   attr.size = buf.size();
   m_dataMap[id].data = buf;
   m_dataMap[id].attr = attr;
-
-  return extent_protocol::OK;
 }
 
 int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
@@ -39,9 +74,18 @@ int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
   // You fill this in for Lab 2.
   std::lock_guard<std::mutex> lg(m_mutex);
 
+  int ret = check(id, false);
+  if(ret != extent_protocol::OK)
+  {
+    return ret;
+  }
   if(m_dataMap.find(id) != m_dataMap.end())
   {
-    m_dataMap[id].attr.atime = time(NULL);
+    // 复制时 get 不经过复制就在一个副本上执行, 不能改状态, 只有单个服务器才更新 atime
+    if(!rsm)
+    {
+      m_dataMap[id].attr.atime = now();
+    }
     buf = m_dataMap[id].data;
     return extent_protocol::OK;
   }
@@ -57,6 +101,11 @@ int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr
   // unmount) if getattr fails.
   std::lock_guard<std::mutex> lg(m_mutex);
 
+  int ret = check(id, false);
+  if(ret != extent_protocol::OK)
+  {
+    return ret;
+  }
   if(m_dataMap.find(id) != m_dataMap.end())
   {
     a = m_dataMap[id].attr;
@@ -71,6 +120,11 @@ int extent_server::remove(extent_protocol::extentid_t id, int &)
   // You fill this in for Lab 2.
   std::lock_guard<std::mutex> lg(m_mutex);
 
+  int ret = check(id, true);
+  if(ret != extent_protocol::OK)
+  {
+    return ret;
+  }
   auto it = m_dataMap.find(id); 
   if(it != m_dataMap.end())
   {
@@ -81,3 +135,185 @@ int extent_server::remove(extent_protocol::extentid_t id, int &)
   return extent_protocol::NOENT;
 }
 
+int extent_server::getall(extent_protocol::extentid_t id, extent_protocol::getres &r)
+{
+  r.ret = get(id, r.data);
+  if(r.ret == extent_protocol::OK)
+  {
+    r.ret = getattr(id, r.a);
+  }
+  return r.ret;
+}
+
+int extent_server::multiget(std::vector<extent_protocol::extentid_t> ids,
+                            std::vector<extent_protocol::getres> &res)
+{
+  res.resize(ids.size());
+  for(size_t i = 0; i < ids.size(); i++)
+  {
+    getall(ids[i], res[i]);
+  }
+  return extent_protocol::OK;
+}
+
+// 有一个extent不能写时整批都不写，客户端重新分组后整批重发
+int extent_server::multiput(std::map<extent_protocol::extentid_t, std::string> bufs, int &)
+{
+  std::lock_guard<std::mutex> lg(m_mutex);
+  for(auto it = bufs.begin(); it != bufs.end(); ++it)
+  {
+    int ret = check(it->first, true);
+    if(ret != extent_protocol::OK)
+    {
+      return ret;
+    }
+  }
+  for(auto it = bufs.begin(); it != bufs.end(); ++it)
+  {
+    put_l(it->first, it->second);
+  }
+  return extent_protocol::OK;
+}
+
+// 每个extent的结果放在res中，全部删除成功才返回OK
+int extent_server::multiremove(std::vector<extent_protocol::extentid_t> ids,
+                               std::vector<int> &res)
+{
+  int r;
+  int ret = extent_protocol::OK;
+  res.resize(ids.size());
+  for(size_t i = 0; i < ids.size(); i++)
+  {
+    res[i] = remove(ids[i], r);
+    if(res[i] != extent_protocol::OK)
+    {
+      ret = res[i];
+    }
+  }
+  return ret;
+}
+
+int extent_server::list(int, std::map<extent_protocol::extentid_t, unsigned int> &sizes)
+{
+  std::lock_guard<std::mutex> lg(m_mutex);
+  sizes.clear();
+  for(auto it = m_dataMap.begin(); it != m_dataMap.end(); ++it)
+  {
+    sizes[it->first] = it->second.data.size();
+  }
+  return extent_protocol::OK;
+}
+
+int extent_server::setring(std::string servers, std::string self, int state, int &)
+{
+  std::lock_guard<std::mutex> lg(m_mutex);
+  m_ring = extent_ring(servers);
+  m_self = self;
+  m_ringState = state;
+  if(state == extent_protocol::SERVING && !m_ring.empty())
+  {
+    // 迁出的extent已经复制到新的服务器，另外还有每个服务器启动时都建立的根目录
+    for(auto it = m_dataMap.begin(); it != m_dataMap.end(); )
+    {
+      if(m_ring.owner(it->first) != m_self)
+      {
+        m_dataMap.erase(it++);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+  }
+  return extent_protocol::OK;
+}
+
+int extent_server::getring(int, std::string &servers)
+{
+  std::lock_guard<std::mutex> lg(m_mutex);
+  servers = m_ring.str();
+  return extent_protocol::OK;
+}
+
+int extent_server::migrate(std::map<extent_protocol::extentid_t, std::string> bufs, int &)
+{
+  std::lock_guard<std::mutex> lg(m_mutex);
+  for(auto it = bufs.begin(); it != bufs.end(); ++it)
+  {
+    put_l(it->first, it->second);
+  }
+  return extent_protocol::OK;
+}
+
+std::string extent_server::marshal_state()
+{
+  // 不限大小时一块就是全部状态
+  unsigned long long next;
+  bool done;
+  return marshal_state_chunk(0, (size_t)-1, next, done);
+}
+
+void extent_server::unmarshal_state(std::string state)
+{
+  begin_unmarshal_state();
+  unmarshal_state_chunk(state);
+  end_unmarshal_state();
+}
+
+// 块的格式是环(servers, self, state)后面跟连续的(id, data, attr)，
+// 至少包含一个extent，除非已经没有extent了
+std::string extent_server::marshal_state_chunk(unsigned long long cursor, size_t max_bytes,
+                                               unsigned long long &next, bool &done)
+{
+  std::lock_guard<std::mutex> lg(m_mutex);
+  marshall m;
+  m << m_ring.str();
+  m << m_self;
+  m << m_ringState;
+  size_t bytes = 0;
+  auto it = m_dataMap.lower_bound(cursor);
+  for(; it != m_dataMap.end(); ++it)
+  {
+    if(bytes > 0 && bytes + it->second.data.size() > max_bytes)
+    {
+      break;
+    }
+    m << it->first;
+    m << it->second;
+    bytes += it->second.data.size() + 1;
+  }
+  done = it == m_dataMap.end();
+  next = done ? 0 : it->first;
+  return m.str();
+}
+
+void extent_server::begin_unmarshal_state()
+{
+  std::lock_guard<std::mutex> lg(m_mutex);
+  m_staging.clear();
+}
+
+void extent_server::unmarshal_state_chunk(std::string chunk)
+{
+  std::lock_guard<std::mutex> lg(m_mutex);
+  unmarshall u(chunk);
+  u >> m_stagingRing;
+  u >> m_stagingSelf;
+  u >> m_stagingState;
+  while(u.ok() && !u.okdone())
+  {
+    extent_protocol::extentid_t id;
+    u >> id;
+    u >> m_staging[id];
+  }
+}
+
+void extent_server::end_unmarshal_state()
+{
+  std::lock_guard<std::mutex> lg(m_mutex);
+  m_dataMap.swap(m_staging);
+  m_staging.clear();
+  m_ring = extent_ring(m_stagingRing);
+  m_self = m_stagingSelf;
+  m_ringState = m_stagingState;
+}
@@ -5,29 +5,86 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include <mutex>
 #include "extent_protocol.h"
+#include "extent_ring.h"
+#include "rsm_state_transfer.h"
 
 struct extent {
   // 数据
   std::string data;
   // 数据属性
   extent_protocol::attr attr;
+  RPC_FIELDS(data, attr)
 };
 
-class extent_server {
+// 用rsm复制时，extent_server同时负责状态传输
+class extent_server : public rsm_state_transfer {
 
  public:
-  extent_server();
+  // 用rsm复制时传入rsm，时间戳取主服务器为每个请求定的时间
+  extent_server(class rsm *_rsm = NULL);
 
   int put(extent_protocol::extentid_t id, std::string, int &);
   int get(extent_protocol::extentid_t id, std::string &);
+  // 单个服务器时get会更新atime；用rsm复制时get不经过复制，atime只在创建时设置
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
   int remove(extent_protocol::extentid_t id, int &);
 
+  // 批量操作，一次RPC处理多个extent
+  int multiget(std::vector<extent_protocol::extentid_t> ids,
+               std::vector<extent_protocol::getres> &);
+  int multiput(std::map<extent_protocol::extentid_t, std::string> bufs, int &);
+  int multiremove(std::vector<extent_protocol::extentid_t> ids,
+                  std::vector<int> &);
+  int getall(extent_protocol::extentid_t id, extent_protocol::getres &);
+  // 列出本服务器上所有extent的id和大小，增加服务器后迁移数据时使用
+  int list(int, std::map<extent_protocol::extentid_t, unsigned int> &);
+
+  // 增加服务器时由extent_client::add_server设置。servers是逗号分隔的服务器列表，
+  // self是本服务器在列表中的名字。之后环上不属于本服务器的extent回复MOVED，
+  // 客户端用getring取得新列表后重试。state是extent_protocol::ringstate：
+  //   SERVING   只处理属于自己的extent，并删掉本地不属于自己的extent
+  //   HANDOFF   正在迁出，不属于自己的extent还能读但不能写，迁移读到的就是最终数据
+  //   IMPORTING 正在迁入，属于自己的extent回复RETRY，直到迁移完成
+  // 没有设置过环的服务器处理所有extent
+  int setring(std::string servers, std::string self, int state, int &);
+  // 当前的服务器列表，没有设置过环时为空
+  int getring(int, std::string &);
+  // 迁移时写入extent，不检查环
+  int migrate(std::map<extent_protocol::extentid_t, std::string> bufs, int &);
+
+  std::string marshal_state();
+  void unmarshal_state(std::string state);
+  // 按extent id分块传输，cursor是下一块的第一个extent id
+  std::string marshal_state_chunk(unsigned long long cursor, size_t max_bytes,
+                                  unsigned long long &next, bool &done);
+  void begin_unmarshal_state();
+  void unmarshal_state_chunk(std::string chunk);
+  void end_unmarshal_state();
+
 private:
+  class rsm *rsm;
+  // put写进属性的时间，各副本必须一致
+  unsigned int now();
+
+  // 以下调用时都要持有m_mutex
+  // 按环和迁移状态检查能否读写这个extent，返回OK、MOVED或RETRY
+  int check(extent_protocol::extentid_t id, bool write);
+  void put_l(extent_protocol::extentid_t id, const std::string &buf);
+
   std::mutex m_mutex;
   std::map<extent_protocol::extentid_t, extent> m_dataMap;
+  // setring设置的环
+  extent_ring m_ring;
+  std::string m_self;
+  int m_ringState;
+  // 分块状态传输过程中收到的extent和环，传输完成后替换上面的
+  std::map<extent_protocol::extentid_t, extent> m_staging;
+  std::string m_stagingRing;
+  std::string m_stagingSelf;
+  int m_stagingState;
 };
 
 #endif 
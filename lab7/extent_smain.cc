@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include "extent_server.h"
+#include "rsm.h"
 
 // Main loop of extent server
 
@@ -12,8 +13,11 @@ main(int argc, char *argv[])
 {
   int count = 0;
 
-  if(argc != 2){
-    fprintf(stderr, "Usage: %s port\n", argv[0]);
+  // 一个参数时是单个extent_server；两个参数时和lock_server一样用rsm复制，
+  // 第一个副本以[master:]port [me:]port相同的两个端口启动
+  if(argc != 2 && argc != 3){
+    fprintf(stderr, "Usage: %s port\n       %s [master:]port [me:]port\n",
+            argv[0], argv[0]);
     exit(1);
   }
 
@@ -24,13 +28,48 @@ main(int argc, char *argv[])
     count = atoi(count_env);
   }
 
-  rpcs server(atoi(argv[1]), count);
-  extent_server ls;
-
-  server.reg(extent_protocol::get, &ls, &extent_server::get);
-  server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
-  server.reg(extent_protocol::put, &ls, &extent_server::put);
-  server.reg(extent_protocol::remove, &ls, &extent_server::remove);
+  if(argc == 3)
+  {
+    rsm *r = new rsm(argv[1], argv[2]);
+    extent_server *ls = new extent_server(r);
+    r->set_state_transfer(ls);
+    r->reg(extent_protocol::get, ls, &extent_server::get);
+    r->reg(extent_protocol::getattr, ls, &extent_server::getattr);
+    r->reg(extent_protocol::put, ls, &extent_server::put);
+    r->reg(extent_protocol::remove, ls, &extent_server::remove);
+    r->reg(extent_protocol::multiget, ls, &extent_server::multiget);
+    r->reg(extent_protocol::multiput, ls, &extent_server::multiput);
+    r->reg(extent_protocol::multiremove, ls, &extent_server::multiremove);
+    r->reg(extent_protocol::getall, ls, &extent_server::getall);
+    r->reg(extent_protocol::list, ls, &extent_server::list);
+    r->reg(extent_protocol::setring, ls, &extent_server::setring);
+    r->reg(extent_protocol::getring, ls, &extent_server::getring);
+    r->reg(extent_protocol::migrate, ls, &extent_server::migrate);
+    r->set_readonly(extent_protocol::get);
+    r->set_readonly(extent_protocol::getattr);
+    r->set_readonly(extent_protocol::multiget);
+    r->set_readonly(extent_protocol::getall);
+    r->set_readonly(extent_protocol::list);
+    r->set_readonly(extent_protocol::getring);
+  }
+  else
+  {
+    extent_server *ls = new extent_server();
+    rpcs *server = new rpcs(atoi(argv[1]), count);
+    // 只读的 rpc 是幂等的, 不需要 at-most-once, 也不缓存它们的回复
+    server->reg(extent_protocol::get, ls, &extent_server::get, true);
+    server->reg(extent_protocol::getattr, ls, &extent_server::getattr, true);
+    server->reg(extent_protocol::put, ls, &extent_server::put);
+    server->reg(extent_protocol::remove, ls, &extent_server::remove);
+    server->reg(extent_protocol::multiget, ls, &extent_server::multiget, true);
+    server->reg(extent_protocol::multiput, ls, &extent_server::multiput);
+    server->reg(extent_protocol::multiremove, ls, &extent_server::multiremove);
+    server->reg(extent_protocol::getall, ls, &extent_server::getall, true);
+    server->reg(extent_protocol::list, ls, &extent_server::list, true);
+    server->reg(extent_protocol::setring, ls, &extent_server::setring);
+    server->reg(extent_protocol::getring, ls, &extent_server::getring, true);
+    server->reg(extent_protocol::migrate, ls, &extent_server::migrate);
+  }
 
   while(1)
     sleep(1000);
@@ -0,0 +1,361 @@
+//
+// Partitioned extent service tester
+//
+// 启动若干个extent_server，然后
+//   ./extent_tester 3772,3773,3774 [3775]
+// 第一个参数是逗号分隔的服务器列表，extent按一致性哈希分布在它们上面。
+// 给出第二个参数时，测试把这个服务器加入环后数据迁移是否正确，
+// 以及迁移期间和之后用旧服务器列表的客户端是否被正确重定向。
+// 用一个服务器和多个服务器各跑一次，可以比较吞吐量。
+//
+//   ./extent_tester -w 30 rsm:3772
+// 对服务器（通常是用rsm复制的extent_server组）持续读写30秒，
+// 每次读都要读到刚写的内容，期间可以杀掉主服务器测试切换，见test-extent-rsm.pl。
+//
+// 两种模式最后都检查extent_client_cache的后台回写。
+//
+
+#include "extent_protocol.h"
+#include "extent_client.h"
+#include "extent_client_cache.h"
+#include "rpc.h"
+#include <arpa/inet.h>
+#include <sstream>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include "lang/verify.h"
+
+int nt = 8;
+int nextents = 4000;
+size_t extent_size = 4096;
+extent_protocol::extentid_t base;
+extent_client *ec;
+
+// -w模式
+int workload_secs = 0;
+volatile bool stop;
+pthread_mutex_t stat_mutex;
+long total_ops;
+double max_latency;
+
+static double
+now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static std::string
+content(extent_protocol::extentid_t eid)
+{
+  std::ostringstream ost;
+  ost << eid << ":";
+  std::string s = ost.str();
+  s.resize(extent_size, 'a' + eid % 26);
+  return s;
+}
+
+void *
+putter(void *x)
+{
+  long t = (long) x;
+  for (int i = t; i < nextents; i += nt) {
+    VERIFY(ec->put(base + i, content(base + i)) == extent_protocol::OK);
+  }
+  return 0;
+}
+
+void *
+getter(void *x)
+{
+  long t = (long) x;
+  for (int i = t; i < nextents; i += nt) {
+    std::string buf;
+    if (ec->get(base + i, buf) != extent_protocol::OK || buf != content(base + i)) {
+      fprintf(stderr, "error: extent %llx lost or corrupted\n", base + i);
+      exit(1);
+    }
+  }
+  return 0;
+}
+
+static void
+run(const char *name, void *(*fn)(void *))
+{
+  pthread_t th[nt];
+  double start = now();
+  for (long i = 0; i < nt; i++)
+    VERIFY(pthread_create(&th[i], NULL, fn, (void *) i) == 0);
+  for (int i = 0; i < nt; i++)
+    pthread_join(th[i], NULL);
+  double t = now() - start;
+  printf("%s: %d extents in %.3f s, %.0f ops/s\n", name, nextents, t, nextents / t);
+}
+
+// 等别的客户端在secs秒内读到want
+static bool
+visible(extent_client &c, extent_protocol::extentid_t eid,
+        const std::string &want, double secs)
+{
+  double deadline = now() + secs;
+  do {
+    std::string buf;
+    if (c.get(eid, buf) == extent_protocol::OK && buf == want)
+      return true;
+    usleep(20000);
+  } while (now() < deadline);
+  return false;
+}
+
+// extent_client_cache的后台回写：脏数据超过max_age_ms后别的客户端能读到；
+// 脏数据超过dirty_limit时不等超时马上回写；析构时写回剩下的修改和删除
+static void
+writeback_test(const char *dst)
+{
+  extent_client reader(dst);
+  extent_protocol::extentid_t eid = base + nextents;
+  std::string buf;
+
+  extent_client_cache *c = new extent_client_cache(dst, 1 << 20, 200);
+  double start = now();
+  VERIFY(c->put(eid, "aged") == extent_protocol::OK);
+  if (!visible(reader, eid, "aged", 5)) {
+    fprintf(stderr, "error: dirty extent not written back after max_age\n");
+    exit(1);
+  }
+  printf("writeback: max_age 200 ms, visible after %.0f ms\n",
+         (now() - start) * 1000);
+  delete c;
+
+  // max_age很长，只有dirty_limit能让它回写
+  c = new extent_client_cache(dst, 4096, 60000);
+  VERIFY(c->put(eid + 1, std::string(1000, 'x')) == extent_protocol::OK);
+  VERIFY(reader.get(eid + 1, buf) == extent_protocol::NOENT);
+  VERIFY(c->put(eid + 2, std::string(8192, 'y')) == extent_protocol::OK);
+  if (!visible(reader, eid + 2, std::string(8192, 'y'), 5) ||
+      !visible(reader, eid + 1, std::string(1000, 'x'), 0)) {
+    fprintf(stderr, "error: dirty_limit did not force a write-back\n");
+    exit(1);
+  }
+
+  VERIFY(c->put(eid + 3, "at exit") == extent_protocol::OK);
+  VERIFY(c->remove(eid + 1) == extent_protocol::OK);
+  delete c;
+  VERIFY(reader.get(eid + 3, buf) == extent_protocol::OK && buf == "at exit");
+  VERIFY(reader.get(eid + 1, buf) == extent_protocol::NOENT);
+
+  std::vector<extent_protocol::extentid_t> eids;
+  eids.push_back(eid);
+  eids.push_back(eid + 2);
+  eids.push_back(eid + 3);
+  VERIFY(reader.remove_many(eids) == extent_protocol::OK);
+  printf("writeback: dirty_limit and shutdown OK\n");
+}
+
+// 加服务器期间，一个用旧服务器列表的客户端不停地写一组extent并马上读回来，
+// 迁移完成后它最后写的内容都要在
+extent_client *stale;
+volatile bool stale_stop;
+std::map<extent_protocol::extentid_t, std::string> stale_last;
+
+void *
+stale_writer(void *)
+{
+  for (long n = 0; !stale_stop; n++) {
+    extent_protocol::extentid_t eid = base + nextents + 16 + n % 64;
+    std::ostringstream ost;
+    ost << eid << ":" << n;
+    std::string buf;
+    VERIFY(stale->put(eid, ost.str()) == extent_protocol::OK);
+    if (stale->get(eid, buf) != extent_protocol::OK || buf != ost.str()) {
+      fprintf(stderr, "error: extent %llx: read \"%s\" after writing \"%s\" "
+              "during rebalance\n", eid, buf.c_str(), ost.str().c_str());
+      exit(1);
+    }
+    stale_last[eid] = ost.str();
+  }
+  return 0;
+}
+
+// 每个线程反复写自己的一组extent，并马上读回来检查
+void *
+worker(void *x)
+{
+  long t = (long) x;
+  const int per_thread = 16;
+  long n = 0;
+  double my_max = 0;
+
+  while (!stop) {
+    extent_protocol::extentid_t eid = base + t * per_thread + n % per_thread;
+    std::ostringstream ost;
+    ost << eid << ":" << n;
+    std::string buf;
+    double start = now();
+    VERIFY(ec->put(eid, ost.str()) == extent_protocol::OK);
+    if (ec->get(eid, buf) != extent_protocol::OK || buf != ost.str()) {
+      fprintf(stderr, "error: extent %llx: read \"%s\" after writing \"%s\"\n",
+              eid, buf.c_str(), ost.str().c_str());
+      exit(1);
+    }
+    double lat = now() - start;
+    if (lat > my_max)
+      my_max = lat;
+    n++;
+  }
+
+  ScopedLock ml(&stat_mutex);
+  total_ops += 2 * n;
+  if (my_max > max_latency)
+    max_latency = my_max;
+  return 0;
+}
+
+static void
+workload()
+{
+  pthread_t th[nt];
+  VERIFY(pthread_mutex_init(&stat_mutex, NULL) == 0);
+  for (long i = 0; i < nt; i++)
+    VERIFY(pthread_create(&th[i], NULL, worker, (void *) i) == 0);
+  sleep(workload_secs);
+  stop = true;
+  for (int i = 0; i < nt; i++)
+    pthread_join(th[i], NULL);
+  printf("workload: %ld ops in %d s, %.0f ops/s, max put+get latency %.3f s\n",
+         total_ops, workload_secs, (double) total_ops / workload_secs, max_latency);
+}
+
+// 每个服务器上有多少个测试用的extent
+static void
+distribution()
+{
+  std::vector<std::string> servers = ec->servers();
+  for (size_t i = 0; i < servers.size(); i++) {
+    // 复制组的list要通过rsm，这里只统计单个的extent_server
+    if (servers[i].compare(0, 4, "rsm:") == 0)
+      continue;
+    sockaddr_in dstsock;
+    rpc_transport t = make_sockaddr(servers[i].c_str(), &dstsock);
+    rpcc cl(dstsock, true, 0, t);
+    VERIFY(cl.bind() == 0);
+    std::map<extent_protocol::extentid_t, unsigned int> sizes;
+    VERIFY(cl.call(extent_protocol::list, 0, sizes) == extent_protocol::OK);
+    int n = 0;
+    for (auto it = sizes.begin(); it != sizes.end(); ++it) {
+      if (it->first >= base && it->first < base + nextents)
+        n++;
+    }
+    printf("  %s: %d extents\n", servers[i].c_str(), n);
+  }
+}
+
+static void
+verify_all(extent_client *c)
+{
+  std::vector<extent_protocol::extentid_t> eids;
+  for (int i = 0; i < nextents; i++)
+    eids.push_back(base + i);
+  std::map<extent_protocol::extentid_t, std::string> bufs;
+  VERIFY(c->get_many(eids, bufs) == extent_protocol::OK);
+  for (int i = 0; i < nextents; i++) {
+    if (bufs[base + i] != content(base + i)) {
+      fprintf(stderr, "error: extent %llx lost or corrupted\n", base + i);
+      exit(1);
+    }
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  setvbuf(stdout, NULL, _IONBF, 0);
+  setvbuf(stderr, NULL, _IONBF, 0);
+  srandom(getpid());
+
+  int ch;
+  while ((ch = getopt(argc, argv, "w:")) != -1) {
+    switch (ch) {
+    case 'w':
+      workload_secs = atoi(optarg);
+      break;
+    default:
+      break;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s [-w seconds] [host:]port[,[host:]port...] [new-port]\n",
+            argv[0]);
+    exit(1);
+  }
+
+  base = ((extent_protocol::extentid_t) random() << 32) | 0x80000000;
+  ec = new extent_client(argv[1]);
+
+  if (workload_secs > 0) {
+    // 新建的客户端要从argv[1]找到组，在工作负载杀掉它之前做
+    writeback_test(argv[1]);
+    workload();
+    printf("./extent_tester: passed all tests successfully\n");
+    return 0;
+  }
+  printf("%d servers, %d threads, %d extents of %lu bytes\n",
+         (int) ec->servers().size(), nt, nextents, extent_size);
+
+  run("put", putter);
+  run("get", getter);
+  distribution();
+
+  if (argc > 2) {
+    printf("adding server %s\n", argv[2]);
+    stale = new extent_client(argv[1]);
+    pthread_t th;
+    VERIFY(pthread_create(&th, NULL, stale_writer, NULL) == 0);
+    double start = now();
+    VERIFY(ec->add_server(argv[2]) == extent_protocol::OK);
+    printf("rebalance took %.3f s\n", now() - start);
+    stale_stop = true;
+    pthread_join(th, NULL);
+    distribution();
+    verify_all(ec);
+
+    // 用完整服务器列表新建的客户端也能找到所有extent
+    std::string all = std::string(argv[1]) + "," + argv[2];
+    extent_client fresh(all);
+    verify_all(&fresh);
+    // 还用旧列表的客户端被旧服务器重定向到新的环上
+    extent_client old(argv[1]);
+    verify_all(&old);
+    std::vector<extent_protocol::extentid_t> written;
+    for (auto it = stale_last.begin(); it != stale_last.end(); ++it) {
+      std::string buf;
+      if (fresh.get(it->first, buf) != extent_protocol::OK || buf != it->second) {
+        fprintf(stderr, "error: extent %llx: write during rebalance lost\n",
+                it->first);
+        exit(1);
+      }
+      written.push_back(it->first);
+    }
+    printf("rebalance: %lu extents written by a client with the old server "
+           "list, none lost\n", (unsigned long) written.size());
+    VERIFY(old.remove_many(written) == extent_protocol::OK);
+    delete stale;
+    run("get", getter);
+  }
+
+  std::vector<extent_protocol::extentid_t> eids;
+  for (int i = 0; i < nextents; i++)
+    eids.push_back(base + i);
+  VERIFY(ec->remove_many(eids) == extent_protocol::OK);
+
+  writeback_test(argv[1]);
+  printf("./extent_tester: passed all tests successfully\n");
+  return 0;
+}
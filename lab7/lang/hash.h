@@ -0,0 +1,19 @@
+// integer hashing
+
+#ifndef hash_h
+#define hash_h
+
+// the splitmix64 finalizer: every input bit affects every output bit,
+// so consecutive ids land far apart
+inline unsigned long long
+mix64(unsigned long long x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+#endif
@@ -11,8 +11,8 @@
 lock_client::lock_client(std::string dst)
 {
   sockaddr_in dstsock;
-  make_sockaddr(dst.c_str(), &dstsock);
-  cl = new rpcc(dstsock);
+  rpc_transport t = make_sockaddr(dst.c_str(), &dstsock);
+  cl = new rpcc(dstsock, true, 0, t);
   if (cl->bind() < 0) {
     printf("lock_client: call bind\n");
   }
@@ -16,6 +16,9 @@ lock_client_cache::lock_client_cache(std::string xdst,
   rpcs *rlsrpc = new rpcs(0);
   rlsrpc->reg(rlock_protocol::revoke, this, &lock_client_cache::revoke_handler);
   rlsrpc->reg(rlock_protocol::retry, this, &lock_client_cache::retry_handler);
+  // revoke/retry 不能排在数据请求之后, 否则服务器端的等待者会被拖慢
+  rlsrpc->set_prio(rlock_protocol::revoke, rpcs::PRIO_CONTROL);
+  rlsrpc->set_prio(rlock_protocol::retry, rpcs::PRIO_CONTROL);
 
   const char *hname;
   hname = "127.0.0.1";
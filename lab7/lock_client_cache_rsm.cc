@@ -6,8 +6,12 @@
 #include <sstream>
 #include <iostream>
 #include <chrono>
+#include <algorithm>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "tprintf.h"
+#include "lang/hash.h"
 
 #include "rsm_client.h"
 
@@ -19,11 +23,19 @@ releasethread(void *x)
   return 0;
 }
 
+static void *
+expirethread(void *x)
+{
+  lock_client_cache_rsm *cc = (lock_client_cache_rsm *) x;
+  cc->expirer();
+  return 0;
+}
+
 int lock_client_cache_rsm::last_port = 0;
 
 lock_client_cache_rsm::lock_client_cache_rsm(std::string xdst, 
 				     class lock_release_user *_lu)
-  : lock_client(xdst), lu(_lu)
+  : lock_client(xdst.substr(0, xdst.find(','))), lu(_lu)
 {
   srand(time(NULL)^last_port);
   rlock_port = ((rand()%32000) | (0x1 << 10));
@@ -37,18 +49,48 @@ lock_client_cache_rsm::lock_client_cache_rsm(std::string xdst,
   rpcs *rlsrpc = new rpcs(rlock_port);
   rlsrpc->reg(rlock_protocol::revoke, this, &lock_client_cache_rsm::revoke_handler);
   rlsrpc->reg(rlock_protocol::retry, this, &lock_client_cache_rsm::retry_handler);
+  rlsrpc->reg(rlock_protocol::revoke_many, this, &lock_client_cache_rsm::revoke_many_handler);
+  rlsrpc->reg(rlock_protocol::grant, this, &lock_client_cache_rsm::grant_handler);
+  // revoke/retry 不能排在数据请求之后, 否则服务器端的等待者会被拖慢
+  rlsrpc->set_prio(rlock_protocol::revoke, rpcs::PRIO_CONTROL);
+  rlsrpc->set_prio(rlock_protocol::revoke_many, rpcs::PRIO_CONTROL);
+  rlsrpc->set_prio(rlock_protocol::grant, rpcs::PRIO_CONTROL);
+  rlsrpc->set_prio(rlock_protocol::retry, rpcs::PRIO_CONTROL);
   xid = 0;
   // You fill this in Step Two, Lab 7
   // - Create rsmc, and use the object to do RPC 
   //   calls instead of the rpcc object of lock_client
-  rsmc = new rsm_client(xdst);
+  std::stringstream ss(xdst);
+  std::string one;
+  while (std::getline(ss, one, ',')) {
+    if (!one.empty())
+      groups.push_back(new rsm_client(one));
+  }
+  VERIFY(!groups.empty());
+
+  // $LOCK_IDLE_MS: 缓存的锁空闲多久后还给服务器，0 表示一直留着
+  char *idle_env = getenv("LOCK_IDLE_MS");
+  idle = std::chrono::milliseconds(idle_env ? atoi(idle_env) : 30000);
 
   pthread_t th;
   int r = pthread_create(&th, NULL, &releasethread, (void *) this);
   VERIFY (r == 0);
+  if(idle.count() > 0)
+  {
+    r = pthread_create(&th, NULL, &expirethread, (void *) this);
+    VERIFY (r == 0);
+  }
 }
 
 
+rsm_client *
+lock_client_cache_rsm::group(lock_protocol::lockid_t lid)
+{
+  // 相邻的lid先打散，再把哈希空间等分成groups.size()段，用高32位算落在哪一段
+  unsigned long long h = mix64(lid) >> 32;
+  return groups[(h * groups.size()) >> 32];
+}
+
 void
 lock_client_cache_rsm::releaser()
 {
@@ -60,20 +102,134 @@ lock_client_cache_rsm::releaser()
     release_entry e;
     releaseFifo.deq(&e);
 
+    // 把队列里已经有的一起取出来，同组的用一次 release_many 还回去
+    batches b;
+    do
+    {
+      b[group(e.lid)].push_back(e);
+    } while(releaseFifo.deq(&e, false));
+    release_groups(b);
+  }
+}
+
+// 调用时持有 m_mutex；没人在等的 NONE 表项不再有用
+void
+lock_client_cache_rsm::forget(std::map<lock_protocol::lockid_t, lock_entry>::iterator it)
+{
+  if(it->second.state == NONE && it->second.users == 0)
+  {
+    m_lockMap.erase(it);
+  }
+}
+
+// 调用时持有 m_mutex；锁留在本地缓存里，空闲超过 idle 后由 expirer 还掉
+void
+lock_client_cache_rsm::make_free(std::map<lock_protocol::lockid_t, lock_entry>::iterator it)
+{
+  it->second.state = FREE;
+  it->second.used = std::chrono::steady_clock::now();
+  if(idle.count() > 0)
+  {
+    idleList.push_back(std::make_pair(it->first, it->second.used));
+  }
+}
+
+// 服务器没有收下的锁仍然算我们的: 放回 FREE 留在缓存里, 等下一次 revoke
+// 或者过期时再还
+lock_protocol::status
+lock_client_cache_rsm::release_batch(rsm_client *g, const std::vector<release_entry> &batch)
+{
+  std::vector<lock_protocol::lockid_t> lids;
+  std::vector<lock_protocol::xid_t> xids;
+  for(auto &e : batch)
+  {
     if(lu)
     {
       lu->dorelease(e.lid);
-    }  
-    int r;
-    rsmc->call(lock_protocol::release, e.lid, id, e.xid, r);
+    }
+    lids.push_back(e.lid);
+    xids.push_back(e.xid);
+  }
+  std::vector<int> r;
+  lock_protocol::status ret = g->call(lock_protocol::release_many, lids, id, xids, r);
+  if(ret == lock_protocol::OK && r.size() != lids.size())
+  {
+    ret = lock_protocol::RPCERR;
+  }
 
-    std::unique_lock<std::mutex> lck(m_mutex);
-    auto it = m_lockMap.find(e.lid);
+  std::unique_lock<std::mutex> lck(m_mutex);
+  for(size_t i = 0; i < lids.size(); i++)
+  {
+    auto it = m_lockMap.find(lids[i]);
     VERIFY(it != m_lockMap.end());
-    it->second.state = NONE;
-    releaseQueue.notify_all();
-    waitQueue.notify_all();
+    // 之前收到的 revoke 针对的是这次要还的锁
+    it->second.revoked = false;
+    if(ret == lock_protocol::OK && r[i] == lock_protocol::OK)
+    {
+      it->second.state = NONE;
+      forget(it);
+      continue;
+    }
+    if(ret == lock_protocol::OK)
+    {
+      ret = r[i];
+    }
+    make_free(it);
+  }
+  releaseQueue.notify_all();
+  waitQueue.notify_all();
+  return ret;
+}
+
+lock_protocol::status
+lock_client_cache_rsm::release_groups(batches &b)
+{
+  lock_protocol::status ret = lock_protocol::OK;
+  for(auto &g : b)
+  {
+    for(size_t i = 0; i < g.second.size(); i += max_batch)
+    {
+      size_t n = std::min(g.second.size() - i, (size_t) max_batch);
+      lock_protocol::status r =
+          release_batch(g.first, std::vector<release_entry>(g.second.begin() + i,
+                                                            g.second.begin() + i + n));
+      if(ret == lock_protocol::OK)
+      {
+        ret = r;
+      }
+    }
+  }
+  return ret;
+}
+
+void
+lock_client_cache_rsm::expirer()
+{
+  // 每隔半个 idle 检查一次，把空闲超过 idle 的 FREE 锁按组收集起来，
+  // 每组一次 release_many 还给服务器
+  while(1)
+  {
+    usleep(idle.count() * 1000 / 2);
+
+    auto now = std::chrono::steady_clock::now();
+    batches b;
+    std::unique_lock<std::mutex> lck(m_mutex);
+    while(!idleList.empty() && now - idleList.front().second >= idle)
+    {
+      lock_protocol::lockid_t lid = idleList.front().first;
+      auto stamp = idleList.front().second;
+      idleList.pop_front();
+      auto it = m_lockMap.find(lid);
+      if(it == m_lockMap.end() || it->second.state != FREE || it->second.used != stamp)
+      {
+        continue;
+      }
+      it->second.state = RELEASING;
+      b[group(lid)].push_back(release_entry(lid, it->second.xid));
+    }
     lck.unlock();
+
+    release_groups(b);
   }
 }
 
@@ -91,6 +247,7 @@ lock_client_cache_rsm::acquire(lock_protocol::lockid_t lid)
   {
     it = m_lockMap.insert(std::make_pair(lid, lock_entry())).first;
   }
+  it->second.users++;
 
   while(1)
   {
@@ -100,34 +257,35 @@ lock_client_cache_rsm::acquire(lock_protocol::lockid_t lid)
         // 当客户端尝试向服务器获取锁时，状态变为ACQUIRING
         it->second.state = ACQUIRING;
         it->second.retry = false;
+        it->second.granted = false;
         it->second.xid = xid;
         xid++;
         lck.unlock();
-        ret = rsmc->call(lock_protocol::acquire, lid, id, it->second.xid, r);
+        ret = group(lid)->call(lock_protocol::acquire, lid, id, it->second.xid, r);
         lck.lock();
 
         // 成功获得锁
         if(ret == lock_protocol::OK)
         {
           it->second.state = LOCKED;
+          it->second.users--;
           return ret;
         }
         // 否则挂起在retryQueue
         else if(ret == lock_protocol::RETRY)
         {
-          if(!it->second.retry)
+          // retryQueue 是所有锁共用的, 被别的锁的 retry 叫醒时要接着等
+          auto deadline = std::chrono::system_clock::now() + std::chrono::seconds(3);
+          if(!retryQueue.wait_until(lck, deadline, [&] { return it->second.retry || it->second.granted; }))
           {
-            auto now = std::chrono::system_clock::now();
-            if(retryQueue.wait_until(lck, now + std::chrono::seconds(3)) == std::cv_status::timeout)
-            {
-              it->second.retry = true;
-            }
+            it->second.retry = true;
           }
         }
         break;
 
       case FREE:
         it->second.state = LOCKED;
+        it->second.users--;
         return ret;
         break;
 
@@ -136,6 +294,14 @@ lock_client_cache_rsm::acquire(lock_protocol::lockid_t lid)
         break;
       
       case ACQUIRING:
+        // release 时服务器直接把锁给了我们
+        if(it->second.granted)
+        {
+          it->second.granted = false;
+          it->second.state = LOCKED;
+          it->second.users--;
+          return lock_protocol::OK;
+        }
         if(!it->second.retry)
         {
           waitQueue.wait(lck);
@@ -147,23 +313,22 @@ lock_client_cache_rsm::acquire(lock_protocol::lockid_t lid)
           xid++;
 
           lck.unlock();
-          ret = rsmc->call(lock_protocol::acquire, lid, id, it->second.xid, r);
+          ret = group(lid)->call(lock_protocol::acquire, lid, id, it->second.xid, r);
           lck.lock();
 
           if(ret == lock_protocol::OK)
           {
             it->second.state = LOCKED;
+            it->second.users--;
             return ret;
           }
           else if(ret == lock_protocol::RETRY)
           {
-            if(!it->second.retry)
+            // retryQueue 是所有锁共用的, 被别的锁的 retry 叫醒时要接着等
+            auto deadline = std::chrono::system_clock::now() + std::chrono::seconds(3);
+            if(!retryQueue.wait_until(lck, deadline, [&] { return it->second.retry || it->second.granted; }))
             {
-              auto now = std::chrono::system_clock::now();
-              if(retryQueue.wait_until(lck, now + std::chrono::seconds(3)) == std::cv_status::timeout)
-              {
-                it->second.retry = true;
-              }
+              it->second.retry = true;
             }
           }
         }
@@ -177,6 +342,117 @@ lock_client_cache_rsm::acquire(lock_protocol::lockid_t lid)
   return ret;
 }
 
+lock_protocol::status
+lock_client_cache_rsm::stat(lock_protocol::lockid_t lid)
+{
+  int r;
+  lock_protocol::status ret = group(lid)->read(lock_protocol::stat, lid, r);
+  VERIFY (ret == lock_protocol::OK);
+  return r;
+}
+
+// 按 lid 从小到大拿，所有客户端都这样就不会互相死锁。本地没有缓存、
+// 又属于同一组的连续几把锁用一次 acquire_many 要，服务器给出前面能给的
+// 那些；第一把没给的照常 acquire 等它，然后继续往后拿
+lock_protocol::status
+lock_client_cache_rsm::acquire_many(std::vector<lock_protocol::lockid_t> lids)
+{
+  std::sort(lids.begin(), lids.end());
+  lids.erase(std::unique(lids.begin(), lids.end()), lids.end());
+
+  size_t i = 0;
+  while(i < lids.size())
+  {
+    std::unique_lock<std::mutex> lck(m_mutex);
+    rsm_client *g = group(lids[i]);
+    std::vector<lock_protocol::lockid_t> run;
+    std::vector<lock_protocol::xid_t> xids;
+    for(size_t j = i; j < lids.size() && run.size() < max_batch && group(lids[j]) == g; j++)
+    {
+      auto it = m_lockMap.find(lids[j]);
+      if(it == m_lockMap.end())
+      {
+        it = m_lockMap.insert(std::make_pair(lids[j], lock_entry())).first;
+      }
+      else if(it->second.state != NONE)
+      {
+        break;
+      }
+      it->second.state = ACQUIRING;
+      it->second.retry = false;
+      it->second.xid = xid;
+      xid++;
+      run.push_back(lids[j]);
+      xids.push_back(it->second.xid);
+    }
+
+    size_t granted = 0;
+    if(!run.empty())
+    {
+      lck.unlock();
+      int r = 0;
+      if(g->call(lock_protocol::acquire_many, run, id, xids, r) == lock_protocol::OK)
+      {
+        granted = r;
+      }
+      lck.lock();
+
+      for(size_t k = 0; k < run.size(); k++)
+      {
+        auto it = m_lockMap.find(run[k]);
+        VERIFY(it != m_lockMap.end());
+        it->second.state = k < granted ? LOCKED : NONE;
+        forget(it);
+      }
+      waitQueue.notify_all();
+    }
+    lck.unlock();
+
+    i += granted;
+    if(granted < run.size() || run.empty())
+    {
+      // lids[i] 在本地有缓存，或者服务器上正被别人拿着
+      acquire(lids[i]);
+      i++;
+    }
+  }
+  return lock_protocol::OK;
+}
+
+// 被 revoke 过的锁按组攒起来一次还给服务器，其余的留在本地缓存
+lock_protocol::status
+lock_client_cache_rsm::release_many(std::vector<lock_protocol::lockid_t> lids)
+{
+  lock_protocol::status ret = lock_protocol::OK;
+  batches b;
+
+  std::unique_lock<std::mutex> lck(m_mutex);
+  for(auto lid : lids)
+  {
+    auto it = m_lockMap.find(lid);
+    if(it == m_lockMap.end())
+    {
+      ret = lock_protocol::NOENT;
+      continue;
+    }
+    if(it->second.revoked)
+    {
+      it->second.state = RELEASING;
+      it->second.revoked = false;
+      b[group(lid)].push_back(release_entry(lid, it->second.xid));
+    }
+    else
+    {
+      make_free(it);
+    }
+  }
+  waitQueue.notify_all();
+  lck.unlock();
+
+  lock_protocol::status r = release_groups(b);
+  return ret == lock_protocol::OK ? r : ret;
+}
+
 lock_protocol::status
 lock_client_cache_rsm::release(lock_protocol::lockid_t lid)
 {
@@ -203,16 +479,25 @@ lock_client_cache_rsm::release(lock_protocol::lockid_t lid)
     {
       lu->dorelease(lid);
     }
-    ret = rsmc->call(lock_protocol::release, lid, id, cur_xid, r);
+    ret = group(lid)->call(lock_protocol::release, lid, id, cur_xid, r);
     lck.lock();
 
-    it->second.state = NONE;
+    if(ret == lock_protocol::OK)
+    {
+      it->second.state = NONE;
+      releaseQueue.notify_all();
+      waitQueue.notify_all();
+      forget(it);
+      return ret;
+    }
+    // 服务器没有收下, 锁还是我们的
+    make_free(it);
     releaseQueue.notify_all();
     waitQueue.notify_all();
   }
   else
   {
-    it->second.state = FREE;
+    make_free(it);
     waitQueue.notify_one();
   }
   return ret;
@@ -235,10 +520,18 @@ lock_client_cache_rsm::revoke_handler(lock_protocol::lockid_t lid,
     return lock_protocol::NOENT;
   }
 
+  // 服务器会重发 revoke, 也会把 grant 和 revoke 一起发出, 晚到的 revoke
+  // 可能针对的是已经还掉的那次持有, 不能拿它去还现在这次. 还有人在等的话,
+  // 等的人超时重新来要时服务器会带着新的 xid 再发
+  if (xid < it->second.xid)
+  {
+    return ret;
+  }
+
   if (it->second.state == FREE)
   {
     it->second.state = RELEASING;
-    releaseFifo.enq(release_entry(lid, xid));
+    releaseFifo.enq(release_entry(lid, it->second.xid));
   }
   else
   {
@@ -247,6 +540,45 @@ lock_client_cache_rsm::revoke_handler(lock_protocol::lockid_t lid,
   return ret;
 }
 
+// 服务器把同一客户端的多个 revoke 合在一起发来，releaser 会把它们
+// 一起取出来，用一次 release_many 还回去
+rlock_protocol::status
+lock_client_cache_rsm::revoke_many_handler(std::vector<lock_protocol::lockid_t> lids,
+                                           std::vector<lock_protocol::xid_t> xids, int &r)
+{
+  if(lids.size() != xids.size())
+  {
+    return rlock_protocol::RPCERR;
+  }
+  for(size_t i = 0; i < lids.size(); i++)
+  {
+    revoke_handler(lids[i], xids[i], r);
+  }
+  return rlock_protocol::OK;
+}
+
+// 只认这次 acquire 的 grant; 超时后已经换了新 xid 重新要, 旧的 grant 就不用管了,
+// 服务器那边会把新 xid 当作持有者的重复请求
+rlock_protocol::status
+lock_client_cache_rsm::grant_handler(lock_protocol::lockid_t lid,
+                                     lock_protocol::xid_t xid, int &)
+{
+  std::unique_lock<std::mutex> lck(m_mutex);
+
+  auto it = m_lockMap.find(lid);
+  if (it == m_lockMap.end())
+  {
+    return lock_protocol::NOENT;
+  }
+
+  if (it->second.state == ACQUIRING && it->second.xid == xid)
+  {
+    it->second.granted = true;
+    retryQueue.notify_all();
+  }
+  return rlock_protocol::OK;
+}
+
 rlock_protocol::status
 lock_client_cache_rsm::retry_handler(lock_protocol::lockid_t lid,
                                      lock_protocol::xid_t xid, int &)
@@ -262,6 +594,6 @@ lock_client_cache_rsm::retry_handler(lock_protocol::lockid_t lid,
   }
 
   it->second.retry = true;
-  retryQueue.notify_one();
+  retryQueue.notify_all();
   return ret;
 }
@@ -5,6 +5,9 @@
 #define lock_client_cache_rsm_h
 
 #include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
 #include "lock_protocol.h"
 #include "rpc.h"
 #include "lock_client.h"
@@ -29,7 +32,9 @@ class lock_client_cache_rsm;
 // lock_revoke_server.
 class lock_client_cache_rsm : public lock_client {
  private:
-  rsm_client *rsmc;
+  // 每个rsm组一个rsm_client，组i负责哈希值落在第i段的锁
+  std::vector<rsm_client *> groups;
+  rsm_client *group(lock_protocol::lockid_t lid);
   class lock_release_user *lu;
   int rlock_port;
   std::string hostname;
@@ -59,10 +64,16 @@ class lock_client_cache_rsm : public lock_client {
     bool revoked;
     // 记录是否收到retryRPC
     bool retry;
+    // 记录是否收到grantRPC: 服务器已经把锁交给了这次acquire
+    bool granted;
     lock_state state;
     lock_protocol::xid_t xid;
+    // 正在 acquire 里用这个表项的线程数，为 0 且 NONE 时才能删掉
+    int users;
+    // 最近一次变成 FREE 的时间
+    std::chrono::steady_clock::time_point used;
 
-    lock_entry() : revoked(false), retry(false), state(NONE), xid(0)
+    lock_entry() : revoked(false), retry(false), granted(false), state(NONE), xid(0), users(0)
     {
     }
   };
@@ -70,21 +81,47 @@ class lock_client_cache_rsm : public lock_client {
   std::map<lock_protocol::lockid_t, lock_entry> m_lockMap;
   std::mutex m_mutex;
 
+  // FREE 超过 idle 的锁由 expirer 主动还给服务器，0 表示不过期
+  std::chrono::milliseconds idle;
+  // 按变成 FREE 的先后排列；表项之后又被用过的，时间对不上，跳过即可
+  std::deque<std::pair<lock_protocol::lockid_t,
+                       std::chrono::steady_clock::time_point> > idleList;
+  void forget(std::map<lock_protocol::lockid_t, lock_entry>::iterator it);
+  void make_free(std::map<lock_protocol::lockid_t, lock_entry>::iterator it);
+  // 用一次 release_many 归还同一组的一批锁
+  enum { max_batch = 512 };
+  lock_protocol::status release_batch(rsm_client *, const std::vector<release_entry> &);
+  // 每组的锁按 max_batch 分批归还
+  typedef std::map<rsm_client *, std::vector<release_entry> > batches;
+  lock_protocol::status release_groups(batches &);
+
   std::condition_variable waitQueue;
   std::condition_variable releaseQueue;
   std::condition_variable retryQueue;
 
  public:
   static int last_port;
+  // xdst可以是逗号分隔的多个rsm组，每组给出任意一个副本的[host:]port。
+  // 锁按id的哈希值分段分给各组，所有客户端要按相同的顺序列出同一组服务器
   lock_client_cache_rsm(std::string xdst, class lock_release_user *l = 0);
   virtual ~lock_client_cache_rsm() {};
   lock_protocol::status acquire(lock_protocol::lockid_t);
   virtual lock_protocol::status release(lock_protocol::lockid_t);
+  // 一次拿多把锁，内部按 lid 排序，不会和别的客户端死锁
+  lock_protocol::status acquire_many(std::vector<lock_protocol::lockid_t>);
+  lock_protocol::status release_many(std::vector<lock_protocol::lockid_t>);
+  // 只读，由持有租约的主服务器直接回答，不走复制
+  lock_protocol::status stat(lock_protocol::lockid_t);
   void releaser();
+  void expirer();
   rlock_protocol::status revoke_handler(lock_protocol::lockid_t, 
 				        lock_protocol::xid_t, int &);
+  rlock_protocol::status revoke_many_handler(std::vector<lock_protocol::lockid_t>,
+                                             std::vector<lock_protocol::xid_t>, int &);
   rlock_protocol::status retry_handler(lock_protocol::lockid_t, 
 				       lock_protocol::xid_t, int &);
+  rlock_protocol::status grant_handler(lock_protocol::lockid_t,
+                                       lock_protocol::xid_t, int &);
 };
 
 
@@ -17,7 +17,9 @@ class lock_protocol {
   enum rpc_numbers {
     acquire = 0x7001,
     release,
-    stat
+    stat,
+    release_many,
+    acquire_many
   };
 };
 
@@ -42,7 +44,9 @@ class rlock_protocol {
   typedef int status;
   enum rpc_numbers {
     revoke = 0x8001,
-    retry = 0x8002
+    retry = 0x8002,
+    revoke_many = 0x8003,
+    grant = 0x8004
   };
 };
 
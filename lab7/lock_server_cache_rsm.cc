@@ -3,9 +3,11 @@
 #include "lock_server_cache_rsm.h"
 #include <sstream>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include "lang/verify.h"
+#include "lang/hash.h"
 #include "handle.h"
 #include "tprintf.h"
 
@@ -29,13 +31,46 @@ retrythread(void *x)
 lock_server_cache_rsm::lock_server_cache_rsm(class rsm *_rsm) 
   : rsm (_rsm)
 {
+  char *grant_env = getenv("LOCK_DIRECT_GRANT");
+  direct_grant = grant_env == NULL || atoi(grant_env) != 0;
+
   pthread_t th;
   int r = pthread_create(&th, NULL, &revokethread, (void *) this);
   VERIFY (r == 0);
   r = pthread_create(&th, NULL, &retrythread, (void *) this);
   VERIFY (r == 0);
 
-  rsm->set_state_transfer(this);
+  // 没有 rsm 时(STEP_ONE 或 -bench)就是单机服务器
+  if (rsm)
+    rsm->set_state_transfer(this);
+}
+
+lock_server_cache_rsm::shard &
+lock_server_cache_rsm::shard_of(lock_protocol::lockid_t lid)
+{
+  // 用低位选分片, 客户端选组用的是高位
+  return m_shards[mix64(lid) % nshards];
+}
+
+// 编号按第一次出现的顺序分配; 各副本以相同顺序执行请求, 所以编号一致
+lock_server_cache_rsm::client_t
+lock_server_cache_rsm::intern(const std::string &id)
+{
+  std::lock_guard<std::mutex> lg(m_clients_mutex);
+  auto it = m_client_ids.find(id);
+  if (it != m_client_ids.end())
+    return it->second;
+  client_t cid = m_clients.size();
+  m_clients.push_back(id);
+  m_client_ids[id] = cid;
+  return cid;
+}
+
+std::string
+lock_server_cache_rsm::client_name(client_t cid)
+{
+  std::lock_guard<std::mutex> lg(m_clients_mutex);
+  return cid < m_clients.size() ? m_clients[cid] : "";
 }
 
 void
@@ -50,11 +85,35 @@ lock_server_cache_rsm::revoker()
     revoke_retry_entry e;
     revokeQueue.deq(&e);
 
-    if (rsm->amiprimary())
+    // 队列里已经有的一起取出来, 同一客户端的合成一次 revoke_many
+    std::map<client_t, std::vector<revoke_retry_entry> > batches;
+    do
+    {
+      batches[e.cid].push_back(e);
+    } while (revokeQueue.deq(&e, false));
+
+    if (rsm && !rsm->amiprimary())
+      continue;
+    for (auto &b : batches)
     {
       int r;
-      rpcc *cl = handle(e.id).safebind();
-      cl->call(rlock_protocol::revoke, e.lid, e.xid, r);
+      rpcc *cl = handle(client_name(b.first)).safebind();
+      // 客户端可能已经退出
+      if (!cl)
+        continue;
+      if (b.second.size() == 1)
+      {
+        cl->call(rlock_protocol::revoke, b.second[0].lid, b.second[0].xid, r);
+        continue;
+      }
+      std::vector<lock_protocol::lockid_t> lids;
+      std::vector<lock_protocol::xid_t> xids;
+      for (auto &x : b.second)
+      {
+        lids.push_back(x.lid);
+        xids.push_back(x.xid);
+      }
+      cl->call(rlock_protocol::revoke_many, lids, xids, r);
     }
   }
 }
@@ -66,17 +125,20 @@ lock_server_cache_rsm::retryer()
 
   // This method should be a continuous loop, waiting for locks
   // to be released and then sending retry messages to those who
-  // are waiting for it.
+  // are waiting for it.  With direct_grant the message is a grant.
   while (true)
   {
     revoke_retry_entry e;
     retryQueue.deq(&e);
 
-    if (rsm->amiprimary())
+    if (!rsm || rsm->amiprimary())
     {
       int r;
-      rpcc *cl = handle(e.id).safebind();
-      cl->call(rlock_protocol::retry, e.lid, e.xid, r);
+      rpcc *cl = handle(client_name(e.cid)).safebind();
+      // 客户端可能已经退出
+      if (cl)
+        cl->call(e.grant ? rlock_protocol::grant : rlock_protocol::retry,
+                 e.lid, e.xid, r);
     }
   }
 }
@@ -86,67 +148,70 @@ int lock_server_cache_rsm::acquire(lock_protocol::lockid_t lid, std::string id,
              lock_protocol::xid_t xid, int &)
 {
   lock_protocol::status ret = lock_protocol::OK;
-  std::lock_guard<std::mutex> lg(m_mutex);
-  auto it = m_lockMap.find(lid);
-  if (it == m_lockMap.end())
-  {
-    it = m_lockMap.insert(std::make_pair(lid, lock_entry())).first;
-  }
-
-  lock_entry &le = it->second;
-  auto xid_it = le.highest_xid_from_client.find(id);
-
-  if (xid_it == le.highest_xid_from_client.end() || xid_it->second < xid)
+  client_t cid = intern(id);
+  shard &sh = shard_of(lid);
+  std::lock_guard<std::mutex> lg(sh.m);
+  lock_entry &le = sh.locks[lid];
+
+  // 重复的请求: 按它现在所处的位置回复
+  if (le.owner == cid && le.owner_xid >= xid)
+    return lock_protocol::OK;
+  auto w = le.waiters.begin();
+  for (; w != le.waiters.end() && w->cid != cid; ++w)
+    ;
+  if (w != le.waiters.end() && w->xid >= xid)
+    return lock_protocol::RETRY;
+
+  switch (le.state)
   {
-
-    le.highest_xid_from_client[id] = xid;
-    le.highest_xid_release_reply.erase(id);
-
-    switch (it->second.state)
+  case FREE:
+    le.state = LOCKED;
+    le.owner = cid;
+    le.owner_xid = xid;
+    break;
+
+  case LOCKED:
+  case LOCKED_AND_WAIT:
+    if (le.owner == cid)
     {
-    case FREE:
-      it->second.state = LOCKED;
-      it->second.owner = id;
+      // 持有者用新的 xid 再要一次, 说明它没收到上次的回复
+      le.owner_xid = xid;
       break;
-
-    case LOCKED:
-      it->second.state = LOCKED_AND_WAIT;
-      it->second.waitSet.insert(id);
-      revokeQueue.enq(revoke_retry_entry(it->second.owner, lid, le.highest_xid_from_client[it->second.owner]));
-      ret = lock_protocol::RETRY;
-      break;
-
-    case LOCKED_AND_WAIT:
-      it->second.waitSet.insert(id);
-      revokeQueue.enq(revoke_retry_entry(it->second.owner, lid, le.highest_xid_from_client[it->second.owner]));
-      ret = lock_protocol::RETRY;
-      break;
-
-    case RETRYING:
-      if (it->second.waitSet.count(id))
+    }
+    // 每把锁同时只有一个 revoke 在路上: 第一个等待者来时发, 之后来的只排队.
+    // 已经在排队的客户端超时后又来要, 说明 revoke 可能丢了(比如换了主), 再发一次
+    if (le.state == LOCKED || w != le.waiters.end())
+      revokeQueue.enq(revoke_retry_entry(le.owner, lid, le.owner_xid));
+    if (w == le.waiters.end())
+      le.waiters.push_back(waiter{cid, xid});
+    else
+      w->xid = xid;
+    le.state = LOCKED_AND_WAIT;
+    ret = lock_protocol::RETRY;
+    break;
+
+  case RETRYING:
+    // retry 发给了排在最前面的等待者, 新来的排到队尾. 别的等待者只有在
+    // 等了 3 秒超时后才会再来要, 那时给它, 免得一个退出了的客户端卡住整个队列
+    if (w != le.waiters.end())
+    {
+      le.waiters.erase(w);
+      le.owner = cid;
+      le.owner_xid = xid;
+      if (le.waiters.size())
       {
-        it->second.waitSet.erase(id);
-        it->second.owner = id;
-        if (it->second.waitSet.size())
-        {
-          it->second.state = LOCKED_AND_WAIT;
-          revokeQueue.enq(revoke_retry_entry(it->second.owner, lid, le.highest_xid_from_client[it->second.owner]));
-        }
-        else
-          it->second.state = LOCKED;
+        le.state = LOCKED_AND_WAIT;
+        revokeQueue.enq(revoke_retry_entry(le.owner, lid, le.owner_xid));
       }
       else
-      {
-        it->second.waitSet.insert(id);
-        ret = lock_protocol::RETRY;
-      }
-      break;
+        le.state = LOCKED;
     }
-    le.highest_xid_acquire_reply[id] = ret;
-  }
-  else if (xid_it->second == xid)
-  {
-    ret = le.highest_xid_acquire_reply[id];
+    else
+    {
+      le.waiters.push_back(waiter{cid, xid});
+      ret = lock_protocol::RETRY;
+    }
+    break;
   }
 
   return ret;
@@ -156,185 +221,251 @@ int
 lock_server_cache_rsm::release(lock_protocol::lockid_t lid, std::string id, 
          lock_protocol::xid_t xid, int &r)
 {
-  std::string client_need_retry;
-  lock_protocol::status ret = lock_protocol::OK;
-  std::lock_guard<std::mutex> lg(m_mutex);
-  auto it = m_lockMap.find(lid);
-  if (it == m_lockMap.end())
+  client_t cid = intern(id);
+  shard &sh = shard_of(lid);
+  std::lock_guard<std::mutex> lg(sh.m);
+  auto it = sh.locks.find(lid);
+  // 没有表项说明锁空闲且没人等, 表项已被回收: 这是已经执行过的重复 release
+  if (it == sh.locks.end())
   {
-    return lock_protocol::NOENT;
+    return lock_protocol::OK;
   }
 
   lock_entry &le = it->second;
 
-  auto xid_it = le.highest_xid_from_client.find(id);
-  if (xid_it != le.highest_xid_from_client.end() && xid == xid_it->second)
+  if (le.owner != cid)
   {
+    // 已经执行过的重复 release
+    return lock_protocol::OK;
+  }
+  if (le.owner_xid != xid)
+  {
+    return lock_protocol::RPCERR;
+  }
 
-    auto reply_it = le.highest_xid_release_reply.find(id);
-
-    if (reply_it == le.highest_xid_release_reply.end())
+  if (le.waiters.empty())
+  {
+    // 空闲且没有等待者的锁不必留着, 下次 acquire 时再建
+    sh.locks.erase(it);
+  }
+  else if (direct_grant)
+  {
+    // 锁直接归排在最前面的等待者, 它的 xid 就是那次 acquire 的
+    waiter next = le.waiters.front();
+    le.waiters.erase(le.waiters.begin());
+    le.owner = next.cid;
+    le.owner_xid = next.xid;
+    retryQueue.enq(revoke_retry_entry(next.cid, lid, next.xid, true));
+    if (le.waiters.empty())
     {
-
-      if (it->second.owner != id)
-      {
-        ret = lock_protocol::IOERR;
-        le.highest_xid_release_reply.insert(make_pair(id, ret));
-      }
-      switch (it->second.state)
-      {
-      case FREE:
-        ret = lock_protocol::IOERR;
-        break;
-
-      case LOCKED:
-        it->second.state = FREE;
-        it->second.owner = "";
-        break;
-
-      case LOCKED_AND_WAIT:
-        it->second.state = RETRYING;
-        it->second.owner = "";
-        client_need_retry = *it->second.waitSet.begin();
-        retryQueue.enq(revoke_retry_entry(client_need_retry, lid, le.highest_xid_from_client[client_need_retry]));
-        break;
-
-      case RETRYING:
-        ret = lock_protocol::IOERR;
-        break;
-      }
-      le.highest_xid_release_reply.insert(make_pair(id, ret));
+      le.state = LOCKED;
     }
     else
     {
-      ret = reply_it->second;
+      le.state = LOCKED_AND_WAIT;
+      revokeQueue.enq(revoke_retry_entry(le.owner, lid, le.owner_xid));
     }
   }
   else
   {
-    ret = lock_protocol::RPCERR;
+    le.owner = nobody;
+    le.owner_xid = 0;
+    le.state = RETRYING;
+    const waiter &next = le.waiters.front();
+    retryQueue.enq(revoke_retry_entry(next.cid, lid, next.xid));
   }
 
-  return ret;
+  return lock_protocol::OK;
 }
 
-std::string
-lock_server_cache_rsm::marshal_state()
+// 一次要多把锁, lids 必须从小到大排好. 按这个顺序给, 遇到第一把给不了的
+// 就停, r 是给出去的个数: 客户端拿着前面的锁单独去等那一把, 大家都按 lid
+// 顺序拿锁就不会死锁. 没有加入等待的请求不留任何状态, 重做一遍结果不变
+int
+lock_server_cache_rsm::acquire_many(std::vector<lock_protocol::lockid_t> lids,
+         std::string id, std::vector<lock_protocol::xid_t> xids, int &r)
 {
-  std::ostringstream ost;
-  std::string r;
+  if (lids.size() != xids.size())
+  {
+    return lock_protocol::RPCERR;
+  }
+  for (size_t i = 1; i < lids.size(); i++)
+  {
+    if (lids[i - 1] >= lids[i])
+      return lock_protocol::RPCERR;
+  }
 
-  std::lock_guard<std::mutex> lg(m_mutex);
-  marshall m;
-  unsigned int size = m_lockMap.size();
-  m << size;
-  for(auto it = m_lockMap.begin(); it != m_lockMap.end(); ++it)
+  client_t cid = intern(id);
+  size_t n = 0;
+  for (; n < lids.size(); n++)
   {
-    m << it->first;
-    m << static_cast<unsigned int>(it->second.state);
-    m << it->second.owner;
-    m << it->second.revoked;
-
-    size = it->second.waitSet.size();
-    m << size;
-    for(auto it_set = it->second.waitSet.begin(); it_set != it->second.waitSet.end(); ++it_set)
+    shard &sh = shard_of(lids[n]);
+    std::lock_guard<std::mutex> lg(sh.m);
+    auto it = sh.locks.find(lids[n]);
+    if (it == sh.locks.end())
     {
-      m << *it_set;
+      lock_entry &le = sh.locks[lids[n]];
+      le.state = LOCKED;
+      le.owner = cid;
+      le.owner_xid = xids[n];
     }
-
-    size = it->second.highest_xid_from_client.size();
-    m << size;
-    for(auto it_client = it->second.highest_xid_from_client.begin();
-          it_client != it->second.highest_xid_from_client.end(); ++it_client)
+    else if (!(it->second.owner == cid && it->second.owner_xid >= xids[n]))
     {
-      m << it_client->first;
-      m << it_client->second;
+      // 不是重复的请求, 锁又不空闲
+      break;
     }
+  }
+  r = n;
 
-    size = it->second.highest_xid_acquire_reply.size();
-    m << size;
-    for(auto it_acquire = it->second.highest_xid_acquire_reply.begin();
-          it_acquire != it->second.highest_xid_acquire_reply.end(); ++it_acquire)
-    {
-      m << it_acquire->first;
-      m << it_acquire->second;
-    }
+  // 剩下的锁里被别人缓存着的先 revoke 掉, 持有者会把它们攒成一批还回来,
+  // 客户端之后再要时多半已经空闲
+  for (size_t i = n; i < lids.size(); i++)
+  {
+    shard &sh = shard_of(lids[i]);
+    std::lock_guard<std::mutex> lg(sh.m);
+    auto it = sh.locks.find(lids[i]);
+    if (it != sh.locks.end() && it->second.state == LOCKED && it->second.owner != cid)
+      revokeQueue.enq(revoke_retry_entry(it->second.owner, lids[i], it->second.owner_xid));
+  }
+  return lock_protocol::OK;
+}
+
+// 客户端一次归还多把空闲的锁, 逐个按 release 处理; r 是每把锁的结果,
+// 没还成的客户端要继续当作自己的
+int
+lock_server_cache_rsm::release_many(std::vector<lock_protocol::lockid_t> lids,
+         std::string id, std::vector<lock_protocol::xid_t> xids,
+         std::vector<int> &r)
+{
+  if (lids.size() != xids.size())
+  {
+    return lock_protocol::RPCERR;
+  }
+  r.assign(lids.size(), lock_protocol::OK);
+  for (size_t i = 0; i < lids.size(); i++)
+  {
+    int r1;
+    r[i] = release(lids[i], id, xids[i], r1);
+  }
+  return lock_protocol::OK;
+}
 
-    size = it->second.highest_xid_release_reply.size();
-    m << size;
-    for(auto it_release = it->second.highest_xid_release_reply.begin();
-          it_release != it->second.highest_xid_release_reply.end(); ++it_release)
+std::string
+lock_server_cache_rsm::marshal_state()
+{
+  std::string state;
+  unsigned long long cursor = 0;
+  bool done = false;
+  while (!done)
+  {
+    state += marshal_state_chunk(cursor, (size_t)-1, cursor, done);
+  }
+  return state;
+}
+
+void
+lock_server_cache_rsm::unmarshal_state(std::string state)
+{
+  // 从 state 恢复整张锁表, 旧表作废
+  begin_unmarshal_state();
+  unmarshal_state_chunk(state);
+  end_unmarshal_state();
+}
+
+// 块的格式: 客户端编号表, 然后若干个(分片号, 锁的个数, (lid, lock_entry)...)，
+// cursor 是下一个分片号
+std::string
+lock_server_cache_rsm::marshal_state_chunk(unsigned long long cursor, size_t max_bytes,
+                                           unsigned long long &next, bool &done)
+{
+  marshall m;
+  {
+    std::lock_guard<std::mutex> lg(m_clients_mutex);
+    m << m_clients;
+  }
+  size_t start = m.size();
+  unsigned s = cursor;
+  for (; s < nshards; s++)
+  {
+    if (s > cursor && m.size() - start >= max_bytes)
+      break;
+    std::lock_guard<std::mutex> lg(m_shards[s].m);
+    m << s;
+    m << (unsigned int) m_shards[s].locks.size();
+    for (auto &it : m_shards[s].locks)
     {
-      m << it_release->first;
-      m << it_release->second;
+      m << it.first;
+      m << it.second;
     }
   }
-  r = m.str();
-
+  done = s == nshards;
+  next = done ? 0 : s;
+  return m.str();
+}
 
-  return r;
+void
+lock_server_cache_rsm::begin_unmarshal_state()
+{
+  std::lock_guard<std::mutex> lg(m_clients_mutex);
+  m_staging.assign(nshards, lock_table());
+  m_staging_clients.clear();
 }
 
 void
-lock_server_cache_rsm::unmarshal_state(std::string state)
+lock_server_cache_rsm::unmarshal_state_chunk(std::string chunk)
 {
-  std::lock_guard<std::mutex> lg(m_mutex);
-  
-  unmarshall m;
-  unsigned int size;
-  m >> size;
-  for(auto it = m_lockMap.begin(); it != m_lockMap.end(); ++it)
+  std::lock_guard<std::mutex> lg(m_clients_mutex);
+  unmarshall u(chunk);
+  // 编号表只会变长, 后面的块带的是完整的表
+  u >> m_staging_clients;
+  while (u.ok() && !u.okdone())
   {
-    lock_protocol::lockid_t lid;
-    m >> lid;
-    lock_entry *entry = new lock_entry();
-    unsigned int state;
-    m >> state;
-    entry->state = static_cast<lock_state>(state);
-    m >> entry->owner;
-    m >> entry->revoked;
-
-    unsigned int waitSet_size;
-    m >> waitSet_size; 
-    std::string waitid;
-    for(unsigned int i = 0; i < waitSet_size; ++i)
+    unsigned s, n;
+    u >> s;
+    u >> n;
+    if (s >= nshards)
+      break;
+    lock_table &t = m_staging[s];
+    t.reserve(t.size() + n);
+    for (unsigned i = 0; i < n && u.ok(); i++)
     {
-      m >> waitid;
-      entry->waitSet.insert(waitid);
+      lock_protocol::lockid_t lid;
+      u >> lid;
+      u >> t[lid];
     }
+  }
+}
 
-    unsigned int xid_size;
-    m >> xid_size;
-		std::string client_id;
-		lock_protocol::xid_t xid;
-		for (unsigned int i = 0; i < xid_size; i++) {
-			m >> client_id;
-			m >> xid;
-		   	entry->highest_xid_from_client[client_id] = xid;
-		}
-		unsigned int reply_size;
-		m >> reply_size;
-		int ret;
-		for (unsigned int i = 0; i < reply_size; i++) {
-			m >> client_id;
-			m >> ret;
-			entry->highest_xid_acquire_reply[client_id] = ret; 
-		}
-		m >> reply_size;
-		for (unsigned int i = 0; i < reply_size; i++) {
-			m >> client_id;
-			m >> ret;
-			entry->highest_xid_release_reply[client_id] = ret;
-		}
-		m_lockMap[lid] = *entry;
+void
+lock_server_cache_rsm::end_unmarshal_state()
+{
+  std::lock_guard<std::mutex> lg(m_clients_mutex);
+  for (unsigned s = 0; s < nshards; s++)
+  {
+    std::lock_guard<std::mutex> slg(m_shards[s].m);
+    m_shards[s].locks.swap(m_staging[s]);
   }
+  m_staging.clear();
+  m_clients.swap(m_staging_clients);
+  m_staging_clients.clear();
+  m_client_ids.clear();
+  for (client_t cid = 0; cid < m_clients.size(); cid++)
+    m_client_ids[m_clients[cid]] = cid;
 }
 
+// r 是持有和等待这把锁的客户端数, 锁空闲时为 0. 只读, 不经过复制
 lock_protocol::status
 lock_server_cache_rsm::stat(lock_protocol::lockid_t lid, int &r)
 {
-  printf("stat request\n");
-  r = nacquire;
+  shard &sh = shard_of(lid);
+  std::lock_guard<std::mutex> lg(sh.m);
+  auto it = sh.locks.find(lid);
+  r = 0;
+  if (it != sh.locks.end())
+  {
+    const lock_entry &le = it->second;
+    r = (le.owner != nobody) + le.waiters.size();
+  }
   return lock_protocol::OK;
 }
 
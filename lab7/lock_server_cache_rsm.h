@@ -2,7 +2,8 @@
 #define lock_server_cache_rsm_h
 
 #include <string>
-#include <set>
+#include <vector>
+#include <unordered_map>
 #include <mutex>
 
 #include "lock_protocol.h"
@@ -15,38 +16,77 @@ class lock_server_cache_rsm : public rsm_state_transfer
 {
   private:
     class rsm *rsm;
-    int nacquire;
 
-    enum lock_state {
+    enum lock_state : unsigned char {
         FREE,
         LOCKED,
         LOCKED_AND_WAIT,
         RETRYING
     };
 
+    // 客户端 id 字符串只存一份, 锁表里只放它的编号
+    typedef unsigned int client_t;
+    static const client_t nobody = ~0u;
+
+    // 每个客户端对一把锁同一时刻只有一个请求, 重复的请求只可能是
+    // 刚执行过的那个: 只要记住持有者和等待者各自的 xid, 回复就能从
+    // 它所在的位置推出来, 不必为每个客户端保存历史
+    struct waiter {
+        client_t cid;
+        lock_protocol::xid_t xid;
+
+        RPC_FIELDS(cid, xid)
+    };
+
+    // waiters 按到达顺序排队, 锁空出来时 retry 发给最前面的那个
     struct lock_entry {
         lock_state state;
-        std::string owner;
-        bool revoked;
-        std::set<std::string> waitSet;
+        client_t owner;
+        lock_protocol::xid_t owner_xid;
+        std::vector<waiter> waiters;
 
-        std::map<std::string, lock_protocol::xid_t> highest_xid_from_client;
-        std::map<std::string, int> highest_xid_acquire_reply;
-        std::map<std::string, int> highest_xid_release_reply;
+        lock_entry() : state(FREE), owner(nobody), owner_xid(0) {}
 
-        lock_entry() : state(FREE), revoked(false) {}
+        // 状态传输时的编码顺序
+        RPC_FIELDS(state, owner, owner_xid, waiters)
     };
 
-    std::map<lock_protocol::lockid_t, lock_entry> m_lockMap;
-    std::mutex m_mutex;
+    typedef std::unordered_map<lock_protocol::lockid_t, lock_entry> lock_table;
+
+    // 锁表按 lid 的哈希分片, 每片一把锁; 状态传输也按片分块
+    enum { nshards = 64 };
+    struct shard {
+        std::mutex m;
+        lock_table locks;
+    };
+    shard m_shards[nshards];
+    shard &shard_of(lock_protocol::lockid_t lid);
+
+    std::mutex m_clients_mutex;
+    std::unordered_map<std::string, client_t> m_client_ids;
+    std::vector<std::string> m_clients;
+    client_t intern(const std::string &id);
+    std::string client_name(client_t cid);
+
+    // 分块状态传输时暂存, end_unmarshal_state 时一起换上
+    std::vector<lock_table> m_staging;
+    std::vector<std::string> m_staging_clients;
+
+    // release 时直接把锁交给排在最前面的等待者, 回调带着授权, 省掉它再来
+    // acquire 的一次复制操作. $LOCK_DIRECT_GRANT=0 时退回 retry, 同组的
+    // 副本必须取一样的值
+    bool direct_grant;
 
     struct revoke_retry_entry {
-        std::string id;
+        client_t cid;
         lock_protocol::lockid_t lid;
         lock_protocol::xid_t xid;
+        // retryQueue 里的项: 发 grant 而不是 retry
+        bool grant;
 
-        revoke_retry_entry(const std::string& id_ = "", lock_protocol::lockid_t lid_ = 0, lock_protocol::xid_t xid_ = 0)
-                                : id(id_), lid(lid_), xid(xid_) {}
+        revoke_retry_entry(client_t cid_ = nobody, lock_protocol::lockid_t lid_ = 0,
+                           lock_protocol::xid_t xid_ = 0, bool grant_ = false)
+                                : cid(cid_), lid(lid_), xid(xid_), grant(grant_) {}
     };
 
     fifo<revoke_retry_entry> retryQueue;
@@ -59,10 +99,19 @@ class lock_server_cache_rsm : public rsm_state_transfer
     void retryer();
     std::string marshal_state();
     void unmarshal_state(std::string state);
+    std::string marshal_state_chunk(unsigned long long cursor, size_t max_bytes,
+                                    unsigned long long &next, bool &done);
+    void begin_unmarshal_state();
+    void unmarshal_state_chunk(std::string chunk);
+    void end_unmarshal_state();
     int acquire(lock_protocol::lockid_t, std::string id,
                 lock_protocol::xid_t, int &);
     int release(lock_protocol::lockid_t, std::string id, lock_protocol::xid_t,
                 int &);
+    int acquire_many(std::vector<lock_protocol::lockid_t>, std::string id,
+                     std::vector<lock_protocol::xid_t>, int &);
+    int release_many(std::vector<lock_protocol::lockid_t>, std::string id,
+                     std::vector<lock_protocol::xid_t>, std::vector<int> &);
 };
 
 #endif
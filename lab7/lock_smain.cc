@@ -4,6 +4,9 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <signal.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
 #include "lock_server_cache_rsm.h"
 #include "paxos.h"
 #include "rsm.h"
@@ -17,6 +20,72 @@ force_exit(int) {
     exit(0);
 }
 
+static double
+now_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+// resident set size, from /proc/self/statm
+static long
+rss_kb()
+{
+  long pages = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+      resident = 0;
+    fclose(f);
+  }
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// lock_server -bench nlocks nclients: drive the lock table in-process,
+// without RPC or the RSM.  Every client in turn acquires all nlocks
+// locks and then releases them.  The memory per lock and the state
+// transfer size are taken while the first client holds them all; once
+// everything is released the table should be empty again.
+static void
+bench(int nlocks, int nclients)
+{
+  // never freed: its revoker and retryer threads block on its queues
+  lock_server_cache_rsm &ls = *new lock_server_cache_rsm();
+  std::vector<std::string> ids;
+  for (int c = 0; c < nclients; c++)
+    ids.push_back("127.0.0.1:" + std::to_string(30000 + c));
+
+  long rss0 = rss_kb(), rss1 = 0;
+  double t0 = now_ms(), busy = 0, marshal_ms = 0;
+  size_t held_state = 0;
+  lock_protocol::xid_t xid = 0;
+  int r;
+  for (int c = 0; c < nclients; c++) {
+    for (int i = 0; i < nlocks; i++)
+      VERIFY(ls.acquire(i + 1, ids[c], xid + i, r) == lock_protocol::OK);
+    if (c == 0) {
+      double t = now_ms();
+      rss1 = rss_kb();
+      held_state = ls.marshal_state().size();
+      marshal_ms = now_ms() - t;
+      busy -= marshal_ms;
+    }
+    for (int i = 0; i < nlocks; i++)
+      VERIFY(ls.release(i + 1, ids[c], xid + i, r) == lock_protocol::OK);
+    xid += nlocks;
+  }
+  busy += now_ms() - t0;
+  size_t left_state = ls.marshal_state().size();
+
+  double ops = 2.0 * nlocks * nclients;
+  printf("bench: %d locks x %d clients: %.0f ops/s, %.0f bytes/lock, "
+         "state %.1f MB marshalled in %.0f ms, %lu bytes once released\n",
+         nlocks, nclients, ops * 1000 / busy,
+         (rss1 - rss0) * 1024.0 / nlocks, held_state / 1e6, marshal_ms,
+         (unsigned long) left_state);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -31,8 +100,14 @@ main(int argc, char *argv[])
 
   srandom(getpid());
 
+  if(argc == 4 && std::string(argv[1]) == "-bench"){
+    bench(atoi(argv[2]), atoi(argv[3]));
+    exit(0);
+  }
+
   if(argc != 3){
-    fprintf(stderr, "Usage: %s [master:]port [me:]port\n", argv[0]);
+    fprintf(stderr, "Usage: %s [master:]port [me:]port\n"
+            "       %s -bench nlocks nclients\n", argv[0], argv[0]);
     exit(1);
   }
 
@@ -56,14 +131,23 @@ main(int argc, char *argv[])
   lock_server_cache_rsm ls;
   server.reg(lock_protocol::acquire, &ls, &lock_server_cache_rsm::acquire);
   server.reg(lock_protocol::release, &ls, &lock_server_cache_rsm::release);
-  server.reg(lock_protocol::stat, &ls, &lock_server_cache_rsm::stat);
+  server.reg(lock_protocol::acquire_many, &ls,
+             &lock_server_cache_rsm::acquire_many);
+  server.reg(lock_protocol::release_many, &ls,
+             &lock_server_cache_rsm::release_many);
+  server.reg(lock_protocol::stat, &ls, &lock_server_cache_rsm::stat, true);
 #else
   rsm rsm(argv[1], argv[2]);
   lock_server_cache_rsm ls(&rsm);
   rsm.set_state_transfer((rsm_state_transfer *)&ls);
   rsm.reg(lock_protocol::acquire, &ls, &lock_server_cache_rsm::acquire);
   rsm.reg(lock_protocol::release, &ls, &lock_server_cache_rsm::release);
-  rsm.reg(lock_protocol::stat, &ls, &lock_server_cache_rsm::stat);
+  rsm.reg(lock_protocol::acquire_many, &ls,
+          &lock_server_cache_rsm::acquire_many);
+  rsm.reg(lock_protocol::release_many, &ls,
+          &lock_server_cache_rsm::release_many);
+  rsm.reg(lock_protocol::stat, &ls, &lock_server_cache_rsm::stat,
+          rsm::READONLY);
 #endif // STEP_ONE
 #endif // RSM
 
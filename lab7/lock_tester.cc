@@ -9,9 +9,11 @@
 #include <signal.h>
 #include <arpa/inet.h>
 #include <vector>
+#include <algorithm>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <sys/time.h>
 #include "lang/verify.h"
 #include "lock_client_cache_rsm.h"
 
@@ -145,6 +147,223 @@ test5(void *x)
   return 0;
 }
 
+static long
+now_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000L + tv.tv_usec / 1000;
+}
+
+// test 6 is a failover probe, not part of the default run: for secs
+// seconds it acquires a fresh lock every 10ms, so that every acquire
+// goes to the lock service, and logs when each returned. rsm_tester
+// kills the primary meanwhile and reads the stall off this log.
+void
+test6(int secs)
+{
+  lock_protocol::lockid_t lid = 1000;
+  long start = now_ms();
+  long prev = start;
+  long worst = 0;
+
+  printf ("test6: acquire a new lock every 10ms for %d s\n", secs);
+  while (prev - start < secs * 1000L) {
+    lc[0]->acquire(lid);
+    long t = now_ms();
+    printf ("test6: acquired %llu at %ld\n", lid, t);
+    lc[0]->release(lid);
+    if (t - prev > worst)
+      worst = t - prev;
+    prev = t;
+    lid++;
+    usleep(10000);
+  }
+  printf ("test6: %llu acquires, longest stall %ld ms\n", lid - 1000, worst);
+}
+
+// test 7 times stat, which the primary answers without replication,
+// for secs seconds from all the clients at once. Client 0 holds the
+// lock the whole time, so every stat must count exactly one holder.
+static int test7_secs;
+static long test7_stats;
+static lock_protocol::lockid_t test7_lid;
+
+void *
+test7(void *x)
+{
+  int i = * (int *) x;
+  long start = now_ms();
+  long n = 0;
+
+  while (now_ms() - start < test7_secs * 1000L) {
+    VERIFY(lc[i]->stat(test7_lid) == 1);
+    n++;
+  }
+  ScopedLock ml(&count_mutex);
+  test7_stats += n;
+  return 0;
+}
+
+// test 8 measures acquire throughput: for secs seconds every client
+// acquires and releases locks it hasn't used before, so each acquire
+// goes to the lock service. With several rsm groups in dst the locks
+// spread over them.
+static int test8_secs;
+static long test8_acquires;
+
+void *
+test8(void *x)
+{
+  int i = * (int *) x;
+  // locks of earlier runs may still be cached by clients that are gone
+  lock_protocol::lockid_t lid =
+    ((lock_protocol::lockid_t) getpid() << 32) + (i + 1) * 1000000ULL;
+  long start = now_ms();
+  long n = 0;
+
+  while (now_ms() - start < test8_secs * 1000L) {
+    lc[i]->acquire(lid);
+    lc[i]->release(lid);
+    lid++;
+    n++;
+  }
+  ScopedLock ml(&count_mutex);
+  test8_acquires += n;
+  return 0;
+}
+
+// test 9 checks idle expiry: client 0 takes test9_n locks and leaves
+// them cached, and after wait_ms client 1 takes them over. If wait_ms
+// is longer than $LOCK_IDLE_MS client 0 has given them back by then
+// and no acquire has to wait for a revoke.
+static const int test9_n = 100;
+
+void
+test9(int wait_ms)
+{
+  lock_protocol::lockid_t lid = (lock_protocol::lockid_t) getpid() << 32;
+
+  printf ("test9: client 0 caches %d locks, client 1 takes them after %d ms\n",
+          test9_n, wait_ms);
+  for (int i = 0; i < test9_n; i++) {
+    lc[0]->acquire(lid + i);
+    check_grant(lid + i);
+    check_release(lid + i);
+    lc[0]->release(lid + i);
+  }
+  usleep(wait_ms * 1000);
+  long start = now_ms();
+  for (int i = 0; i < test9_n; i++) {
+    lc[1]->acquire(lid + i);
+    check_grant(lid + i);
+    check_release(lid + i);
+    lc[1]->release(lid + i);
+  }
+  printf ("test9: %d locks taken over in %ld ms\n", test9_n, now_ms() - start);
+}
+
+// test 10 compares taking over cached locks one at a time with
+// acquire_many: client 0 caches test10_n locks, and client 1 takes
+// them one by one; then the same for a second set of locks with one
+// acquire_many. acquire_many has the server revoke the whole set at
+// once, so client 0 can return them in a few release_many calls.
+static const int test10_n = 100;
+
+static long
+test10_cache(lock_protocol::lockid_t lid)
+{
+  for (int i = 0; i < test10_n; i++) {
+    lc[0]->acquire(lid + i);
+    check_grant(lid + i);
+    check_release(lid + i);
+    lc[0]->release(lid + i);
+  }
+  return now_ms();
+}
+
+void
+test10()
+{
+  lock_protocol::lockid_t lid = (lock_protocol::lockid_t) getpid() << 32;
+  std::vector<lock_protocol::lockid_t> lids;
+
+  printf ("test10: client 1 takes over %d locks cached by client 0\n",
+          test10_n);
+  long start = test10_cache(lid);
+  for (int i = 0; i < test10_n; i++) {
+    lc[1]->acquire(lid + i);
+    check_grant(lid + i);
+  }
+  long one = now_ms() - start;
+  for (int i = 0; i < test10_n; i++) {
+    check_release(lid + i);
+    lc[1]->release(lid + i);
+  }
+
+  lid += test10_n;
+  for (int i = test10_n - 1; i >= 0; i--)
+    lids.push_back(lid + i);
+  start = test10_cache(lid);
+  lc[1]->acquire_many(lids);
+  for (int i = 0; i < test10_n; i++)
+    check_grant(lid + i);
+  long many = now_ms() - start;
+  for (int i = 0; i < test10_n; i++)
+    check_release(lid + i);
+  lc[1]->release_many(lids);
+
+  printf ("test10: one by one %ld ms, acquire_many %ld ms\n", one, many);
+}
+
+// test 11 reports acquire latency under contention: every client
+// takes the same lock over and over for secs seconds, holding it for
+// 1ms each time, and records how long each acquire waited. Waiters are
+// served in arrival order, so every client should get a similar share
+// and a similar tail.
+static int test11_secs;
+static std::vector<long> test11_lat[256];
+// the lock itself serializes these; a client reusing its cached copy
+// is not a handoff
+static int test11_last = -1;
+static long test11_handoffs;
+
+static long
+now_us()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+void *
+test11(void *x)
+{
+  int i = * (int *) x;
+  lock_protocol::lockid_t a = ((lock_protocol::lockid_t) getpid() << 32) + 11;
+  long end = now_ms() + test11_secs * 1000L;
+
+  while (now_ms() < end) {
+    long start = now_us();
+    lc[i]->acquire(a);
+    test11_lat[i].push_back(now_us() - start);
+    check_grant(a);
+    if (test11_last != i)
+      test11_handoffs++;
+    test11_last = i;
+    usleep(1000);
+    check_release(a);
+    lc[i]->release(a);
+  }
+  return 0;
+}
+
+static long
+percentile(std::vector<long> &v, int p)
+{
+  return v[(v.size() - 1) * p / 100];
+}
+
 static void
 force_exit(int) {
     exit(0);
@@ -168,7 +387,7 @@ main(int argc, char *argv[])
     //jsl_set_debug(2);
 
     if(argc < 2) {
-      fprintf(stderr, "Usage: %s [host:]port [test]\n", argv[0]);
+      fprintf(stderr, "Usage: %s [host:]port[,[host:]port...] [test] [secs]\n", argv[0]);
       exit(1);
     }
 
@@ -176,8 +395,8 @@ main(int argc, char *argv[])
 
     if (argc > 2) {
       test = atoi(argv[2]);
-      if(test < 1 || test > 5){
-        printf("Test number must be between 1 and 5\n");
+      if(test < 1 || test > 11){
+        printf("Test number must be between 1 and 11\n");
         exit(1);
       }
     }
@@ -186,6 +405,94 @@ main(int argc, char *argv[])
     printf("cache lock client\n");
     for (int i = 0; i < nt; i++) lc[i] = new lock_client_cache_rsm(dst);
 
+    if(test == 6){
+      test6(argc > 3 ? atoi(argv[3]) : 30);
+      exit(0);
+    }
+
+    if(test == 7){
+      test7_secs = argc > 3 ? atoi(argv[3]) : 5;
+      printf("test7: stat from %d clients for %d s\n", nt, test7_secs);
+      test7_lid = ((lock_protocol::lockid_t) getpid() << 32) + 7;
+      VERIFY(lc[0]->stat(test7_lid) == 0);
+      lc[0]->acquire(test7_lid);
+      for (int i = 0; i < nt; i++) {
+	int *a = new int (i);
+	r = pthread_create(&th[i], NULL, test7, (void *) a);
+	VERIFY (r == 0);
+      }
+      for (int i = 0; i < nt; i++) {
+	pthread_join(th[i], NULL);
+      }
+      lc[0]->release(test7_lid);
+      printf("test7: %ld stats, %ld per second\n", test7_stats,
+             test7_stats / test7_secs);
+      exit(0);
+    }
+
+    if(test == 8){
+      test8_secs = argc > 3 ? atoi(argv[3]) : 5;
+      printf("test8: acquire new locks from %d clients for %d s\n", nt,
+             test8_secs);
+      for (int i = 0; i < nt; i++) {
+	int *a = new int (i);
+	r = pthread_create(&th[i], NULL, test8, (void *) a);
+	VERIFY (r == 0);
+      }
+      for (int i = 0; i < nt; i++) {
+	pthread_join(th[i], NULL);
+      }
+      printf("test8: %ld acquires, %ld per second\n", test8_acquires,
+             test8_acquires / test8_secs);
+      exit(0);
+    }
+
+    if(test == 11){
+      test11_secs = argc > 3 ? atoi(argv[3]) : 5;
+      printf("test11: %d clients contend for one lock for %d s\n", nt,
+             test11_secs);
+      for (int i = 0; i < nt; i++) {
+	int *a = new int (i);
+	r = pthread_create(&th[i], NULL, test11, (void *) a);
+	VERIFY (r == 0);
+      }
+      for (int i = 0; i < nt; i++) {
+	pthread_join(th[i], NULL);
+      }
+      long total = 0;
+      std::vector<long> all;
+      for (int i = 0; i < nt; i++) {
+	std::vector<long> &v = test11_lat[i];
+	std::sort(v.begin(), v.end());
+	if (v.empty()) {
+	  // starved: no latencies to report
+	  printf("test11: client %d: 0 acquires\n", i);
+	  continue;
+	}
+	printf("test11: client %d: %lu acquires, p50 %ld us, p99 %ld us, "
+	       "max %ld us\n", i, (unsigned long) v.size(), percentile(v, 50),
+	       percentile(v, 99), v.back());
+	total += v.size();
+	all.insert(all.end(), v.begin(), v.end());
+      }
+      std::sort(all.begin(), all.end());
+      printf("test11: %ld acquires, %ld handoffs, %ld handoffs per second, "
+             "p50 %ld us\n", total, test11_handoffs,
+             test11_handoffs / test11_secs,
+             all.empty() ? 0 : percentile(all, 50));
+      exit(0);
+    }
+
+    if(test == 10){
+      test10();
+      exit(0);
+    }
+
+    if(test == 9){
+      test9(argc > 3 ? atoi(argv[3]) : 1000);
+      exit(0);
+    }
+
     if(!test || test == 1){
       test1();
     }
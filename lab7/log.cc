@@ -34,7 +34,6 @@ log::logread(void)
       printf ("logread: instance: %d w. v = %s\n", instance, 
 	      pxs->values[instance].c_str());
       pxs->v_a.clear();
-      pxs->n_h.n = 0;
       pxs->n_a.n = 0;
     } else if (type == "propseen") {
       from >> pxs->n_h.n;
@@ -47,6 +46,8 @@ log::logread(void)
       from.get();
       getline(from, v);
       pxs->v_a = v;
+      if (pxs->n_a > pxs->n_h)
+	pxs->n_h = pxs->n_a;
       printf("logread: prop update %d(%s) with v = %s\n", pxs->n_a.n, 
 	     pxs->n_a.m.c_str(), pxs->v_a.c_str());
     } else {
@@ -2,6 +2,8 @@
 #include "handle.h"
 // #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
 #include "tprintf.h"
 #include "lang/verify.h"
 
@@ -13,6 +15,11 @@
 // this instance of Paxos, the acceptor invokes the upcall
 // paxos_commit to inform higher layers of the agreed value for this
 // instance.
+//
+// Each phase goes to all nodes in parallel. With Multi-Paxos on (the
+// default), a proposer whose full round succeeded stays leader: an
+// acceptor's promise also holds for later instances, so the leader
+// proposes the next views with accept and decide only.
 
 
 bool
@@ -71,10 +78,18 @@ proposer::majority(const std::vector<std::string> &l1,
   return n >= (l1.size() >> 1) + 1;
 }
 
+// $PAXOS_MULTI=0 makes every instance run a full prepare round
+static bool
+multi_enabled()
+{
+  char *env = getenv("PAXOS_MULTI");
+  return env == NULL || atoi(env) != 0;
+}
+
 proposer::proposer(class paxos_change *_cfg, class acceptor *_acceptor, 
 		   std::string _me)
   : cfg(_cfg), acc (_acceptor), me (_me), break1 (false), break2 (false), 
-    stable (true)
+    stable (true), n_seen (0), multi (multi_enabled()), leader (false)
 {
   VERIFY (pthread_mutex_init(&pxs_mutex, NULL) == 0);
   my_n.n = 0;
@@ -84,7 +99,8 @@ proposer::proposer(class paxos_change *_cfg, class acceptor *_acceptor,
 void
 proposer::setn()
 {
-  my_n.n = acc->get_n_h().n + 1 > my_n.n + 1 ? acc->get_n_h().n + 1 : my_n.n + 1;
+  unsigned n = acc->get_n_h().n > n_seen ? acc->get_n_h().n : n_seen;
+  my_n.n = n + 1 > my_n.n + 1 ? n + 1 : my_n.n + 1;
 }
 
 bool
@@ -94,6 +110,8 @@ proposer::run(int instance, std::vector<std::string> cur_nodes, std::string newv
   std::vector<std::string> nodes;
   std::string v;
   bool r = false;
+  bool fast = false;
+  struct timeval start, end;
 
   ScopedLock ml(&pxs_mutex);
   tprintf("start: initiate paxos for %s w. i=%d v=%s stable=%d\n",
@@ -103,43 +121,210 @@ proposer::run(int instance, std::vector<std::string> cur_nodes, std::string newv
     return false;
   }
   stable = false;
-  setn();
-  accepts.clear();
-  v.clear();
-  if (prepare(instance, accepts, cur_nodes, v)) {
+  gettimeofday(&start, NULL);
+  unsigned need = (cur_nodes.size() >> 1) + 1;
 
-    if (majority(cur_nodes, accepts)) {
-      tprintf("paxos::manager: received a majority of prepare responses\n");
+  if (multi && leader && majority(cur_nodes, promised) && 
+      !(acc->get_n_h() > my_n)) {
+    // still leader: a majority promised my_n, go straight to accept
+    breakpoint1();
+
+    accept(instance, accepts, cur_nodes, newv, need);
 
-      if (v.size() == 0)
-	v = newv;
+    if (majority(cur_nodes, accepts)) {
+      tprintf("paxos::manager: leader received a majority of accept responses\n");
 
-      breakpoint1();
+      breakpoint2();
 
-      nodes = accepts;
+      decide(instance, cur_nodes, newv, need);
+      promised = accepts;
+      r = fast = true;
+    } else {
+      tprintf("paxos::manager: leader lost its majority; run prepare\n");
+      leader = false;
       accepts.clear();
-      accept(instance, accepts, nodes, v);
+    }
+  }
+
+  if (!r) {
+    // a new n has no promises behind it until this round gets them
+    leader = false;
+    setn();
+    if (prepare(instance, accepts, cur_nodes, v, need)) {
 
       if (majority(cur_nodes, accepts)) {
-	tprintf("paxos::manager: received a majority of accept responses\n");
+	tprintf("paxos::manager: received a majority of prepare responses\n");
 
-	breakpoint2();
+	if (v.size() == 0)
+	  v = newv;
 
-	decide(instance, accepts, v);
-	r = true;
+	breakpoint1();
+
+	nodes = accepts;
+	accepts.clear();
+	accept(instance, accepts, nodes, v, need);
+
+	if (majority(cur_nodes, accepts)) {
+	  tprintf("paxos::manager: received a majority of accept responses\n");
+
+	  breakpoint2();
+
+	  decide(instance, cur_nodes, v, need);
+	  leader = true;
+	  promised = accepts;
+	  r = true;
+	} else {
+	  tprintf("paxos::manager: no majority of accept responses\n");
+	}
       } else {
-	tprintf("paxos::manager: no majority of accept responses\n");
+	tprintf("paxos::manager: no majority of prepare responses\n");
       }
     } else {
-      tprintf("paxos::manager: no majority of prepare responses\n");
+      tprintf("paxos::manager: prepare is rejected %d\n", stable);
     }
-  } else {
-    tprintf("paxos::manager: prepare is rejected %d\n", stable);
   }
+
+  gettimeofday(&end, NULL);
+  tprintf("paxos::manager: instance %d %s in %ld ms (%s)\n", instance,
+	  r ? "decided" : "failed",
+	  (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000,
+	  fast ? "leader" : "full");
   stable = true;
   return r;
 }
 
+template<class R>
+struct paxos_reply {
+  std::string node;
+  int ret;
+  R r;
+};
+
+// One phase of a round. It sends to all of its nodes at once and
+// returns when every reply is in or when `need' of them are good, so a
+// dead node costs nothing once a majority has answered. The calls
+// still out finish on their own threads; the last one to drop its
+// reference frees the phase.
+template<class A, class R>
+class paxos_phase {
+ public:
+  paxos_phase(unsigned int proc, const std::string &src, const A &a,
+	      const std::vector<std::string> &nodes, bool (*good)(const R &))
+    : proc_(proc), src_(src), a_(a), good_(good), ngood_(0), ndone_(0),
+      refs_(nodes.size() + 1)
+  {
+    VERIFY(pthread_mutex_init(&m_, NULL) == 0);
+    VERIFY(pthread_cond_init(&c_, NULL) == 0);
+    replies_.resize(nodes.size());
+    for (unsigned i = 0; i < nodes.size(); i++) {
+      replies_[i].node = nodes[i];
+      replies_[i].ret = rpc_const::bind_failure;
+    }
+    for (unsigned i = 0; i < nodes.size(); i++) {
+      pthread_t th;
+      slot *s = new slot;
+      s->p = this;
+      s->i = i;
+      VERIFY(pthread_create(&th, NULL, &paxos_phase::run, (void *) s) == 0);
+      VERIFY(pthread_detach(th) == 0);
+    }
+  }
+
+  // copies out the replies that are in and drops the caller's reference
+  void wait(unsigned need, std::vector<paxos_reply<R> > &out)
+  {
+    {
+      ScopedLock ml(&m_);
+      while (ndone_ < replies_.size() && ngood_ < need)
+	VERIFY(pthread_cond_wait(&c_, &m_) == 0);
+      for (unsigned i = 0; i < done_.size(); i++)
+	out.push_back(replies_[done_[i]]);
+    }
+    release();
+  }
+
+ private:
+  struct slot {
+    paxos_phase *p;
+    unsigned i;
+  };
+
+  unsigned int proc_;
+  std::string src_;
+  A a_;
+  bool (*good_)(const R &);
+  std::vector<paxos_reply<R> > replies_;
+  std::vector<unsigned> done_;	// replies in, in arrival order
+  unsigned ngood_;
+  unsigned ndone_;
+  unsigned refs_;
+  pthread_mutex_t m_;
+  pthread_cond_t c_;
+
+  ~paxos_phase()
+  {
+    VERIFY(pthread_mutex_destroy(&m_) == 0);
+    VERIFY(pthread_cond_destroy(&c_) == 0);
+  }
+
+  void release()
+  {
+    bool last;
+    {
+      ScopedLock ml(&m_);
+      last = --refs_ == 0;
+    }
+    if (last)
+      delete this;
+  }
+
+  static void *
+  run(void *x)
+  {
+    slot *s = (slot *) x;
+    paxos_phase *p = s->p;
+    unsigned i = s->i;
+    delete s;
+
+    R r;
+    int ret = rpc_const::bind_failure;
+    handle h(p->replies_[i].node);
+    rpcc *cl = h.safebind();
+    if (cl)
+      ret = cl->call(p->proc_, p->src_, p->a_, r, rpcc::to(1000));
+    {
+      ScopedLock ml(&p->m_);
+      p->replies_[i].ret = ret;
+      p->replies_[i].r = r;
+      p->done_.push_back(i);
+      p->ndone_++;
+      if (ret == paxos_protocol::OK && p->good_(r))
+	p->ngood_++;
+      VERIFY(pthread_cond_signal(&p->c_) == 0);
+    }
+    p->release();
+    return 0;
+  }
+};
+
+static bool
+prepare_good(const paxos_protocol::prepareres &r)
+{
+  return r.accept || r.oldinstance;
+}
+
+static bool
+accept_good(const bool &r)
+{
+  return r;
+}
+
+static bool
+decide_good(const int &r)
+{
+  return true;
+}
+
 // proposer::run() calls prepare to send prepare RPCs to nodes
 // and collect responses. if one of those nodes
 // replies with an oldinstance, return false.
@@ -148,7 +333,7 @@ proposer::run(int instance, std::vector<std::string> cur_nodes, std::string newv
 bool
 proposer::prepare(unsigned instance, std::vector<std::string> &accepts, 
          std::vector<std::string> nodes,
-         std::string &v)
+         std::string &v, unsigned need)
 {
   // You fill this in for Lab 6
   // Note: if got an "oldinstance" reply, commit the instance using
@@ -161,43 +346,40 @@ proposer::prepare(unsigned instance, std::vector<std::string> &accepts,
   paxos_protocol::preparearg a;
   a.instance = instance;
   a.n = my_n;
-  paxos_protocol::prepareres r;
 
-  paxos_protocol::status ret;
+  std::vector<paxos_reply<paxos_protocol::prepareres> > replies;
+  pthread_mutex_unlock(&pxs_mutex);
+  (new paxos_phase<paxos_protocol::preparearg, paxos_protocol::prepareres>
+   (paxos_protocol::preparereq, me, a, nodes, prepare_good))
+    ->wait(need, replies);
+  pthread_mutex_lock(&pxs_mutex);
 
-  for(auto it = nodes.begin(); it != nodes.end(); ++it)
+  for (auto it = replies.begin(); it != replies.end(); ++it)
   {
-    handle h(*it);
+    if(it->ret != paxos_protocol::OK)
+      continue;
 
-    pthread_mutex_unlock(&pxs_mutex);
-    rpcc *cl = h.safebind();
-    if(cl)
+    paxos_protocol::prepareres &r = it->r;
+    // oldinstance为true说明未批准
+    if(r.oldinstance)
     {
-      ret = cl->call(paxos_protocol::preparereq, me, a, r, rpcc::to(1000));
+      acc->commit(instance, r.v_a);
+      return false;
     }
-    pthread_mutex_lock(&pxs_mutex);
-
-    if(cl)
+    else if(r.accept)
     {
-      if(ret == paxos_protocol::OK)
+      accepts.push_back(it->node);
+      if(r.n_a > max)
       {
-        // oldinstance为true说明未批准
-        if(r.oldinstance)
-        {
-          acc->commit(instance, r.v_a);
-          return false;
-        }
-        else if(r.accept)
-        {
-          accepts.push_back(*it);
-          if(r.n_a > max)
-          {
-            v = r.v_a;
-            max = r.n_a;
-          }
-        }
+        v = r.v_a;
+        max = r.n_a;
       }
     }
+    else if(r.n_h.n > n_seen)
+    {
+      // 被更大的提案号拒绝，下一轮要超过它
+      n_seen = r.n_h.n;
+    }
   }
 
   return true;
@@ -207,63 +389,51 @@ proposer::prepare(unsigned instance, std::vector<std::string> &accepts,
 // fill in accepts with list of nodes that accepted.
 void
 proposer::accept(unsigned instance, std::vector<std::string> &accepts,
-        std::vector<std::string> nodes, std::string v)
+        std::vector<std::string> nodes, std::string v, unsigned need)
 {
   // You fill this in for Lab 6
-  paxos_protocol::status ret;
   paxos_protocol::acceptarg a;
   a.instance = instance;
   a.n = my_n;
   a.v = v;
 
-  bool r;
+  std::vector<paxos_reply<bool> > replies;
+  pthread_mutex_unlock(&pxs_mutex);
+  (new paxos_phase<paxos_protocol::acceptarg, bool>
+   (paxos_protocol::acceptreq, me, a, nodes, accept_good))
+    ->wait(need, replies);
+  pthread_mutex_lock(&pxs_mutex);
 
-  for(auto it = nodes.begin(); it != nodes.end(); ++it)
+  for (auto it = replies.begin(); it != replies.end(); ++it)
   {
-    handle h(*it);
-
-    pthread_mutex_unlock(&pxs_mutex);
-    rpcc *cl = h.safebind();
-    if(cl)
+    if(it->ret == paxos_protocol::OK && it->r)
     {
-      ret = cl->call(paxos_protocol::acceptreq, me, a, r, rpcc::to(1000));
-    }
-    pthread_mutex_lock(&pxs_mutex);
-
-    if(cl)
-    {
-      if(ret == paxos_protocol::OK && r)
-      {
-        accepts.push_back(*it);
-      }
+      accepts.push_back(it->node);
     }
   }
 }
 
 void
-proposer::decide(unsigned instance, std::vector<std::string> accepts, 
-	      std::string v)
+proposer::decide(unsigned instance, std::vector<std::string> nodes, 
+	      std::string v, unsigned need)
 {
   // You fill this in for Lab 6
-  paxos_protocol::status ret;
   paxos_protocol::decidearg a;
   a.instance = instance;
   a.v = v;
 
-  int r;
-
-  for(auto it = accepts.begin(); it != accepts.end(); ++it)
-  {
-    handle h(*it);
-
-    pthread_mutex_unlock(&pxs_mutex);
-    rpcc *cl = h.safebind();
-    if(cl)
-    {
-      ret = cl->call(paxos_protocol::decidereq, me, a, r, rpcc::to(1000));
-    }
-    pthread_mutex_lock(&pxs_mutex);
-  }
+  // every node of the view learns the value, also the ones whose
+  // accept was still on its way when the phase returned
+  std::vector<paxos_reply<int> > replies;
+  pthread_mutex_unlock(&pxs_mutex);
+  (new paxos_phase<paxos_protocol::decidearg, int>
+   (paxos_protocol::decidereq, me, a, nodes, decide_good))
+    ->wait(need, replies);
+  // the callers look at the new view as soon as run() returns. not
+  // under pxs_mutex: the commit upcall takes cfg_mutex, and
+  // config::heartbeat takes pxs_mutex while holding it
+  acc->commit(instance, v);
+  pthread_mutex_lock(&pxs_mutex);
 }
 
 acceptor::acceptor(class paxos_change *_cfg, bool _first, std::string _me, 
@@ -290,6 +460,9 @@ acceptor::acceptor(class paxos_change *_cfg, bool _first, std::string _me,
   pxs->reg(paxos_protocol::preparereq, this, &acceptor::preparereq);
   pxs->reg(paxos_protocol::acceptreq, this, &acceptor::acceptreq);
   pxs->reg(paxos_protocol::decidereq, this, &acceptor::decidereq);
+  pxs->set_prio(paxos_protocol::preparereq, rpcs::PRIO_CONTROL);
+  pxs->set_prio(paxos_protocol::acceptreq, rpcs::PRIO_CONTROL);
+  pxs->set_prio(paxos_protocol::decidereq, rpcs::PRIO_CONTROL);
 }
 
 paxos_protocol::status
@@ -324,6 +497,7 @@ acceptor::preparereq(std::string src, paxos_protocol::preparearg a,
   {
     r.oldinstance = false;
     r.accept = false;
+    r.n_h = n_h;
   }
 
   return paxos_protocol::OK;
@@ -336,8 +510,15 @@ acceptor::acceptreq(std::string src, paxos_protocol::acceptarg a, bool &r)
   // You fill this in for Lab 6
   // Remember to *log* the accept if the proposal is accepted.
   ScopedLock ml(&pxs_mutex);
-  if(a.n >= n_h)
+  // 只接受下一个instance的提案：已决定的不再改，落后时等decide补上
+  if(a.instance != instance_h + 1)
   {
+    r = false;
+  }
+  else if(a.n >= n_h)
+  {
+    // leader跳过prepare时，accept同时也是对后续instance的承诺
+    n_h = a.n;
     n_a = a.n;
     v_a = a.v;
     r = true;
@@ -360,8 +541,9 @@ acceptor::decidereq(std::string src, paxos_protocol::decidearg a, int &r)
   tprintf("decidereq for accepted instance %d (my instance %d) v=%s\n", 
 	 a.instance, instance_h, v_a.c_str());
   if (a.instance == instance_h + 1) {
-    VERIFY(v_a == a.v);
-    commit_wo(a.instance, v_a);
+    // a.v is chosen; our own accept of it may have been lost or still
+    // be on its way, since the proposer doesn't wait for every node
+    commit_wo(a.instance, a.v);
   } else if (a.instance <= instance_h) {
     // we are ahead ignore.
   } else {
@@ -381,8 +563,8 @@ acceptor::commit_wo(unsigned instance, std::string value)
     values[instance] = value;
     l->loginstance(instance, value);
     instance_h = instance;
-    n_h.n = 0;
-    n_h.m = me;
+    // n_h is a promise for all later instances too (Multi-Paxos), so
+    // only the accepted proposal is reset
     n_a.n = 0;
     n_a.m = me;
     v_a.clear();
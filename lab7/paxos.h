@@ -54,6 +54,8 @@ class acceptor {
   unsigned get_instance_h() { return instance_h; };
 };
 
+extern bool operator> (const prop_t &a, const prop_t &b);
+extern bool operator>= (const prop_t &a, const prop_t &b);
 extern bool isamember(std::string m, const std::vector<std::string> &nodes);
 extern std::string print_members(const std::vector<std::string> &nodes);
 
@@ -71,15 +73,24 @@ class proposer {
   // Proposer state
   bool stable;
   prop_t my_n;		// number of the last proposal used in this instance
+  unsigned n_seen;	// highest n a prepare of ours was rejected for
+
+  // Multi-Paxos: an acceptor's promise covers all later instances, so
+  // once a full round succeeds the proposer stays leader and proposes
+  // the next instances with my_n and no prepare, as long as the nodes
+  // that accepted it still make up a majority of the view.
+  bool multi;
+  bool leader;
+  std::vector<std::string> promised;
 
   void setn();
   bool prepare(unsigned instance, std::vector<std::string> &accepts, 
          std::vector<std::string> nodes,
-         std::string &v);
+         std::string &v, unsigned need);
   void accept(unsigned instance, std::vector<std::string> &accepts, 
-        std::vector<std::string> nodes, std::string v);
-  void decide(unsigned instance, std::vector<std::string> accepts,
-        std::string v);
+        std::vector<std::string> nodes, std::string v, unsigned need);
+  void decide(unsigned instance, std::vector<std::string> nodes,
+        std::string v, unsigned need);
 
   void breakpoint1();
   void breakpoint2();
@@ -6,6 +6,7 @@
 struct prop_t {
   unsigned n;
   std::string m;
+  RPC_FIELDS(n, m)
 };
 
 class paxos_protocol {
@@ -22,6 +23,7 @@ class paxos_protocol {
   struct preparearg {
     unsigned instance;
     prop_t n;
+    RPC_FIELDS(instance, n)
   };
 
   struct prepareres {
@@ -29,105 +31,23 @@ class paxos_protocol {
     bool accept;
     prop_t n_a;
     std::string v_a;
+    prop_t n_h;		// on a reject, the promise that beat us
+    RPC_FIELDS(oldinstance, accept, n_a, v_a, n_h)
   };
 
   struct acceptarg {
     unsigned instance;
     prop_t n;
     std::string v;
+    RPC_FIELDS(instance, n, v)
   };
 
   struct decidearg {
     unsigned instance;
     std::string v;
+    RPC_FIELDS(instance, v)
   };
 
 };
 
-inline unmarshall &
-operator>>(unmarshall &u, prop_t &a)
-{
-  u >> a.n;
-  u >> a.m;
-  return u;
-}
-
-inline marshall &
-operator<<(marshall &m, prop_t a)
-{
-  m << a.n;
-  m << a.m;
-  return m;
-}
-
-inline unmarshall &
-operator>>(unmarshall &u, paxos_protocol::preparearg &a)
-{
-  u >> a.instance;
-  u >> a.n;
-  return u;
-}
-
-inline marshall &
-operator<<(marshall &m, paxos_protocol::preparearg a)
-{
-  m << a.instance;
-  m << a.n;
-  return m;
-}
-
-inline unmarshall &
-operator>>(unmarshall &u, paxos_protocol::prepareres &r)
-{
-  u >> r.oldinstance;
-  u >> r.accept;
-  u >> r.n_a;
-  u >> r.v_a;
-  return u;
-}
-
-inline marshall &
-operator<<(marshall &m, paxos_protocol::prepareres r)
-{
-  m << r.oldinstance;
-  m << r.accept;
-  m << r.n_a;
-  m << r.v_a;
-  return m;
-}
-
-inline unmarshall &
-operator>>(unmarshall &u, paxos_protocol::acceptarg &a)
-{
-  u >> a.instance;
-  u >> a.n;
-  u >> a.v;
-  return u;
-}
-
-inline marshall &
-operator<<(marshall &m, paxos_protocol::acceptarg a)
-{
-  m << a.instance;
-  m << a.n;
-  m << a.v;
-  return m;
-}
-
-inline unmarshall &
-operator>>(unmarshall &u, paxos_protocol::decidearg &a)
-{
-  u >> a.instance;
-  u >> a.v;
-  return u;
-}
-
-inline marshall &
-operator<<(marshall &m, paxos_protocol::decidearg a)
-{
-  m << a.instance;
-  m << a.v;
-  return m;
-}
-
 #endif
@@ -0,0 +1,240 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bufpool.h"
+#include "lang/verify.h"
+
+// classes are 32 bytes .. bufpool_max, header included
+enum {
+	MIN_SHIFT = 5,
+	MAX_SHIFT = 18,
+	NCLASS = MAX_SHIFT - MIN_SHIFT + 1,
+	LARGE = NCLASS,  // class of blocks from malloc
+};
+
+static const unsigned int MAGIC = 0x6270f00d;
+
+// in front of every block; 16 bytes keeps the payload aligned
+struct bhdr {
+	unsigned int cls;
+	unsigned int magic;
+	unsigned long long pad;
+};
+
+// a free block, linked through its first word
+struct fblk {
+	fblk *next;
+};
+
+struct tcache {
+	fblk *head[NCLASS];
+	int n[NCLASS];
+};
+
+struct depot {
+	pthread_mutex_t m;
+	fblk *head;
+	int n;
+};
+
+static depot depots[NCLASS];
+static pthread_key_t tc_key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static __thread tcache *tc;
+
+static inline size_t
+class_size(int c)
+{
+	return (size_t) 1 << (c + MIN_SHIFT);
+}
+
+// a thread keeps at most cap() free blocks of a class (about 256 KB
+// worth) and moves half of that to or from the depot at a time
+static inline int
+cap(int c)
+{
+	int n = (256 << 10) >> (c + MIN_SHIFT);
+	return n < 4 ? 4 : (n > 256 ? 256 : n);
+}
+
+// the depot holds at most this many; the rest goes back to malloc
+static inline int
+depot_cap(int c)
+{
+	return 16 * cap(c);
+}
+
+static inline int
+class_of(size_t need)
+{
+	if (need > (size_t) bufpool_max)
+		return LARGE;
+	int c = 0;
+	while (class_size(c) < need)
+		c++;
+	return c;
+}
+
+// return the blocks on list to the depot
+static void
+depot_put(int c, fblk *list)
+{
+	depot *d = &depots[c];
+	fblk *extra = NULL;
+	VERIFY(pthread_mutex_lock(&d->m) == 0);
+	while (list) {
+		fblk *b = list;
+		list = b->next;
+		if (d->n < depot_cap(c)) {
+			b->next = d->head;
+			d->head = b;
+			d->n++;
+		} else {
+			b->next = extra;
+			extra = b;
+		}
+	}
+	VERIFY(pthread_mutex_unlock(&d->m) == 0);
+	while (extra) {
+		fblk *b = extra;
+		extra = b->next;
+		free(b);
+	}
+}
+
+static void
+tcache_exit(void *p)
+{
+	tcache *t = (tcache *) p;
+	for (int c = 0; c < NCLASS; c++)
+		depot_put(c, t->head[c]);
+	free(t);
+	tc = NULL;
+}
+
+static void
+init()
+{
+	for (int c = 0; c < NCLASS; c++) {
+		VERIFY(pthread_mutex_init(&depots[c].m, NULL) == 0);
+		depots[c].head = NULL;
+		depots[c].n = 0;
+	}
+	VERIFY(pthread_key_create(&tc_key, tcache_exit) == 0);
+}
+
+static tcache *
+get_tcache()
+{
+	if (!tc) {
+		VERIFY(pthread_once(&once, init) == 0);
+		tc = (tcache *) calloc(1, sizeof(tcache));
+		VERIFY(tc);
+		VERIFY(pthread_setspecific(tc_key, tc) == 0);
+	}
+	return tc;
+}
+
+// move half a cache's worth from the depot to t
+static void
+refill(tcache *t, int c)
+{
+	depot *d = &depots[c];
+	int want = cap(c) / 2;
+	VERIFY(pthread_mutex_lock(&d->m) == 0);
+	while (d->head && t->n[c] < want) {
+		fblk *b = d->head;
+		d->head = b->next;
+		d->n--;
+		b->next = t->head[c];
+		t->head[c] = b;
+		t->n[c]++;
+	}
+	VERIFY(pthread_mutex_unlock(&d->m) == 0);
+}
+
+void *
+bufpool_alloc(size_t sz)
+{
+	size_t need = sz + sizeof(bhdr);
+	int c = class_of(need);
+	bhdr *h;
+
+	if (c == LARGE) {
+		h = (bhdr *) malloc(need);
+	} else {
+		tcache *t = get_tcache();
+		if (!t->head[c])
+			refill(t, c);
+		if (t->head[c]) {
+			fblk *b = t->head[c];
+			t->head[c] = b->next;
+			t->n[c]--;
+			h = (bhdr *) b;
+		} else {
+			h = (bhdr *) malloc(class_size(c));
+		}
+	}
+	VERIFY(h);
+	h->cls = c;
+	h->magic = MAGIC;
+	return h + 1;
+}
+
+void
+bufpool_free(void *p)
+{
+	if (!p)
+		return;
+	bhdr *h = (bhdr *) p - 1;
+	VERIFY(h->magic == MAGIC);
+	int c = h->cls;
+	h->magic = 0;
+
+	if (c == LARGE) {
+		free(h);
+		return;
+	}
+	VERIFY(c >= 0 && c < NCLASS);
+
+	tcache *t = get_tcache();
+	fblk *b = (fblk *) h;
+	b->next = t->head[c];
+	t->head[c] = b;
+	if (++t->n[c] > cap(c)) {
+		// keep half, hand the rest to the depot
+		int keep = cap(c) / 2;
+		fblk *last = t->head[c];
+		for (int i = 1; i < keep; i++)
+			last = last->next;
+		fblk *rest = last->next;
+		last->next = NULL;
+		t->n[c] = keep;
+		depot_put(c, rest);
+	}
+}
+
+void *
+bufpool_realloc(void *p, size_t sz)
+{
+	if (!p)
+		return bufpool_alloc(sz);
+	bhdr *h = (bhdr *) p - 1;
+	VERIFY(h->magic == MAGIC);
+
+	size_t need = sz + sizeof(bhdr);
+	if (h->cls == LARGE && class_of(need) == LARGE) {
+		h = (bhdr *) realloc(h, need);
+		VERIFY(h);
+		return h + 1;
+	}
+	if (h->cls != LARGE && need <= class_size(h->cls))
+		return p;
+
+	void *np = bufpool_alloc(sz);
+	size_t old = h->cls == LARGE ? sz : class_size(h->cls) - sizeof(bhdr);
+	memcpy(np, p, old < sz ? old : sz);
+	bufpool_free(p);
+	return np;
+}
@@ -0,0 +1,59 @@
+#ifndef bufpool_h
+#define bufpool_h
+
+// Size-classed memory pool for the RPC hot path: request and reply
+// buffers, dispatch jobs and the container nodes allocated per call.
+//
+// Blocks of up to bufpool_max bytes come from per-thread free lists,
+// one per power-of-two size class, and are never returned to malloc.
+// A thread that frees more blocks than it allocates (a dispatch worker
+// freeing request buffers the poll thread allocated, say) hands them
+// back in batches to a global depot, from which allocating threads
+// refill. Once the pool has warmed up, RPCs don't call the global
+// allocator. Bigger blocks go straight to malloc.
+//
+// Every block carries a small header naming its class, so
+// bufpool_free() works on any block regardless of which thread
+// allocated it. Buffers taken from marshall::take_buf() or
+// unmarshall::take_buf() must be released with bufpool_free().
+
+#include <stddef.h>
+
+enum { bufpool_max = 256 << 10 };
+
+void *bufpool_alloc(size_t sz);
+void *bufpool_realloc(void *p, size_t sz);
+void bufpool_free(void *p);
+
+// base for small per-RPC objects, so new/delete use the pool
+struct bufpool_obj {
+	static void *operator new(size_t sz) { return bufpool_alloc(sz); }
+	static void operator delete(void *p) { bufpool_free(p); }
+};
+
+// STL allocator on the pool, for the list and map nodes of
+// per-call bookkeeping
+template<class T>
+struct bufpool_allocator {
+	typedef T value_type;
+
+	bufpool_allocator() { }
+	template<class U> bufpool_allocator(const bufpool_allocator<U> &) { }
+
+	T *allocate(size_t n) { return (T *) bufpool_alloc(n * sizeof(T)); }
+	void deallocate(T *p, size_t) { bufpool_free(p); }
+};
+
+template<class T, class U> bool
+operator==(const bufpool_allocator<T> &, const bufpool_allocator<U> &)
+{
+	return true;
+}
+
+template<class T, class U> bool
+operator!=(const bufpool_allocator<T> &, const bufpool_allocator<U> &)
+{
+	return false;
+}
+
+#endif
@@ -1,12 +1,20 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/un.h>
 #include <netinet/tcp.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <atomic>
 
 #include "method_thread.h"
+#include "bufpool.h"
+#include "marshall.h"
 #include "connection.h"
 #include "slock.h"
 #include "pollmgr.h"
@@ -18,8 +26,24 @@
 
 
 connection::connection(chanmgr *m1, int f1, int l1) 
-: mgr_(m1), fd_(f1), dead_(false),waiters_(0), refno_(1),lossy_(l1)
+: mgr_(m1), t_(new transport(f1)), fd_(f1), dead_(false), inoff_(0), inlen_(0),
+	waiters_(0), refno_(1),lossy_(l1)
 {
+	init();
+}
+
+connection::connection(chanmgr *m1, transport *t1, int l1)
+: mgr_(m1), t_(t1), fd_(t1->fd()), dead_(false), inoff_(0), inlen_(0),
+	waiters_(0), refno_(1),lossy_(l1)
+{
+	init();
+}
+
+void
+connection::init()
+{
+	inbuf_ = (char *)malloc(INBUF_SZ);
+	VERIFY(inbuf_);
 
 	int flags = fcntl(fd_, F_GETFL, NULL);
 	flags |= O_NONBLOCK;
@@ -44,9 +68,10 @@ connection::~connection()
 	VERIFY(pthread_cond_destroy(&send_wait_) == 0);
 	VERIFY(pthread_cond_destroy(&send_complete_) == 0);
 	if (rpdu_.buf)
-		free(rpdu_.buf);
+		bufpool_free(rpdu_.buf);
+	free(inbuf_);
 	VERIFY(!wpdu_.buf);
-	close(fd_);
+	delete t_;
 }
 
 void
@@ -70,7 +95,7 @@ connection::closeconn()
 		ScopedLock ml(&m_);
 		if (!dead_) {
 			dead_ = true;
-			shutdown(fd_,SHUT_RDWR);
+			t_->shutdown();
 		}else{
 			return;
 		}
@@ -139,7 +164,7 @@ connection::send(char *b, int sz)
 	if (lossy_) {
 		if ((random()%100) < lossy_) {
 			jsl_log(JSL_DBG_1, "connection::send LOSSY TEST shutdown fd_ %d\n", fd_);
-			shutdown(fd_,SHUT_RDWR);
+			t_->shutdown();
 		}
 	}
 
@@ -152,7 +177,8 @@ connection::send(char *b, int sz)
 		if (wpdu_.solong == wpdu_.sz) {
 		}else{
 			//should be rare to need to explicitly add write callback
-			PollMgr::Instance()->add_callback(fd_, CB_WRONLY, this);
+			if (!t_->write_wakes_reader())
+				PollMgr::Instance()->add_callback(fd_, CB_WRONLY, this);
 			while (!dead_ && wpdu_.solong >= 0 && wpdu_.solong < wpdu_.sz) {
 				VERIFY(pthread_cond_wait(&send_complete_,&m_) == 0);
 			}
@@ -171,8 +197,12 @@ void
 connection::write_cb(int s)
 {
 	ScopedLock ml(&m_);
-	VERIFY(!dead_);
 	VERIFY(fd_ == s);
+	// send() may have marked the connection dead while this write
+	// event was already queued; block_remove_fd() will follow
+	if (dead_) {
+		return;
+	}
 	if (wpdu_.sz == 0) {
 		PollMgr::Instance()->del_callback(fd_,CB_WRONLY);
 		return;
@@ -199,23 +229,48 @@ connection::read_cb(int s)
 		return;
 	}
 
-	bool succ = true;
-	if (!rpdu_.buf || rpdu_.solong < rpdu_.sz) {
-		succ = readpdu();
+	t_->drain();
+	// a send() waiting for room in the shm ring; see write_cb
+	if (t_->write_wakes_reader() && wpdu_.buf && wpdu_.solong >= 0
+			&& wpdu_.solong < wpdu_.sz) {
+		if (!writepdu()) {
+			PollMgr::Instance()->del_callback(fd_, CB_RDWR);
+			dead_ = true;
+			pthread_cond_signal(&send_complete_);
+			return;
+		}
+		if (wpdu_.solong == wpdu_.sz)
+			pthread_cond_signal(&send_complete_);
 	}
 
-	if (!succ) {
-		PollMgr::Instance()->del_callback(fd_,CB_RDWR);
-		dead_ = true;
-		pthread_cond_signal(&send_complete_);
-	}
+	while (1) {
+		int r = 1;
+		if (!rpdu_.buf || rpdu_.solong < rpdu_.sz) {
+			r = readpdu();
+		}
 
-	if (rpdu_.buf && rpdu_.sz == rpdu_.solong) {
-		if (mgr_->got_pdu(this, rpdu_.buf, rpdu_.sz)) {
-			//chanmgr has successfully consumed the pdu
-			rpdu_.buf = NULL;
-			rpdu_.sz = rpdu_.solong = 0;
+		if (r < 0) {
+			PollMgr::Instance()->del_callback(fd_,CB_RDWR);
+			dead_ = true;
+			pthread_cond_signal(&send_complete_);
+			return;
+		}
+
+		if (rpdu_.buf && rpdu_.sz == rpdu_.solong) {
+			if (mgr_->got_pdu(this, rpdu_.buf, rpdu_.sz)) {
+				//chanmgr has successfully consumed the pdu
+				rpdu_.buf = NULL;
+				rpdu_.sz = rpdu_.solong = 0;
+			} else {
+				return;
+			}
 		}
+
+		// carry on with pdus already in inbuf_. the socket transports
+		// are level-triggered, so once inbuf_ is used up the poll
+		// loop calls again if there is more.
+		if ((r == 0 || inoff_ == inlen_) && !t_->pending())
+			return;
 	}
 }
 
@@ -227,10 +282,12 @@ connection::writepdu()
 		return true;
 
 	if (wpdu_.solong == 0) {
-		int sz = htonl(wpdu_.sz);
+		// keep the compact-encoding bit the marshall left there
+		unsigned int flags = rpc_pdu_compact(wpdu_.buf) ? RPC_SZ_COMPACT : 0;
+		int sz = htonl(wpdu_.sz | flags);
 		bcopy(&sz,wpdu_.buf,sizeof(sz));
 	}
-	int n = write(fd_, wpdu_.buf + wpdu_.solong, (wpdu_.sz-wpdu_.solong));
+	int n = t_->write(wpdu_.buf + wpdu_.solong, (wpdu_.sz-wpdu_.solong));
 	if (n < 0) {
 		if (errno != EAGAIN) {
 			jsl_log(JSL_DBG_1, "connection::writepdu fd_ %d failure errno=%d\n", fd_, errno);
@@ -243,56 +300,66 @@ connection::writepdu()
 	return true;
 }
 
-bool
+// make progress on rpdu_: 1 if it did, 0 if the transport has
+// nothing for now, -1 on eof or error. reads go through inbuf_, so one
+// read() picks up a small pdu's length and body together, or several
+// pdus; only the tail of a big body is read straight into the pdu.
+int
 connection::readpdu()
 {
-	if (!rpdu_.sz) {
-		int sz, sz1;
-		int n = read(fd_, &sz1, sizeof(sz1));
-
-		if (n == 0) {
-			return false;
-		}
-
-		if (n < 0) {
-			VERIFY(errno!=EAGAIN);
-			return false;
-		}
-
-		if (n >0 && n!= sizeof(sz)) {
-			jsl_log(JSL_DBG_OFF, "connection::readpdu short read of sz\n");
-			return false;
+	int hdr = sizeof(int);
+	if (inoff_ == inlen_ || (!rpdu_.buf && inlen_ - inoff_ < hdr)) {
+		int n;
+		if (rpdu_.buf && inoff_ == inlen_ && rpdu_.sz - rpdu_.solong >= INBUF_SZ) {
+			n = t_->read(rpdu_.buf + rpdu_.solong, rpdu_.sz - rpdu_.solong);
+			if (n > 0) {
+				rpdu_.solong += n;
+				return 1;
+			}
+		} else {
+			// keep a partial length at the front
+			memmove(inbuf_, inbuf_ + inoff_, inlen_ - inoff_);
+			inlen_ -= inoff_;
+			inoff_ = 0;
+			n = t_->read(inbuf_ + inlen_, INBUF_SZ - inlen_);
+			if (n > 0)
+				inlen_ += n;
 		}
+		if (n == 0)
+			return -1;
+		if (n < 0)
+			return errno == EAGAIN ? 0 : -1;
+		if (!rpdu_.buf && inlen_ - inoff_ < hdr)
+			return 1;
+	}
 
-		sz = ntohl(sz1);
+	if (!rpdu_.buf) {
+		int sz, sz1;
+		memcpy(&sz1, inbuf_ + inoff_, hdr);
+		sz = ntohl(sz1) & ~RPC_SZ_COMPACT;
 
-		if (sz > MAX_PDU) {
+		if (sz > MAX_PDU || sz < hdr) {
 			char *tmpb = (char *)&sz1;
 			jsl_log(JSL_DBG_2, "connection::readpdu read pdu TOO BIG %d network order=%x %x %x %x %x\n", sz, 
 					sz1, tmpb[0],tmpb[1],tmpb[2],tmpb[3]);
-			return false;
+			return -1;
 		}
 
 		rpdu_.sz = sz;
-		VERIFY(rpdu_.buf == NULL);
-		rpdu_.buf = (char *)malloc(sz+sizeof(sz));
+		rpdu_.buf = (char *)bufpool_alloc(sz+sizeof(sz));
 		VERIFY(rpdu_.buf);
 		bcopy(&sz1,rpdu_.buf,sizeof(sz));
 		rpdu_.solong = sizeof(sz);
+		inoff_ += hdr;
 	}
 
-	int n = read(fd_, rpdu_.buf + rpdu_.solong, rpdu_.sz - rpdu_.solong);
-	if (n <= 0) {
-		if (errno == EAGAIN)
-			return true;
-		if (rpdu_.buf)
-			free(rpdu_.buf);
-		rpdu_.buf = NULL;
-		rpdu_.sz = rpdu_.solong = 0;
-		return (errno == EAGAIN);
-	}
-	rpdu_.solong += n;
-	return true;
+	int k = inlen_ - inoff_;
+	if (k > rpdu_.sz - rpdu_.solong)
+		k = rpdu_.sz - rpdu_.solong;
+	memcpy(rpdu_.buf + rpdu_.solong, inbuf_ + inoff_, k);
+	rpdu_.solong += k;
+	inoff_ += k;
+	return 1;
 }
 
 tcpsconn::tcpsconn(chanmgr *m1, int port, int lossytest) 
@@ -333,6 +400,9 @@ tcpsconn::tcpsconn(chanmgr *m1, int port, int lossytest)
 	jsl_log(JSL_DBG_2, "tcpsconn::tcpsconn listen on %d %d\n", port_, 
 		sin.sin_port);
 
+	unix_ = listen_unix(TRANSPORT_UNIX);
+	shm_ = listen_unix(TRANSPORT_SHM);
+
 	if (pipe(pipe_) < 0) {
 		perror("accept_loop pipe:");
 		VERIFY(0);
@@ -358,20 +428,110 @@ tcpsconn::~tcpsconn()
 	}	
 }
 
+// where the rpcs on port listens for same-host connections
+std::string
+tcpsconn::sock_path(int port, rpc_transport t)
+{
+	const char *dir = getenv("RPC_SOCKDIR");
+	char path[sizeof(((sockaddr_un *)0)->sun_path)];
+	snprintf(path, sizeof(path), "%s/rpc-%d.%s", dir ? dir : "/tmp", port,
+			t == TRANSPORT_SHM ? "shm" : "sock");
+	return path;
+}
+
+static bool
+make_sockaddr_un(int port, rpc_transport t, sockaddr_un *sun)
+{
+	std::string path = tcpsconn::sock_path(port, t);
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (path.size() >= sizeof(sun->sun_path))
+		return false;
+	strcpy(sun->sun_path, path.c_str());
+	return true;
+}
+
+int
+tcpsconn::listen_unix(rpc_transport t)
+{
+	sockaddr_un sun;
+	if (!make_sockaddr_un(port_, t, &sun))
+		return -1;
+	int l = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (l < 0)
+		return -1;
+	// a leftover from a server that died; a live one would
+	// already have failed our tcp bind
+	unlink(sun.sun_path);
+	if (bind(l, (sockaddr *)&sun, sizeof(sun)) < 0 || listen(l, 1000) < 0) {
+		jsl_log(JSL_DBG_OFF, "tcpsconn::listen_unix %s failed errno %d\n",
+				sun.sun_path, errno);
+		close(l);
+		return -1;
+	}
+	return l;
+}
+
+// the connecting side of a shm connection sends one byte with the
+// segment's fd attached
+static void *
+recv_shm_seg(int s)
+{
+	char c;
+	struct iovec iov = { &c, 1 };
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+
+	// don't let a stuck client hold up the accept thread
+	struct timeval tv = { 1, 0 };
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (recvmsg(s, &msg, 0) != 1)
+		return NULL;
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+		return NULL;
+	int fd;
+	memcpy(&fd, CMSG_DATA(cm), sizeof(fd));
+	void *seg = mmap(NULL, shm_transport::seg_size(),
+			PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	return seg == MAP_FAILED ? NULL : seg;
+}
+
 void
-tcpsconn::process_accept()
+tcpsconn::process_accept(int l)
 {
-	sockaddr_in sin;
-	socklen_t slen = sizeof(sin);
-	int s1 = accept(tcp_, (sockaddr *)&sin, &slen); 
+	int s1 = accept(l, NULL, NULL);
 	if (s1 < 0) {
 		perror("tcpsconn::accept_conn error");
 		pthread_exit(NULL);
 	}
 
-	jsl_log(JSL_DBG_2, "accept_loop got connection fd=%d %s:%d\n", 
-			s1, inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
-	connection *ch = new connection(mgr_, s1, lossy_);
+	connection *ch;
+	if (l == tcp_) {
+		jsl_log(JSL_DBG_2, "accept_loop got connection fd=%d\n", s1);
+		ch = new connection(mgr_, s1, lossy_);
+	} else if (l == unix_) {
+		jsl_log(JSL_DBG_2, "accept_loop got unix connection fd=%d\n", s1);
+		ch = new connection(mgr_, s1, lossy_);
+	} else {
+		void *seg = recv_shm_seg(s1);
+		if (!seg) {
+			jsl_log(JSL_DBG_1, "accept_loop bad shm handshake fd=%d\n", s1);
+			close(s1);
+			return;
+		}
+		jsl_log(JSL_DBG_2, "accept_loop got shm connection fd=%d\n", s1);
+		ch = new connection(mgr_, new shm_transport(s1, seg, false), lossy_);
+	}
 
         // garbage collect all dead connections with refcount of 1
         std::map<int, connection *>::iterator i;
@@ -397,11 +557,19 @@ tcpsconn::accept_conn()
 {
 	fd_set rfds;
 	int max_fd = pipe_[0] > tcp_ ? pipe_[0] : tcp_;
+	if (unix_ > max_fd)
+		max_fd = unix_;
+	if (shm_ > max_fd)
+		max_fd = shm_;
 
 	while (1) { 
 		FD_ZERO(&rfds);
 		FD_SET(pipe_[0], &rfds);
 		FD_SET(tcp_, &rfds);
+		if (unix_ >= 0)
+			FD_SET(unix_, &rfds);
+		if (shm_ >= 0)
+			FD_SET(shm_, &rfds);
 
 		int ret = select(max_fd+1, &rfds, NULL, NULL, NULL);
 
@@ -418,19 +586,93 @@ tcpsconn::accept_conn()
 		if (FD_ISSET(pipe_[0], &rfds)) {
 			close(pipe_[0]);
 			close(tcp_);
+			if (unix_ >= 0) {
+				close(unix_);
+				unlink(sock_path(port_, TRANSPORT_UNIX).c_str());
+			}
+			if (shm_ >= 0) {
+				close(shm_);
+				unlink(sock_path(port_, TRANSPORT_SHM).c_str());
+			}
 			return;
 		}
-		else if (FD_ISSET(tcp_, &rfds)) {
-			process_accept();
-		} else {
-			VERIFY(0);
-		}
+		if (FD_ISSET(tcp_, &rfds))
+			process_accept(tcp_);
+		if (unix_ >= 0 && FD_ISSET(unix_, &rfds))
+			process_accept(unix_);
+		if (shm_ >= 0 && FD_ISSET(shm_, &rfds))
+			process_accept(shm_);
 	}
 }
 
+static connection *
+connect_to_shm(int s, chanmgr *mgr, int lossy)
+{
+	int fd = memfd_create("rpc-shm", 0);
+	if (fd < 0 || ftruncate(fd, shm_transport::seg_size()) < 0) {
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	void *seg = mmap(NULL, shm_transport::seg_size(),
+			PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (seg == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	// set up the rings before the server can see them
+	shm_transport *t = new shm_transport(s, seg, true);
+
+	char c = 0;
+	struct iovec iov = { &c, 1 };
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &fd, sizeof(fd));
+	ssize_t n = sendmsg(s, &msg, MSG_NOSIGNAL);
+	close(fd);
+	if (n != 1) {
+		delete t;
+		return NULL;
+	}
+	return new connection(mgr, t, lossy);
+}
+
 connection *
-connect_to_dst(const sockaddr_in &dst, chanmgr *mgr, int lossy)
+connect_to_dst(const sockaddr_in &dst, chanmgr *mgr, int lossy, rpc_transport t)
 {
+	if (t != TRANSPORT_TCP) {
+		sockaddr_un sun;
+		int port = ntohs(dst.sin_port);
+		if (!make_sockaddr_un(port, t, &sun))
+			return NULL;
+		int s = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (s < 0)
+			return NULL;
+		if (connect(s, (sockaddr *)&sun, sizeof(sun)) < 0) {
+			jsl_log(JSL_DBG_1, "rpcc::connect_to_dst failed to %s\n",
+					sun.sun_path);
+			close(s);
+			return NULL;
+		}
+		jsl_log(JSL_DBG_2, "connect_to_dst fd=%d to dst %s\n",
+				s, sun.sun_path);
+		if (t == TRANSPORT_SHM)
+			return connect_to_shm(s, mgr, lossy);
+		return new connection(mgr, s, lossy);
+	}
+
 	int s= socket(AF_INET, SOCK_STREAM, 0);
 	int yes = 1;
 	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
@@ -443,4 +685,153 @@ connect_to_dst(const sockaddr_in &dst, chanmgr *mgr, int lossy)
 	jsl_log(JSL_DBG_2, "connect_to_dst fd=%d to dst %s:%d\n",
 			s, inet_ntoa(dst.sin_addr), (int)ntohs(dst.sin_port));
 	return new connection(mgr, s, lossy);
-}
\ No newline at end of file
+}
+
+// one direction of a shm connection. head and tail count bytes ever
+// consumed and published, so head == tail is empty and tail - head ==
+// ring_sz is full. they sit on their own cache lines since each is
+// written by a different process.
+struct shm_ring {
+	alignas(64) std::atomic<unsigned long long> head;
+	alignas(64) std::atomic<unsigned long long> tail;
+	// the reader found the ring empty and waits for a wakeup
+	alignas(64) std::atomic<int> reader_idle;
+	// the writer found the ring full and waits for a wakeup
+	std::atomic<int> writer_blocked;
+	alignas(64) char data[shm_transport::ring_sz];
+};
+
+size_t
+shm_transport::seg_size()
+{
+	return 2 * sizeof(shm_ring);
+}
+
+shm_transport::shm_transport(int fd, void *seg, bool connector)
+	: transport(fd), seg_(seg), eof_(false)
+{
+	shm_ring *rings = (shm_ring *) seg;
+	if (connector) {
+		for (int i = 0; i < 2; i++) {
+			new (&rings[i].head) std::atomic<unsigned long long>(0);
+			new (&rings[i].tail) std::atomic<unsigned long long>(0);
+			new (&rings[i].reader_idle) std::atomic<int>(1);
+			new (&rings[i].writer_blocked) std::atomic<int>(0);
+		}
+	}
+	tx_ = &rings[connector ? 0 : 1];
+	rx_ = &rings[connector ? 1 : 0];
+}
+
+shm_transport::~shm_transport()
+{
+	munmap(seg_, seg_size());
+}
+
+void
+shm_transport::wakeup()
+{
+	char c = 0;
+	// if the socket buffer is full the peer has wakeups queued anyway
+	send(fd_, &c, 1, MSG_DONTWAIT|MSG_NOSIGNAL);
+}
+
+// like a shut down socket: writes fail, and reads see eof once the
+// ring is empty. the peer sees the socket shut down.
+void
+shm_transport::shutdown()
+{
+	eof_ = true;
+	transport::shutdown();
+}
+
+void
+shm_transport::drain()
+{
+	char buf[64];
+	while (1) {
+		ssize_t n = recv(fd_, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n == 0)
+			eof_ = true;
+		if (n <= 0 || n < (ssize_t) sizeof(buf))
+			return;
+	}
+}
+
+ssize_t
+shm_transport::read(char *b, size_t n)
+{
+	unsigned long long head = rx_->head.load(std::memory_order_relaxed);
+	unsigned long long tail = rx_->tail.load(std::memory_order_acquire);
+	size_t avail = tail - head;
+	if (avail == 0) {
+		if (eof_)
+			return 0;
+		errno = EAGAIN;
+		return -1;
+	}
+	if (n > avail)
+		n = avail;
+	size_t off = head % ring_sz;
+	size_t first = n < ring_sz - off ? n : ring_sz - off;
+	memcpy(b, rx_->data + off, first);
+	memcpy(b + first, rx_->data, n - first);
+	rx_->head.store(head + n, std::memory_order_seq_cst);
+	if (rx_->writer_blocked.exchange(0))
+		wakeup();
+	return n;
+}
+
+ssize_t
+shm_transport::write(const char *b, size_t n)
+{
+	if (eof_) {
+		errno = EPIPE;
+		return -1;
+	}
+	size_t done = 0;
+	while (done < n) {
+		unsigned long long tail = tx_->tail.load(std::memory_order_relaxed);
+		size_t space = ring_sz - (tail - tx_->head.load(std::memory_order_acquire));
+		// never split the 4-byte pdu length: the reader reads it whole
+		size_t need = done > 0 ? 1 : (n < sizeof(int) ? n : sizeof(int));
+		if (space < need) {
+			// full: ask the reader for a wakeup, then look again in
+			// case it made room before it could see the request
+			tx_->writer_blocked.store(1, std::memory_order_seq_cst);
+			space = ring_sz - (tail - tx_->head.load(std::memory_order_seq_cst));
+			if (space < need)
+				break;
+			tx_->writer_blocked.store(0, std::memory_order_relaxed);
+		}
+		size_t k = n - done < space ? n - done : space;
+		size_t off = tail % ring_sz;
+		size_t first = k < ring_sz - off ? k : ring_sz - off;
+		memcpy(tx_->data + off, b + done, first);
+		memcpy(tx_->data, b + done + first, k - first);
+		tx_->tail.store(tail + k, std::memory_order_seq_cst);
+		if (tx_->reader_idle.exchange(0))
+			wakeup();
+		done += k;
+	}
+	if (done == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return done;
+}
+
+bool
+shm_transport::pending()
+{
+	if (rx_->tail.load(std::memory_order_acquire) != rx_->head.load(std::memory_order_relaxed))
+		return true;
+	// about to wait: ask the writer for a wakeup, then look again in
+	// case it published before it could see the request
+	rx_->reader_idle.store(1, std::memory_order_seq_cst);
+	if (rx_->tail.load(std::memory_order_seq_cst) != rx_->head.load(std::memory_order_relaxed)) {
+		rx_->reader_idle.store(0, std::memory_order_relaxed);
+		return true;
+	}
+	return eof_;
+}
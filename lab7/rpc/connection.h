@@ -5,14 +5,74 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <unistd.h>
 #include <cstddef>
 
 #include <map>
+#include <string>
 
 #include "pollmgr.h"
 
 class connection;
 
+// how a connection reaches its peer, chosen by the address scheme
+// (see make_sockaddr): "[host:]port" is tcp, "unix:port" and
+// "shm:port" reach the rpcs listening on port on this host through
+// an AF_UNIX socket or a shared-memory ring.
+enum rpc_transport { TRANSPORT_TCP, TRANSPORT_UNIX, TRANSPORT_SHM };
+
+// the byte stream under a connection. tcp and unix sockets use the
+// socket itself.
+class transport {
+	public:
+		transport(int fd) : fd_(fd) {}
+		virtual ~transport() { close(fd_); }
+
+		int fd() { return fd_; }  // the fd PollMgr watches
+		virtual ssize_t read(char *b, size_t n) { return ::read(fd_, b, n); }
+		virtual ssize_t write(const char *b, size_t n) { return ::write(fd_, b, n); }
+		virtual void shutdown() { ::shutdown(fd_, SHUT_RDWR); }
+
+		// consume wakeups from fd before reading
+		virtual void drain() {}
+		// more bytes can be read without waiting for fd
+		virtual bool pending() { return false; }
+		// the transport signals room to write through fd becoming
+		// readable, not writable
+		virtual bool write_wakes_reader() { return false; }
+	protected:
+		const int fd_;
+};
+
+struct shm_ring;
+
+// moves the bytes through a pair of rings in a shared segment, one
+// per direction. the unix socket to the peer only carries one-byte
+// wakeups, sent when the reader is idle or the writer is waiting for
+// room, and tells us when the peer goes away.
+class shm_transport : public transport {
+	public:
+		shm_transport(int fd, void *seg, bool connector);
+		~shm_transport();
+
+		ssize_t read(char *b, size_t n);
+		ssize_t write(const char *b, size_t n);
+		void shutdown();
+		void drain();
+		bool pending();
+		bool write_wakes_reader() { return true; }
+
+		static const size_t ring_sz = 1 << 20;
+		static size_t seg_size();
+	private:
+		void wakeup();
+
+		void *seg_;
+		shm_ring *tx_;
+		shm_ring *rx_;
+		bool eof_;
+};
+
 class chanmgr {
 	public:
 		virtual bool got_pdu(connection *c, char *b, int sz) = 0;
@@ -30,6 +90,7 @@ class connection : public aio_callback {
 		};
 
 		connection(chanmgr *m1, int f1, int lossytest=0);
+		connection(chanmgr *m1, transport *t1, int lossytest=0);
 		~connection();
 
 		int channo() { return fd_; }
@@ -47,15 +108,22 @@ class connection : public aio_callback {
                 int compare(connection *another);
 	private:
 
-		bool readpdu();
+		void init();
+		int readpdu();
 		bool writepdu();
 
 		chanmgr *mgr_;
+		transport *t_;
 		const int fd_;
 		bool dead_;
 
 		charbuf wpdu_;
 		charbuf rpdu_;
+
+		static const int INBUF_SZ = 16 * 1024;
+		char *inbuf_; // bytes read but not yet in rpdu_
+		int inoff_;
+		int inlen_;
                 
                 struct timeval create_time_;
 
@@ -75,6 +143,7 @@ class tcpsconn {
 		~tcpsconn();
                 inline int port() { return port_; }
 		void accept_conn();
+		static std::string sock_path(int port, rpc_transport t);
 	private:
                 int port_;
 		pthread_mutex_t m_;
@@ -82,11 +151,14 @@ class tcpsconn {
 		int pipe_[2];
 
 		int tcp_; //file desciptor for accepting connection
+		int unix_; // same-host listeners, -1 if they could not be set up
+		int shm_;
 		chanmgr *mgr_;
 		int lossy_;
 		std::map<int, connection *> conns_;
 
-		void process_accept();
+		int listen_unix(rpc_transport t);
+		void process_accept(int l);
 };
 
 struct bundle {
@@ -97,5 +169,6 @@ struct bundle {
 };
 
 void start_accept_thread(chanmgr *mgr, int port, pthread_t *th, int *fd = NULL, int lossy=0);
-connection *connect_to_dst(const sockaddr_in &dst, chanmgr *mgr, int lossy=0);
+connection *connect_to_dst(const sockaddr_in &dst, chanmgr *mgr, int lossy=0,
+		rpc_transport t=TRANSPORT_TCP);
 #endif
\ No newline at end of file
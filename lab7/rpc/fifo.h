@@ -10,6 +10,7 @@
 #include <time.h>
 #include <errno.h>
 #include "slock.h"
+#include "bufpool.h"
 #include "lang/verify.h"
 
 template<class T>
@@ -18,11 +19,11 @@ class fifo {
 		fifo(int m=0);
 		~fifo();
 		bool enq(T, bool blocking=true);
-		void deq(T *);
+		bool deq(T *, bool blocking=true);
 		bool size();
 
 	private:
-		std::list<T> q_;
+		std::list<T, bufpool_allocator<T> > q_;
 		pthread_mutex_t m_;
 		pthread_cond_t non_empty_c_; // q went non-empty
 		pthread_cond_t has_space_c_; // q is not longer overfull
@@ -71,13 +72,15 @@ fifo<T>::enq(T e, bool blocking)
 	return true;
 }
 
-template<class T> void
-fifo<T>::deq(T *e)
+template<class T> bool
+fifo<T>::deq(T *e, bool blocking)
 {
 	ScopedLock ml(&m_);
 
 	while(1) {
 		if(q_.empty()){
+			if (!blocking)
+				return false;
 			VERIFY (pthread_cond_wait(&non_empty_c_, &m_) == 0);
 		} else {
 			*e = q_.front();
@@ -88,7 +91,7 @@ fifo<T>::deq(T *e)
 			break;
 		}
 	}
-	return;
+	return true;
 }
 
 #endif
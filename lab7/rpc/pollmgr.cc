@@ -1,7 +1,12 @@
 #include <sys/time.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include "slock.h"
 #include "jsl_log.h"
@@ -28,8 +33,19 @@ PollMgr::Instance()
 PollMgr::PollMgr() : pending_change_(false)
 {
 	bzero(callbacks_, MAX_POLL_FDS*sizeof(void *));
-	aio_ = new SelectAIO();
-	//aio_ = new EPollAIO();
+	aio_ = NULL;
+
+	// $RPC_AIO=select picks select; the default is epoll on linux
+	const char *which = getenv("RPC_AIO");
+	if (which && strcmp(which, "select") == 0)
+		aio_ = new SelectAIO();
+#ifdef __linux__
+	if (!aio_)
+		aio_ = new EPollAIO();
+#else
+	if (!aio_)
+		aio_ = new SelectAIO();
+#endif
 
 	VERIFY(pthread_mutex_init(&m_, NULL) == 0);
 	VERIFY(pthread_cond_init(&changedone_c_, NULL) == 0);
@@ -263,37 +279,36 @@ EPollAIO::EPollAIO()
 	pollfd_ = epoll_create(MAX_POLL_FDS);
 	VERIFY(pollfd_ >= 0);
 	bzero(fdstatus_, sizeof(int)*MAX_POLL_FDS);
+	VERIFY(pthread_mutex_init(&m_, NULL) == 0);
+
+	evfd_ = eventfd(0, EFD_NONBLOCK);
+	VERIFY(evfd_ >= 0);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = evfd_;
+	VERIFY(epoll_ctl(pollfd_, EPOLL_CTL_ADD, evfd_, &ev) == 0);
 }
 
 EPollAIO::~EPollAIO()
 {
 	close(pollfd_);
+	close(evfd_);
+	VERIFY(pthread_mutex_destroy(&m_) == 0);
 }
 
-static inline
-int poll_flag_to_event(poll_flag flag)
-{
-	int f;
-	if (flag == CB_RDONLY) {
-		f = EPOLLIN;
-	}else if (flag == CB_WRONLY) {
-		f = EPOLLOUT;
-	}else { //flag == CB_RDWR
-		f = EPOLLIN | EPOLLOUT;
-	}
-	return f;
-}
-
+// level-triggered like select: connection reads one pdu per callback
+// and counts on being called again while there is more
 void
 EPollAIO::watch_fd(int fd, poll_flag flag)
 {
 	VERIFY(fd < MAX_POLL_FDS);
 
+	ScopedLock ml(&m_);
 	struct epoll_event ev;
 	int op = fdstatus_[fd]? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
 	fdstatus_[fd] |= (int)flag;
 
-	ev.events = EPOLLET;
+	ev.events = 0;
 	ev.data.fd = fd;
 
 	if (fdstatus_[fd] & CB_RDONLY) {
@@ -303,10 +318,6 @@ EPollAIO::watch_fd(int fd, poll_flag flag)
 		ev.events |= EPOLLOUT;
 	}
 
-	if (flag == CB_RDWR) {
-		VERIFY(ev.events == (uint32_t)(EPOLLET | EPOLLIN | EPOLLOUT));
-	}
-
 	VERIFY(epoll_ctl(pollfd_, op, fd, &ev) == 0);
 }
 
@@ -314,33 +325,38 @@ bool
 EPollAIO::unwatch_fd(int fd, poll_flag flag)
 {
 	VERIFY(fd < MAX_POLL_FDS);
-	fdstatus_[fd] &= ~(int)flag;
-
-	struct epoll_event ev;
-	int op = fdstatus_[fd]? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-
-	ev.events = EPOLLET;
-	ev.data.fd = fd;
 
-	if (fdstatus_[fd] & CB_RDONLY) {
-		ev.events |= EPOLLIN;
-	}
-	if (fdstatus_[fd] & CB_WRONLY) {
-		ev.events |= EPOLLOUT;
+	ScopedLock ml(&m_);
+	if (fdstatus_[fd]) {
+		fdstatus_[fd] &= ~(int)flag;
+		int op = fdstatus_[fd]? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+		if (flag == CB_RDWR) {
+			VERIFY(op == EPOLL_CTL_DEL);
+		}
+		struct epoll_event ev;
+		ev.events = 0;
+		ev.data.fd = fd;
+		if (fdstatus_[fd] & CB_RDONLY) {
+			ev.events |= EPOLLIN;
+		}
+		if (fdstatus_[fd] & CB_WRONLY) {
+			ev.events |= EPOLLOUT;
+		}
+		VERIFY(epoll_ctl(pollfd_, op, fd, &ev) == 0);
 	}
-
 	if (flag == CB_RDWR) {
-		VERIFY(op == EPOLL_CTL_DEL);
+		uint64_t one = 1;
+		VERIFY(write(evfd_, &one, sizeof(one)) == sizeof(one));
 	}
-	VERIFY(epoll_ctl(pollfd_, op, fd, &ev) == 0);
-	return (op == EPOLL_CTL_DEL);
+	return fdstatus_[fd] == 0;
 }
 
 bool
 EPollAIO::is_watched(int fd, poll_flag flag)
 {
 	VERIFY(fd < MAX_POLL_FDS);
-	return ((fdstatus_[fd] & CB_MASK) == flag);
+	ScopedLock ml(&m_);
+	return ((fdstatus_[fd] & flag) == flag);
 }
 
 void
@@ -348,7 +364,13 @@ EPollAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
 {
 	int nfds = epoll_wait(pollfd_, ready_,	MAX_POLL_FDS, -1);
 	for (int i = 0; i < nfds; i++) {
-		if (ready_[i].events & EPOLLIN) {
+		if (ready_[i].data.fd == evfd_) {
+			uint64_t n;
+			VERIFY(read(evfd_, &n, sizeof(n)) == sizeof(n));
+			continue;
+		}
+		// report errors and hangups so the callback finds out
+		if (ready_[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP)) {
 			readable->push_back(ready_[i].data.fd);
 		}
 		if (ready_[i].events & EPOLLOUT) {
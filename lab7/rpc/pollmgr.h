@@ -97,8 +97,10 @@ class EPollAIO : public aio_mgr {
 
 	private:
 		int pollfd_;
+		int evfd_; // wakes epoll_wait for block_remove_fd, like SelectAIO's pipe
 		struct epoll_event ready_[MAX_POLL_FDS];
 		int fdstatus_[MAX_POLL_FDS];
+		pthread_mutex_t m_;
 
 };
 #endif /* __linux */
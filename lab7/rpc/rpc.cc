@@ -70,13 +70,21 @@
 #include <time.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <limits.h>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "jsl_log.h"
 #include "gettime.h"
 #include "lang/verify.h"
 
-const rpcc::TO rpcc::to_max = { 120000 };
-const rpcc::TO rpcc::to_min = { 1000 };
+const rpcc::TO rpcc::to_max = { 120000, false };
+const rpcc::TO rpcc::to_min = { 1000, false };
+const rpcc::TO rpcc::rto_floor = { 10, false };
+const rpcc::TO rpcc::rto_cap = { 1000, false };
 
 rpcc::caller::caller(unsigned int xxid, unmarshall *xun)
 : xid(xxid), un(xun), done(false)
@@ -99,9 +107,19 @@ void set_rand_seed()
 	srandom((int)ts.tv_nsec^((int)getpid()));
 }
 
-rpcc::rpcc(sockaddr_in d, bool retrans) :
-	dst_(d), srv_nonce_(0), bind_done_(false), xid_(1), lossytest_(0),
-	retrans_(retrans), reachable_(true), chan_(NULL), destroy_wait_ (false), xid_rep_done_(-1)
+// $RPC_COMPACT=0 turns the compact encoding off: clients don't offer
+// it and servers don't take it
+static bool
+compact_enabled()
+{
+	char *env = getenv("RPC_COMPACT");
+	return env == NULL || atoi(env) != 0;
+}
+
+rpcc::rpcc(sockaddr_in d, bool retrans, int nchans, rpc_transport t) :
+	dst_(d), transport_(t), srv_nonce_(0), bind_done_(false), xid_(1), lossytest_(0),
+	delay_us_(0), retrans_(retrans), reachable_(true), compact_(false), next_bulk_(0), destroy_wait_ (false), xid_rep_done_(-1),
+	srtt_us_(0), rttvar_us_(0), rtt_samples_(0), timeouts_(0), retransmits_(0)
 {
 	VERIFY(pthread_mutex_init(&m_, 0) == 0);
 	VERIFY(pthread_mutex_init(&chan_m_, 0) == 0);
@@ -122,6 +140,21 @@ rpcc::rpcc(sockaddr_in d, bool retrans) :
 		lossytest_ = atoi(loss_env);
 	}
 
+	// $RPC_DELAY microseconds of one-way latency, so that tests on
+	// localhost can act like a network
+	char *delay_env = getenv("RPC_DELAY");
+	if(delay_env != NULL){
+		delay_us_ = atoi(delay_env);
+	}
+
+	if(nchans <= 0){
+		char *conns_env = getenv("RPC_CONNS");
+		nchans = conns_env ? atoi(conns_env) : 2;
+		if(nchans <= 0)
+			nchans = 1;
+	}
+	chans_.resize(nchans, NULL);
+
 	// xid starts with 1 and latest received reply starts with 0
 	xid_rep_window_.push_back(0);
 
@@ -134,10 +167,12 @@ rpcc::rpcc(sockaddr_in d, bool retrans) :
 rpcc::~rpcc()
 {
 	jsl_log(JSL_DBG_2, "rpcc::~rpcc delete nonce %d channo=%d\n",
-			clt_nonce_, chan_?chan_->channo():-1);
-	if(chan_){
-		chan_->closeconn();
-		chan_->decref();
+			clt_nonce_, chans_[0]?chans_[0]->channo():-1);
+	for(unsigned int i = 0; i < chans_.size(); i++){
+		if(chans_[i]){
+			chans_[i]->closeconn();
+			chans_[i]->decref();
+		}
 	}
 	VERIFY(calls_.size() == 0);
 	VERIFY(pthread_mutex_destroy(&m_) == 0);
@@ -148,11 +183,19 @@ int
 rpcc::bind(TO to)
 {
 	int r;
-	int ret = call(rpc_const::bind, 0, r, to);
+	marshall m;
+	unmarshall u;
+	// offer the compact encoding. a server that takes it answers in
+	// it; one that doesn't, or predates it, ignores the offer
+	m << (compact_enabled() ? rpc_const::opt_compact : 0);
+	int ret = call1(rpc_const::bind, m, u, to);
 	if(ret == 0){
+		u >> r;
+		VERIFY(u.okdone());
 		ScopedLock ml(&m_);
 		bind_done_ = true;
 		srv_nonce_ = r;
+		compact_ = u.compact();
 	} else {
 		jsl_log(JSL_DBG_2, "rpcc::bind %s failed %d\n",
 				inet_ntoa(dst_.sin_addr), ret);
@@ -193,6 +236,8 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 
 	caller ca(0, &rep);
         int xid_rep;
+	TO curr_to;
+	unsigned int chan;
 	{
 		ScopedLock ml(&m_);
 
@@ -213,21 +258,22 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
                              xid_rep_window_.front());
 		req.pack_req_header(h);
                 xid_rep = xid_rep_window_.front();
+		curr_to.to = rto_wo();
+		chan = pick_chan_wo(proc, req.size());
 	}
 
-	TO curr_to;
-	struct timespec now, nextdeadline, finaldeadline;
+	struct timespec now, nextdeadline, finaldeadline, sent;
 
 	clock_gettime(CLOCK_REALTIME, &now);
 	add_timespec(now, to.to, &finaldeadline);
-	curr_to.to = to_min.to;
 
 	bool transmit = true;
+	int transmissions = 0;
 	connection *ch = NULL;
 
 	while (1){
 		if(transmit){
-			get_refconn(&ch);
+			get_refconn(&ch, chan);
 			if(ch){
 			        if(reachable_) {
                                         request forgot;
@@ -238,6 +284,8 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
                                                         dup_req_.clear();
                                                 }
                                         }
+                                        if (delay_us_ > 0)
+                                                usleep(delay_us_);
                                         if (forgot.isvalid())
                                                 ch->send((char *)forgot.buf.c_str(), forgot.buf.size());
                                         ch->send(req.cstr(), req.size());
@@ -246,6 +294,18 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 				jsl_log(JSL_DBG_2,
 						"rpcc::call1 %u just sent req proc %x xid %u clt_nonce %d\n",
 						clt_nonce_, proc, ca.xid, clt_nonce_);
+				if (transmissions++ == 0) {
+					clock_gettime(CLOCK_MONOTONIC, &sent);
+				} else {
+					ScopedLock ml(&m_);
+					retransmits_++;
+				}
+			} else if (to.fail_fast) {
+				// nothing listens there (connection refused)
+				// and the caller would rather try elsewhere
+				// than wait for it to come back
+				jsl_log(JSL_DBG_1, "rpcc::call1: cannot connect\n");
+				break;
 			}
 			transmit = false; // only send once on a given channel
 		}
@@ -276,12 +336,18 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 			}
 		}
 
+		{
+			ScopedLock ml(&m_);
+			timeouts_++;
+		}
 		if(retrans_ && (!ch || ch->isdead())){
 			// since connection is dead, retransmit
                         // on the new connection
 			transmit = true;
 		}
 		curr_to.to <<= 1;
+		if(curr_to.to > rto_cap.to)
+			curr_to.to = rto_cap.to;
 	}
 
 	{
@@ -293,6 +359,12 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 		// I don't think there's any harm in maybe doing it twice
 		update_xid_rep(ca.xid);
 
+		if(ca.done && transmissions == 1){
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			rtt_sample_wo((now.tv_sec - sent.tv_sec) * 1000000LL +
+					(now.tv_nsec - sent.tv_nsec) / 1000);
+		}
+
 		if(destroy_wait_){
 		  VERIFY(pthread_cond_signal(&destroy_wait_c_) == 0);
 		}
@@ -323,21 +395,85 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 	return (ca.done? ca.intret : rpc_const::timeout_failure);
 }
 
+// caller holds m_
+void
+rpcc::rtt_sample_wo(long long us)
+{
+	if(rtt_samples_++ == 0){
+		srtt_us_ = us;
+		rttvar_us_ = us / 2;
+	} else {
+		long long err = us > srtt_us_ ? us - srtt_us_ : srtt_us_ - us;
+		rttvar_us_ += (err - rttvar_us_) / 4;
+		srtt_us_ += (us - srtt_us_) / 8;
+	}
+}
+
+// retransmit timeout in ms: srtt + 4 * rttvar, within [rto_floor, rto_cap].
+// caller holds m_
+int
+rpcc::rto_wo()
+{
+	if(rtt_samples_ == 0)
+		return to_min.to;
+	int rto = (srtt_us_ + 4 * rttvar_us_ + 999) / 1000;
+	if(rto < rto_floor.to)
+		rto = rto_floor.to;
+	if(rto > rto_cap.to)
+		rto = rto_cap.to;
+	return rto;
+}
+
+rpcc::rtt_stats
+rpcc::stats()
+{
+	ScopedLock ml(&m_);
+	rtt_stats st;
+	st.srtt_us = srtt_us_;
+	st.rttvar_us = rttvar_us_;
+	st.rto_ms = rto_wo();
+	st.samples = rtt_samples_;
+	st.timeouts = timeouts_;
+	st.retransmits = retransmits_;
+	return st;
+}
+
+void
+rpcc::set_bulk(unsigned int proc)
+{
+	ScopedLock ml(&m_);
+	bulk_procs_.insert(proc);
+}
+
+// caller holds m_
+unsigned int
+rpcc::pick_chan_wo(unsigned int proc, int sz)
+{
+	if(chans_.size() == 1 || proc == rpc_const::bind)
+		return 0;
+	if(sz < bulk_threshold && !bulk_procs_.count(proc))
+		return 0;
+	return 1 + next_bulk_++ % (chans_.size() - 1);
+}
+
 void
-rpcc::get_refconn(connection **ch)
+rpcc::get_refconn(connection **ch, unsigned int idx)
 {
 	ScopedLock ml(&chan_m_);
-	if(!chan_ || chan_->isdead()){
-		if(chan_)
-			chan_->decref();
-		chan_ = connect_to_dst(dst_, this, lossytest_);
+	connection *&chan = chans_[idx];
+	if(!chan || chan->isdead()){
+		if(chan)
+			chan->decref();
+		chan = connect_to_dst(dst_, this, lossytest_, transport_);
 	}
-	if(ch && chan_){
+	if(ch){
+		// on a failed reconnect, don't hand back the dead connection
 		if(*ch){
 			(*ch)->decref();
 		}
-		*ch = chan_;
-		(*ch)->incref();
+		*ch = chan;
+		if(chan)
+			(*ch)->incref();
 	}
 }
 
@@ -409,8 +545,36 @@ compress:
 }
 
 
+// unmarshals and marshals like method_handler for rpcbind(), but
+// picks the encoding of the reply: compact if the client offered it
+// and this server takes it, which is how the client learns the outcome
+struct rpcs::bind_handler : public handler {
+	rpcs *s_;
+	bind_handler(rpcs *s) : s_(s) { }
+	int fn(unmarshall &args, marshall &ret) {
+		int a, r;
+		args >> a;
+		if(!args.okdone())
+			return rpc_const::unmarshal_args_failure;
+		int b = s_->rpcbind(a, r);
+		ret.set_compact((a & rpc_const::opt_compact) && s_->compact_ok_);
+		ret << r;
+		return b;
+	}
+};
+
+// count 0 means $RPC_COUNT, so servers made inside the RSM layer
+// can print stats too
+static int
+count_or_env(int count)
+{
+	char *env = getenv("RPC_COUNT");
+	return count || env == NULL ? count : atoi(env);
+}
+
 rpcs::rpcs(unsigned int p1, int count)
-  : port_(p1), counting_(count), curr_counts_(count), lossytest_(0), reachable_ (true)
+  : port_(p1), counting_(count_or_env(count)), curr_counts_(counting_), bytes_in_(0), bytes_out_(0),
+    rpcs_counted_(0), lossytest_(0), reachable_ (true), compact_ok_(compact_enabled())
 {
 	VERIFY(pthread_mutex_init(&procs_m_, 0) == 0);
 	VERIFY(pthread_mutex_init(&count_m_, 0) == 0);
@@ -426,8 +590,10 @@ rpcs::rpcs(unsigned int p1, int count)
 		lossytest_ = atoi(loss_env);
 	}
 
-	reg(rpc_const::bind, this, &rpcs::rpcbind);
-	dispatchpool_ = new ThrPool(6,false);
+	reg1(rpc_const::bind, new bind_handler(this), false);
+	set_prio(rpc_const::bind, PRIO_CONTROL);
+	dispatchpool_[PRIO_CONTROL] = new ThrPool(2,false);
+	dispatchpool_[PRIO_DATA] = new ThrPool(6,false);
 
 	listener_ = new tcpsconn(this, port_, lossytest_);
 }
@@ -436,7 +602,8 @@ rpcs::~rpcs()
 {
 	// must delete listener before dispatchpool
 	delete listener_;
-	delete dispatchpool_;
+	for (int i = 0; i < NPRIO; i++)
+		delete dispatchpool_[i];
 	free_reply_window();
 }
 
@@ -448,9 +615,21 @@ rpcs::got_pdu(connection *c, char *b, int sz)
             return true;
         }
 
+	// peek at the proc number to pick the dispatch queue; a
+	// malformed header goes to the data queue and dispatch() drops it.
+	prio_t p = PRIO_DATA;
+	{
+		unmarshall un(b, sz);
+		req_header h;
+		un.unpack_req_header(&h);
+		if (un.ok())
+			p = prio_of(h.proc);
+		un.take_buf(&b, &sz);
+	}
+
 	djob_t *j = new djob_t(c, b, sz);
 	c->incref();
-	bool succ = dispatchpool_->addObjJob(this, &rpcs::dispatch, j);
+	bool succ = dispatchpool_[p]->addObjJob(this, &rpcs::dispatch, j);
 	if(!succ || !reachable_){
 		c->decref();
 		delete j;
@@ -459,19 +638,56 @@ rpcs::got_pdu(connection *c, char *b, int sz)
 }
 
 void
-rpcs::reg1(unsigned int proc, handler *h)
+rpcs::reg1(unsigned int proc, handler *h, bool idempotent)
 {
 	ScopedLock pl(&procs_m_);
 	VERIFY(procs_.count(proc) == 0);
 	procs_[proc] = h;
+	if (idempotent)
+		idempotent_.insert(proc);
 	VERIFY(procs_.count(proc) >= 1);
 }
 
 void
-rpcs::updatestat(unsigned int proc)
+rpcs::set_prio(unsigned int proc, prio_t p)
+{
+	VERIFY(p >= 0 && p < NPRIO);
+	ScopedLock pl(&procs_m_);
+	prios_[proc] = p;
+}
+
+size_t
+rpcs::reply_window_bytes()
+{
+	ScopedLock rwl(&reply_window_m_);
+	std::map<unsigned int, reply_list>::iterator clt;
+	reply_list::iterator it;
+	size_t n = 0;
+	for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++){
+		for (it = clt->second.begin(); it != clt->second.end(); it++){
+			if (it->cb_present)
+				n += it->sz;
+		}
+	}
+	return n;
+}
+
+rpcs::prio_t
+rpcs::prio_of(unsigned int proc)
+{
+	ScopedLock pl(&procs_m_);
+	std::map<unsigned int, prio_t>::iterator i = prios_.find(proc);
+	return i == prios_.end() ? PRIO_DATA : i->second;
+}
+
+void
+rpcs::updatestat(unsigned int proc, int reqsz, int repsz)
 {
 	ScopedLock cl(&count_m_);
 	counts_[proc]++;
+	bytes_in_ += reqsz;
+	bytes_out_ += repsz;
+	rpcs_counted_++;
 	curr_counts_--;
 	if(curr_counts_ == 0){
 		std::map<int, int>::iterator i;
@@ -480,9 +696,13 @@ rpcs::updatestat(unsigned int proc)
 			printf("%x:%d ", i->first, i->second);
 		}
 		printf("\n");
+		printf("RPC BYTES: %lu rpcs, %llu in %llu out, %.1f in %.1f out per rpc\n",
+		       rpcs_counted_, bytes_in_, bytes_out_,
+		       (double) bytes_in_ / rpcs_counted_,
+		       (double) bytes_out_ / rpcs_counted_);
 
 		ScopedLock rwl(&reply_window_m_);
-		std::map<unsigned int,std::list<reply_t> >::iterator clt;
+		std::map<unsigned int, reply_list>::iterator clt;
 
 		unsigned int totalrep = 0, maxrep = 0;
 		for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++){
@@ -517,7 +737,9 @@ rpcs::dispatch(djob_t *j)
 			"rpcs::dispatch: rpc %u (proc %x, last_rep %u) from clt %u for srv instance %u \n",
 			h.xid, proc, h.xid_rep, h.clt_nonce, h.srv_nonce);
 
+	// answer in the encoding the request came in
 	marshall rep;
+	rep.set_compact(req.compact());
 	reply_header rh(h.xid,0);
 
 	// is client sending to an old instance of server?
@@ -532,6 +754,7 @@ rpcs::dispatch(djob_t *j)
 	}
 
 	handler *f;
+	bool idem;
 	// is RPC proc a registered procedure?
 	{
 		ScopedLock pl(&procs_m_);
@@ -544,6 +767,7 @@ rpcs::dispatch(djob_t *j)
 		}
 
 		f = procs_[proc];
+		idem = idempotent_.count(proc) > 0;
 	}
 
 	rpcs::rpcstate_t stat;
@@ -576,8 +800,13 @@ rpcs::dispatch(djob_t *j)
 			}
 		}
 
-		stat = checkduplicate_and_update(h.clt_nonce, h.xid,
-                                                 h.xid_rep, &b1, &sz1);
+		if(idem){
+			// a retransmitted read just runs again
+			stat = NEW;
+		} else {
+			stat = checkduplicate_and_update(h.clt_nonce, h.xid,
+							 h.xid_rep, &b1, &sz1);
+		}
 	} else {
 		// this client does not require at most once logic
 		stat = NEW;
@@ -585,10 +814,6 @@ rpcs::dispatch(djob_t *j)
 
 	switch (stat){
 		case NEW: // new request
-			if(counting_){
-				updatestat(proc);
-			}
-
 			rh.ret = f->fn(req, rep);
                         if (rh.ret == rpc_const::unmarshal_args_failure) {
                                 fprintf(stderr, "rpcs::dispatch: failed to"
@@ -602,11 +827,15 @@ rpcs::dispatch(djob_t *j)
 			rep.pack_reply_header(rh);
 			rep.take_buf(&b1,&sz1);
 
+			if(counting_){
+				updatestat(proc, req.size(), sz1);
+			}
+
 			jsl_log(JSL_DBG_2,
 					"rpcs::dispatch: sending and saving reply of size %d for rpc %u, proc %x ret %d, clt %u\n",
 					sz1, h.xid, proc, rh.ret, h.clt_nonce);
 
-			if(h.clt_nonce > 0){
+			if(h.clt_nonce > 0 && !idem){
 				// only record replies for clients that require at-most-once logic
 				add_reply(h.clt_nonce, h.xid, b1, sz1);
 			}
@@ -622,9 +851,9 @@ rpcs::dispatch(djob_t *j)
 			}
 
 			c->send(b1, sz1);
-			if(h.clt_nonce == 0){
+			if(h.clt_nonce == 0 || idem){
 				// reply is not added to at-most-once window, free it
-				free(b1);
+				bufpool_free(b1);
 			}
 			break;
 		case INPROGRESS: // server is working on this request
@@ -660,7 +889,8 @@ rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
 	// You fill this in for Lab 1.
 	// reply_window_[clt_nonce]中的xid是按从小到大的顺序排序的
 	// 第一个xid都比请求的xid大说明请求的xid已经被丢弃了
-	if (reply_window_[clt_nonce].front().xid > xid)
+	if (!reply_window_[clt_nonce].empty() &&
+	    reply_window_[clt_nonce].front().xid > xid)
 	{
 		return FORGOTTEN;
 	}
@@ -672,7 +902,7 @@ rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
 	{
 		if(it->xid < xid_rep && it->cb_present)
 		{
-			free(it->buf);
+			bufpool_free(it->buf);
 			it = reply_window_[clt_nonce].erase(it);
 			--it;
 		}
@@ -713,7 +943,7 @@ rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
 // and passes the return value in b and sz.
 // add_reply() should remember b and sz.
 // free_reply_window() and checkduplicate_and_update is responsible for
-// calling free(b).
+// calling bufpool_free(b).
 void
 rpcs::add_reply(unsigned int clt_nonce, unsigned int xid,
 		char *b, int sz)
@@ -739,13 +969,13 @@ rpcs::add_reply(unsigned int clt_nonce, unsigned int xid,
 void
 rpcs::free_reply_window(void)
 {
-	std::map<unsigned int,std::list<reply_t> >::iterator clt;
-	std::list<reply_t>::iterator it;
+	std::map<unsigned int, reply_list>::iterator clt;
+	reply_list::iterator it;
 
 	ScopedLock rwl(&reply_window_m_);
 	for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++){
 		for (it = clt->second.begin(); it != clt->second.end(); it++){
-			free((*it).buf);
+			bufpool_free((*it).buf);
 		}
 		clt->second.clear();
 	}
@@ -762,117 +992,156 @@ rpcs::rpcbind(int a, int &r)
 }
 
 void
-marshall::rawbyte(unsigned char x)
+marshall::grow(size_t n)
 {
-	if(_ind >= _capa){
-		_capa *= 2;
-		VERIFY (_buf != NULL);
-		_buf = (char *)realloc(_buf, _capa);
-		VERIFY(_buf);
-	}
-	_buf[_ind++] = x;
+	VERIFY(_buf != NULL);
+	VERIFY(_ind + n <= (size_t) INT_MAX);
+	size_t capa = _capa;
+	while (capa < _ind + n)
+		capa = capa < (size_t) INT_MAX / 2 ? 2 * capa : (size_t) INT_MAX;
+	_capa = capa;
+	_buf = (char *)bufpool_realloc(_buf, _capa);
+	VERIFY(_buf);
 }
 
+// write the n header words as varints right after the length word,
+// and slide the content down (or up) to follow them
 void
-marshall::rawbytes(const char *p, int n)
-{
-	if((_ind+n) > _capa){
-		_capa = _capa > n? 2*_capa:(_capa+n);
-		VERIFY (_buf != NULL);
-		_buf = (char *)realloc(_buf, _capa);
-		VERIFY(_buf);
-	}
-	memcpy(_buf+_ind, p, n);
-	_ind += n;
-}
-
-marshall &
-operator<<(marshall &m, bool x)
-{
-	m.rawbyte(x);
-	return m;
-}
-
-marshall &
-operator<<(marshall &m, unsigned char x)
-{
-	m.rawbyte(x);
-	return m;
-}
-
-marshall &
-operator<<(marshall &m, char x)
-{
-	m << (unsigned char) x;
-	return m;
-}
-
-
-marshall &
-operator<<(marshall &m, unsigned short x)
-{
-	m.rawbyte((x >> 8) & 0xff);
-	m.rawbyte(x & 0xff);
-	return m;
-}
-
-marshall &
-operator<<(marshall &m, short x)
+marshall::pack_compact_header(const uint64_t *w, int n)
 {
-	m << (unsigned short) x;
-	return m;
+	char h[10 * 8];
+	int hlen = 0;
+	VERIFY(n <= 8);
+	for (int i = 0; i < n; i++)
+		hlen += rpc_varint_put(h + hlen, w[i]);
+
+	int start = sizeof(rpc_sz_t);
+#if RPC_CHECKSUMMING
+	start += sizeof(rpc_checksum_t);
+#endif
+	int len = _ind - _body;
+	if (start + hlen > _body)
+		reserve(start + hlen - _body);
+	memmove(_buf + start + hlen, _buf + _body, len);
+	memcpy(_buf + start, h, hlen);
+	_body = start + hlen;
+	_ind = _body + len;
+	_buf[0] = (char) 0x80;
 }
 
-marshall &
-operator<<(marshall &m, unsigned int x)
+// Byte-swap n words from src into dst (either may be unaligned). The
+// build doesn't optimize, so the vector loops are spelled out with
+// intrinsics: pshufb does 16 bytes in one go where SSSE3 is available,
+// plain SSE2 gets there with shifts and word shuffles.
+static void
+bswap32s(char *dst, const char *src, size_t n)
 {
-	// network order is big-endian
-	m.rawbyte((x >> 24) & 0xff);
-	m.rawbyte((x >> 16) & 0xff);
-	m.rawbyte((x >> 8) & 0xff);
-	m.rawbyte(x & 0xff);
-	return m;
+	size_t i = 0;
+#if defined(__SSSE3__)
+	const __m128i rev = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+	    4, 5, 6, 7, 0, 1, 2, 3);
+	for (; i + 4 <= n; i += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (src + 4*i));
+		_mm_storeu_si128((__m128i *) (dst + 4*i), _mm_shuffle_epi8(x, rev));
+	}
+#elif defined(__SSE2__)
+	for (; i + 4 <= n; i += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (src + 4*i));
+		// swap the bytes of each 16-bit half, then the halves
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+		x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+		x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+		_mm_storeu_si128((__m128i *) (dst + 4*i), x);
+	}
+#endif
+	for (; i < n; i++) {
+		uint32_t x;
+		memcpy(&x, src + 4*i, 4);
+		x = rpc_be32(x);
+		memcpy(dst + 4*i, &x, 4);
+	}
 }
 
-marshall &
-operator<<(marshall &m, int x)
+static void
+bswap64s(char *dst, const char *src, size_t n)
 {
-	m << (unsigned int) x;
-	return m;
+	size_t i = 0;
+#if defined(__SSSE3__)
+	const __m128i rev = _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15,
+	    0, 1, 2, 3, 4, 5, 6, 7);
+	for (; i + 2 <= n; i += 2) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (src + 8*i));
+		_mm_storeu_si128((__m128i *) (dst + 8*i), _mm_shuffle_epi8(x, rev));
+	}
+#elif defined(__SSE2__)
+	for (; i + 2 <= n; i += 2) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (src + 8*i));
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+		x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(0, 1, 2, 3));
+		x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(0, 1, 2, 3));
+		_mm_storeu_si128((__m128i *) (dst + 8*i), x);
+	}
+#endif
+	for (; i < n; i++) {
+		uint64_t x;
+		memcpy(&x, src + 8*i, 8);
+		x = rpc_be64(x);
+		memcpy(dst + 8*i, &x, 8);
+	}
 }
 
-marshall &
-operator<<(marshall &m, const std::string &s)
+void
+marshall::put32s(const uint32_t *v, size_t n)
 {
-	m << (unsigned int) s.size();
-	m.rawbytes(s.data(), s.size());
-	return m;
+	reserve(4*n);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	memcpy(_buf + _ind, v, 4*n);
+#else
+	bswap32s(_buf + _ind, (const char *) v, n);
+#endif
+	_ind += 4*n;
 }
 
-marshall &
-operator<<(marshall &m, unsigned long long x)
+void
+marshall::put64s(const uint64_t *v, size_t n)
 {
-	m << (unsigned int) (x >> 32);
-	m << (unsigned int) x;
-	return m;
+	reserve(8*n);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	memcpy(_buf + _ind, v, 8*n);
+#else
+	bswap64s(_buf + _ind, (const char *) v, n);
+#endif
+	_ind += 8*n;
 }
 
-void
-marshall::pack(int x)
+// a swap is its own inverse, so decoding is the same loop run the
+// other way: swap from the buffer into the caller's words
+bool
+unmarshall::get32s(uint32_t *v, size_t n)
 {
-	rawbyte((x >> 24) & 0xff);
-	rawbyte((x >> 16) & 0xff);
-	rawbyte((x >> 8) & 0xff);
-	rawbyte(x & 0xff);
+	if (!check(4*n))
+		return false;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	memcpy(v, _buf + _ind, 4*n);
+#else
+	bswap32s((char *) v, _buf + _ind, n);
+#endif
+	_ind += 4*n;
+	return true;
 }
 
-void
-unmarshall::unpack(int *x)
+bool
+unmarshall::get64s(uint64_t *v, size_t n)
 {
-	(*x) = (rawbyte() & 0xff) << 24;
-	(*x) |= (rawbyte() & 0xff) << 16;
-	(*x) |= (rawbyte() & 0xff) << 8;
-	(*x) |= rawbyte() & 0xff;
+	if (!check(8*n))
+		return false;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	memcpy(v, _buf + _ind, 8*n);
+#else
+	bswap64s((char *) v, _buf + _ind, n);
+#endif
+	_ind += 8*n;
+	return true;
 }
 
 // take the contents from another unmarshall object
@@ -880,10 +1149,13 @@ void
 unmarshall::take_in(unmarshall &another)
 {
 	if(_buf)
-		free(_buf);
+		bufpool_free(_buf);
+	// carry on after the header, wherever its encoding put the end
+	int ind = another._ind;
+	_compact = another._compact;
 	another.take_buf(&_buf, &_sz);
-	_ind = RPC_HEADER_SZ;
-	_ok = _sz >= RPC_HEADER_SZ?true:false;
+	_ind = ind;
+	_ok = _sz >= ind?true:false;
 }
 
 bool
@@ -896,104 +1168,13 @@ unmarshall::okdone()
 	}
 }
 
-unsigned int
-unmarshall::rawbyte()
-{
-	char c = 0;
-	if(_ind >= _sz)
-		_ok = false;
-	else
-		c = _buf[_ind++];
-	return c;
-}
-
-unmarshall &
-operator>>(unmarshall &u, bool &x)
-{
-	x = (bool) u.rawbyte() ;
-	return u;
-}
-
-unmarshall &
-operator>>(unmarshall &u, unsigned char &x)
-{
-	x = (unsigned char) u.rawbyte() ;
-	return u;
-}
-
-unmarshall &
-operator>>(unmarshall &u, char &x)
-{
-	x = (char) u.rawbyte();
-	return u;
-}
-
-
-unmarshall &
-operator>>(unmarshall &u, unsigned short &x)
-{
-	x = (u.rawbyte() & 0xff) << 8;
-	x |= u.rawbyte() & 0xff;
-	return u;
-}
-
-unmarshall &
-operator>>(unmarshall &u, short &x)
-{
-	x = (u.rawbyte() & 0xff) << 8;
-	x |= u.rawbyte() & 0xff;
-	return u;
-}
-
-unmarshall &
-operator>>(unmarshall &u, unsigned int &x)
-{
-	x = (u.rawbyte() & 0xff) << 24;
-	x |= (u.rawbyte() & 0xff) << 16;
-	x |= (u.rawbyte() & 0xff) << 8;
-	x |= u.rawbyte() & 0xff;
-	return u;
-}
-
-unmarshall &
-operator>>(unmarshall &u, int &x)
-{
-	x = (u.rawbyte() & 0xff) << 24;
-	x |= (u.rawbyte() & 0xff) << 16;
-	x |= (u.rawbyte() & 0xff) << 8;
-	x |= u.rawbyte() & 0xff;
-	return u;
-}
-
-unmarshall &
-operator>>(unmarshall &u, unsigned long long &x)
-{
-	unsigned int h, l;
-	u >> h;
-	u >> l;
-	x = l | ((unsigned long long) h << 32);
-	return u;
-}
-
-unmarshall &
-operator>>(unmarshall &u, std::string &s)
-{
-	unsigned sz;
-	u >> sz;
-	if(u.ok())
-		u.rawbytes(s, sz);
-	return u;
-}
-
 void
 unmarshall::rawbytes(std::string &ss, unsigned int n)
 {
-	if((_ind+n) > (unsigned)_sz){
+	if(n > remaining()){
 		_ok = false;
 	} else {
-		std::string tmps = std::string(_buf+_ind, n);
-		swap(ss, tmps);
-		VERIFY(ss.size() == n);
+		ss.assign(_buf+_ind, n);
 		_ind += n;
 	}
 }
@@ -1005,9 +1186,18 @@ bool operator<(const sockaddr_in &a, const sockaddr_in &b){
 }
 
 /*---------------auxilary function--------------*/
-void
+rpc_transport
 make_sockaddr(const char *hostandport, struct sockaddr_in *dst){
 
+	rpc_transport t = TRANSPORT_TCP;
+	if(strncmp(hostandport, "unix:", 5) == 0){
+		t = TRANSPORT_UNIX;
+		hostandport += 5;
+	} else if(strncmp(hostandport, "shm:", 4) == 0){
+		t = TRANSPORT_SHM;
+		hostandport += 4;
+	}
+
 	char host[200];
 	const char *localhost = "127.0.0.1";
 	const char *port = index(hostandport, ':');
@@ -1021,7 +1211,7 @@ make_sockaddr(const char *hostandport, struct sockaddr_in *dst){
 	}
 
 	make_sockaddr(host, port, dst);
-
+	return t;
 }
 
 void
@@ -5,6 +5,11 @@
 #include <netinet/in.h>
 #include <list>
 #include <map>
+#include <set>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 #include <stdio.h>
 
 #include "thr_pool.h"
@@ -25,6 +30,9 @@ class rpc_const {
 		static const int oldsrv_failure = -5;
 		static const int bind_failure = -6;
 		static const int cancel_failure = -7;
+
+		// wire options a client offers in its bind request
+		static const int opt_compact = 1;
 };
 
 // rpc client endpoint.
@@ -47,20 +55,32 @@ class rpcc : public chanmgr {
 			pthread_cond_t c;
 		};
 
-		void get_refconn(connection **ch);
+		void get_refconn(connection **ch, unsigned int idx);
+		unsigned int pick_chan_wo(unsigned int proc, int sz);
 		void update_xid_rep(unsigned int xid);
 
 
 		sockaddr_in dst_;
+		rpc_transport transport_;
 		unsigned int clt_nonce_;
 		unsigned int srv_nonce_;
 		bool bind_done_;
 		unsigned int xid_;
 		int lossytest_;
+		int delay_us_;   // $RPC_DELAY: added before each send, for tests
 		bool retrans_;
 		bool reachable_;
-
-		connection *chan_;
+		// send requests in the compact encoding; bind() sets it, before
+		// any other call can go out
+		bool compact_;
+
+		// connection pool. chans_[0] carries control RPCs; the others
+		// carry bulk RPCs (procs marked with set_bulk() and requests
+		// over bulk_threshold), round-robin, so a large transfer doesn't
+		// hold up small calls behind it. Connections open on first use.
+		std::vector<connection *> chans_;
+		unsigned int next_bulk_;
+		std::set<unsigned int> bulk_procs_;
 
 		pthread_mutex_t m_; // protect insert/delete to calls[]
 		pthread_mutex_t chan_m_;
@@ -68,8 +88,11 @@ class rpcc : public chanmgr {
 		bool destroy_wait_;
 		pthread_cond_t destroy_wait_c_;
 
-		std::map<int, caller *> calls_;
-		std::list<unsigned int> xid_rep_window_;
+		// node allocations for these come from the buffer pool
+		std::map<int, caller *, std::less<int>,
+			bufpool_allocator<std::pair<const int, caller *> > > calls_;
+		std::list<unsigned int, bufpool_allocator<unsigned int> >
+			xid_rep_window_;
                 
                 struct request {
                     request() { clear(); }
@@ -80,20 +103,61 @@ class rpcc : public chanmgr {
                 };
                 struct request dup_req_;
                 int xid_rep_done_;
+
+		// RTT estimate for dst_ (Jacobson/Karels as in TCP, RFC 6298),
+		// protected by m_. Samples are only taken from calls that were
+		// transmitted once (Karn's algorithm).
+		long long srtt_us_;
+		long long rttvar_us_;
+		unsigned long rtt_samples_;
+		unsigned long timeouts_;     // timer expirations without a reply
+		unsigned long retransmits_;  // requests re-sent on a new connection
+		void rtt_sample_wo(long long us);
+		int rto_wo();
 	public:
 
-		rpcc(sockaddr_in d, bool retrans=true);
+		// nchans is the size of the connection pool; 0 means
+		// $RPC_CONNS, or 2 (one control and one bulk) if unset.
+		// t is what make_sockaddr() returned for d's address.
+		rpcc(sockaddr_in d, bool retrans=true, int nchans=0,
+				rpc_transport t=TRANSPORT_TCP);
 		~rpcc();
 
+		static const int bulk_threshold = 64 * 1024;
+		// send proc on the bulk connections, e.g. a call with a large reply
+		void set_bulk(unsigned int proc);
+
 		struct TO {
 			int to;
+			// give up as soon as the destination refuses the
+			// connection, instead of retrying the connect until
+			// the deadline. For callers that have somewhere else
+			// to go, like rsm_client trying the next member.
+			bool fail_fast;
 		};
 		static const TO to_max;
-		static const TO to_min;
-		static TO to(int x) { TO t; t.to = x; return t;}
+		static const TO to_min;     // retransmit timeout before any RTT sample
+		static const TO rto_floor;  // bounds of the computed retransmit timeout,
+		static const TO rto_cap;    // the cap also bounds the exponential backoff
+		static TO to(int x, bool fail_fast = false) {
+			TO t; t.to = x; t.fail_fast = fail_fast; return t;
+		}
+
+		struct rtt_stats {
+			int srtt_us;
+			int rttvar_us;
+			int rto_ms;
+			unsigned long samples;
+			unsigned long timeouts;
+			unsigned long retransmits;
+		};
+		rtt_stats stats();
 
 		unsigned int id() { return clt_nonce_; }
 
+		// whether bind() negotiated the compact encoding
+		bool compact() { return compact_; }
+
 		int bind(TO to = to_max);
 
 		void set_reachable(bool r) { reachable_ = r; }
@@ -111,33 +175,21 @@ class rpcc : public chanmgr {
 		template<class R>
 			int call_m(unsigned int proc, marshall &req, R & r, TO to);
 
-		template<class R>
-			int call(unsigned int proc, R & r, TO to = to_max); 
-		template<class R, class A1>
-			int call(unsigned int proc, const A1 & a1, R & r, TO to = to_max); 
-		template<class R, class A1, class A2>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, R & r, 
-					TO to = to_max); 
-		template<class R, class A1, class A2, class A3>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-					R & r, TO to = to_max); 
-		template<class R, class A1, class A2, class A3, class A4>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-					const A4 & a4, R & r, TO to = to_max);
-		template<class R, class A1, class A2, class A3, class A4, class A5>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-					const A4 & a4, const A5 & a5, R & r, TO to = to_max); 
-		template<class R, class A1, class A2, class A3, class A4, class A5,
-			class A6>
-				int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-						const A4 & a4, const A5 & a5, const A6 & a6,
-						R & r, TO to = to_max); 
-		template<class R, class A1, class A2, class A3, class A4, class A5, 
-			class A6, class A7>
-				int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-						const A4 & a4, const A5 & a5, const A6 &a6, const A7 &a7,
-						R & r, TO to = to_max); 
+		// call(proc, a1, ..., an, r [, to]): marshals a1..an, waits
+		// for the reply and unmarshals it into r
+		template<class... Args>
+			int call(unsigned int proc, Args &&... args);
 
+	private:
+		// peel the arguments off one at a time; the last one, or the
+		// one before a trailing TO, is the reply
+		template<class R>
+			int call_pack(unsigned int proc, marshall &m, R & r);
+		template<class R>
+			int call_pack(unsigned int proc, marshall &m, R & r, TO to);
+		template<class A, class B, class... Rest>
+			int call_pack(unsigned int proc, marshall &m, const A & a,
+					B && b, Rest &&... rest);
 };
 
 template<class R> int 
@@ -157,99 +209,33 @@ rpcc::call_m(unsigned int proc, marshall &req, R & r, TO to)
 	return intret;
 }
 
-template<class R> int
-rpcc::call(unsigned int proc, R & r, TO to) 
-{
-	marshall m;
-	return call_m(proc, m, r, to);
-}
-
-template<class R, class A1> int
-rpcc::call(unsigned int proc, const A1 & a1, R & r, TO to) 
-{
-	marshall m;
-	m << a1;
-	return call_m(proc, m, r, to);
-}
-
-template<class R, class A1, class A2> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		R & r, TO to) 
+template<class... Args> int
+rpcc::call(unsigned int proc, Args &&... args)
 {
 	marshall m;
-	m << a1;
-	m << a2;
-	return call_m(proc, m, r, to);
+	m.set_compact(compact_);
+	return call_pack(proc, m, std::forward<Args>(args)...);
 }
 
-template<class R, class A1, class A2, class A3> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, R & r, TO to) 
-{
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	return call_m(proc, m, r, to);
-}
-
-template<class R, class A1, class A2, class A3, class A4> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, R & r, TO to) 
-{
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	return call_m(proc, m, r, to);
-}
-
-template<class R, class A1, class A2, class A3, class A4, class A5> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, const A5 & a5, R & r, TO to) 
+template<class R> int
+rpcc::call_pack(unsigned int proc, marshall &m, R & r)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	m << a5;
-	return call_m(proc, m, r, to);
+	return call_m(proc, m, r, to_max);
 }
 
-template<class R, class A1, class A2, class A3, class A4, class A5,
-	class A6> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, const A5 & a5, 
-		const A6 & a6, R & r, TO to) 
+template<class R> int
+rpcc::call_pack(unsigned int proc, marshall &m, R & r, TO to)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	m << a5;
-	m << a6;
 	return call_m(proc, m, r, to);
 }
 
-template<class R, class A1, class A2, class A3, class A4, class A5,
-	class A6, class A7> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, const A5 & a5, 
-		const A6 & a6, const A7 & a7,
-		R & r, TO to) 
+template<class A, class B, class... Rest> int
+rpcc::call_pack(unsigned int proc, marshall &m, const A & a, B && b,
+		Rest &&... rest)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	m << a5;
-	m << a6;
-	m << a7;
-	return call_m(proc, m, r, to);
+	m << a;
+	return call_pack(proc, m, std::forward<B>(b),
+			std::forward<Rest>(rest)...);
 }
 
 bool operator<(const sockaddr_in &a, const sockaddr_in &b);
@@ -261,10 +247,60 @@ class handler {
 		virtual int fn(unmarshall &, marshall &) = 0;
 };
 
+// handler for int (S::*meth)(A1, ..., An, R &). fn() unmarshals
+// a1..an, moves them into the call (so a large argument taken by
+// value isn't copied again), and marshals r as the reply.
+template<class S, class... P>
+class method_handler : public handler {
+	static_assert(sizeof...(P) >= 1, "the last parameter is the reply");
+	typedef std::tuple<typename std::decay<P>::type...> vals_t;
+	static const size_t nargs = sizeof...(P) - 1;
+
+	S *sob_;
+	int (S::*meth_)(P...);
+
+	template<size_t... I> int
+	call(unmarshall &args, marshall &ret, rpc_indices<I...>)
+	{
+		vals_t v;
+		// a braced list evaluates its elements in order, so the
+		// arguments come off the wire a1 first
+		int in_order[] = { 0, ((void) (args >> std::get<I>(v)), 0)... };
+		(void) in_order;
+		if(!args.okdone())
+			return rpc_const::unmarshal_args_failure;
+		int b = (sob_->*meth_)(std::move(std::get<I>(v))...,
+				std::get<nargs>(v));
+		ret << std::get<nargs>(v);
+		return b;
+	}
+
+	public:
+		method_handler(S *sob, int (S::*meth)(P...))
+			: sob_(sob), meth_(meth) { }
+		int fn(unmarshall &args, marshall &ret) {
+			return call(args, ret,
+					typename make_rpc_indices<nargs>::type());
+		}
+};
+
 
 // rpc server endpoint.
 class rpcs : public chanmgr {
 
+	public:
+
+	// dispatch classes. each class has its own queue and its own
+	// reserved workers, so a control-plane request (heartbeat, paxos,
+	// revoke) never waits behind a saturated data plane.
+	typedef enum {
+		PRIO_CONTROL = 0,
+		PRIO_DATA,
+		NPRIO,
+	} prio_t;
+
+	private:
+
 	typedef enum {
 		NEW,  // new RPC, not a duplicate
 		INPROGRESS, // duplicate of an RPC we're still processing
@@ -297,7 +333,8 @@ class rpcs : public chanmgr {
 	// provide at most once semantics by maintaining a window of replies
 	// per client that that client hasn't acknowledged receiving yet.
         // indexed by client nonce.
-	std::map<unsigned int, std::list<reply_t> > reply_window_;
+	typedef std::list<reply_t, bufpool_allocator<reply_t> > reply_list;
+	std::map<unsigned int, reply_list> reply_window_;
 
 	void free_reply_window(void);
 	void add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz);
@@ -306,7 +343,7 @@ class rpcs : public chanmgr {
 			unsigned int xid, unsigned int rep_xid,
 			char **b, int *sz);
 
-	void updatestat(unsigned int proc);
+	void updatestat(unsigned int proc, int reqsz, int repsz);
 
 	// latest connection to the client
 	std::map<unsigned int, connection *> conns_;
@@ -315,22 +352,35 @@ class rpcs : public chanmgr {
 	const int counting_;
 	int curr_counts_;
 	std::map<int, int> counts_;
+	unsigned long long bytes_in_, bytes_out_;
+	unsigned long rpcs_counted_;
 
 	int lossytest_; 
 	bool reachable_;
+	bool compact_ok_;  // accept a client's offer of the compact encoding
 
 	// map proc # to function
 	std::map<int, handler *> procs_;
 
+	// map proc # to its dispatch class; procs not listed are PRIO_DATA
+	std::map<unsigned int, prio_t> prios_;
+	prio_t prio_of(unsigned int proc);
+
+	// procs registered as idempotent
+	std::set<unsigned int> idempotent_;
+
 	pthread_mutex_t procs_m_; // protect insert/delete to procs[]
 	pthread_mutex_t count_m_;  //protect modification of counts
 	pthread_mutex_t reply_window_m_; // protect reply window et al
 	pthread_mutex_t conss_m_; // protect conns_
 
+	// answers bind in the encoding the client gets to use
+	struct bind_handler;
+
 
 	protected:
 
-	struct djob_t {
+	struct djob_t : public bufpool_obj {
 		djob_t (connection *c, char *b, int bsz):buf(b),sz(bsz),conn(c) {}
 		char *buf;
 		int sz;
@@ -339,9 +389,9 @@ class rpcs : public chanmgr {
 	void dispatch(djob_t *);
 
 	// internal handler registration
-	void reg1(unsigned int proc, handler *);
+	void reg1(unsigned int proc, handler *, bool idempotent);
 
-	ThrPool* dispatchpool_;
+	ThrPool* dispatchpool_[NPRIO];
 	tcpsconn* listener_;
 
 	public:
@@ -353,270 +403,33 @@ class rpcs : public chanmgr {
 
 	void set_reachable(bool r) { reachable_ = r; }
 
-	bool got_pdu(connection *c, char *b, int sz);
-
-	// register a handler
-	template<class S, class A1, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1 a1, R & r));
-	template<class S, class A1, class A2, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1 a1, const A2, 
-					R & r));
-	template<class S, class A1, class A2, class A3, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-					const A3, R & r));
-	template<class S, class A1, class A2, class A3, class A4, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-					const A3, const A4, R & r));
-	template<class S, class A1, class A2, class A3, class A4, class A5, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-					const A3, const A4, const A5, 
-					R & r));
-	template<class S, class A1, class A2, class A3, class A4, class A5, class A6,
-		class R>
-			void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-						const A3, const A4, const A5, 
-						const A6, R & r));
-	template<class S, class A1, class A2, class A3, class A4, class A5, class A6,
-		class A7, class R>
-			void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-						const A3, const A4, const A5, 
-						const A6, const A7,
-						R & r));
-};
+	// put proc in dispatch class p (default PRIO_DATA)
+	void set_prio(unsigned int proc, prio_t p);
 
-template<class S, class A1, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				R r;
-				args >> a1;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
+	// bytes of replies held for at-most-once retransmission
+	size_t reply_window_bytes();
 
-template<class S, class A1, class A2, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				R r;
-				args >> a1;
-				args >> a2;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class A3, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class A3, class A4, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, R & r))
-				: sob(xsob), meth(xmeth)  { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class A3, class A4, class A5, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			const A5 a5, R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
-					const A5 a5, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, const A5 a5, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				A5 a5;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				args >> a5;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, a5, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
+	bool got_pdu(connection *c, char *b, int sz);
 
-template<class S, class A1, class A2, class A3, class A4, class A5, class A6, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			const A5 a5, const A6 a6, 
-			R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
-					const A5 a5, const A6 a6, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, const A5 a5, const A6 a6, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				A5 a5;
-				A6 a6;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				args >> a5;
-				args >> a6;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, a5, a6, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
+	// register a handler. an idempotent proc (a pure read) skips the
+	// at-most-once machinery: duplicates simply run again, and its
+	// replies are never kept in the reply window.
+	// meth is int (S::*)(A1 a1, ..., An an, R &r). A1..An may be
+	// taken by value or const reference; R is the reply.
+	template<class S, class... P>
+		void reg(unsigned int proc, S *sob, int (S::*meth)(P...),
+				bool idempotent = false);
+};
 
-template<class S, class A1, class A2, class A3, class A4, class A5, 
-	class A6, class A7, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			const A5 a5, const A6 a6,
-			const A7 a7, R & r))
+template<class S, class... P> void
+rpcs::reg(unsigned int proc, S *sob, int (S::*meth)(P...), bool idempotent)
 {
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
-					const A5 a5, const A6 a6, const A7 a7, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, const A5 a5, const A6 a6,
-						const A7 a7, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				A5 a5;
-				A6 a6;
-				A7 a7;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				args >> a5;
-				args >> a6;
-				args >> a7;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, a5, a6, a7, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
+	reg1(proc, new method_handler<S, P...>(sob, meth), idempotent);
 }
 
-
-void make_sockaddr(const char *hostandport, struct sockaddr_in *dst);
+// "unix:port" and "shm:port" give 127.0.0.1:port and the transport
+// to use for it; anything else is tcp
+rpc_transport make_sockaddr(const char *hostandport, struct sockaddr_in *dst);
 void make_sockaddr(const char *host, const char *port,
 		struct sockaddr_in *dst);
 
@@ -8,6 +8,11 @@
 #include <unistd.h>
 #include <string.h>
 #include <getopt.h>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <set>
 #include "jsl_log.h"
 #include "gettime.h"
 #include "lang/verify.h"
@@ -18,8 +23,67 @@ rpcs *server;  // server rpc object
 rpcc *clients[NUM_CL];  // client rpc object
 struct sockaddr_in dst; //server's ip address
 int port;
+rpc_transport transport = TRANSPORT_TCP;  // of the clients, -t
 pthread_attr_t attr;
 
+#ifdef __GLIBC__
+// count calls into the global allocator (new ends up in malloc too),
+// for alloc_test
+extern "C" void *__libc_malloc(size_t);
+extern "C" void *__libc_calloc(size_t, size_t);
+extern "C" void *__libc_realloc(void *, size_t);
+std::atomic<long> nallocs;
+
+extern "C" void *
+malloc(size_t n)
+{
+	nallocs++;
+	return __libc_malloc(n);
+}
+
+extern "C" void *
+calloc(size_t n, size_t m)
+{
+	nallocs++;
+	return __libc_calloc(n, m);
+}
+
+extern "C" void *
+realloc(void *p, size_t n)
+{
+	nallocs++;
+	return __libc_realloc(p, n);
+}
+#endif
+
+// latency of the calls in lossy_test, in ms
+pthread_mutex_t lat_m = PTHREAD_MUTEX_INITIALIZER;
+std::vector<int> latencies;
+
+// an argument type that counts its copies, to check that rpcs
+// moves unmarshalled arguments into the handler
+std::atomic<int> payload_copies;
+struct payload {
+	std::string s;
+	payload() { }
+	payload(const payload &o) : s(o.s) { payload_copies++; }
+	payload(payload &&o) = default;
+	payload &operator=(const payload &o) { s = o.s; payload_copies++; return *this; }
+	payload &operator=(payload &&o) = default;
+};
+
+marshall &
+operator<<(marshall &m, const payload &p)
+{
+	return m << p.s;
+}
+
+unmarshall &
+operator>>(unmarshall &u, payload &p)
+{
+	return u >> p.s;
+}
+
 // server-side handlers. they must be methods of some class
 // to simplify rpcs::reg(). a server process can have handlers
 // from multiple classes.
@@ -27,8 +91,14 @@ class srv {
 	public:
 		int handle_22(const std::string a, const std::string b, std::string & r);
 		int handle_fast(const int a, int &r);
+		int handle_many(const int a, const int b, const int c,
+				const int d, const int e, const int f, const int g,
+				const payload p, payload &r);
 		int handle_slow(const int a, int &r);
 		int handle_bigrep(const int a, std::string &r);
+		int handle_acquire(const unsigned long long lid,
+				const std::string id, const unsigned long long xid,
+				int &r);
 };
 
 // a handler. a and b are arguments, r is the result.
@@ -52,6 +122,23 @@ srv::handle_fast(const int a, int &r)
 	return 0;
 }
 
+int
+srv::handle_many(const int a, const int b, const int c, const int d,
+		const int e, const int f, const int g, const payload p, payload &r)
+{
+	r.s = p.s + std::string(a + b + c + d + e + f + g, 'y');
+	return 0;
+}
+
+// shaped like lock_protocol::acquire
+int
+srv::handle_acquire(const unsigned long long lid, const std::string id,
+		const unsigned long long xid, int &r)
+{
+	r = (int) (lid + xid) + id.size();
+	return 0;
+}
+
 int
 srv::handle_slow(const int a, int &r)
 {
@@ -76,6 +163,14 @@ void startserver()
 	server->reg(23, &service, &srv::handle_fast);
 	server->reg(24, &service, &srv::handle_slow);
 	server->reg(25, &service, &srv::handle_bigrep);
+	// same handler as 23, but dispatched in the control class
+	server->reg(26, &service, &srv::handle_fast);
+	server->set_prio(26, rpcs::PRIO_CONTROL);
+	// 23 and 25 again, as idempotent procs
+	server->reg(27, &service, &srv::handle_fast, true);
+	server->reg(28, &service, &srv::handle_bigrep, true);
+	server->reg(29, &service, &srv::handle_many);
+	server->reg(30, &service, &srv::handle_acquire);
 }
 
 void
@@ -111,6 +206,269 @@ testmarshall()
 	VERIFY(i1==i && l1==l && s1==s);
 }
 
+// both encodings round-trip the same values, header included
+void
+testmarshall_compact()
+{
+	for (int compact = 0; compact < 2; compact++) {
+		marshall m;
+		m.set_compact(compact);
+		int ints[] = { 0, 1, -1, 63, -64, 64, 127, 128, -129,
+		    0x7fffffff, (int) 0x80000000 };
+		unsigned long long ulls[] = { 0, 127, 128, 16383, 16384,
+		    0xffffffffULL, 0xffffffffffffffffULL };
+		std::vector<int> vi(ints, ints + sizeof(ints)/sizeof(ints[0]));
+		std::vector<unsigned long long> vu(ulls,
+		    ulls + sizeof(ulls)/sizeof(ulls[0]));
+		std::map<std::string, int> mp;
+		mp["a"] = -7;
+		mp["bb"] = 300;
+		m << vi << vu << (short) -300 << (unsigned short) 65535
+		  << std::string(200, 's') << mp << (unsigned int) 0xffffffffu;
+		req_header rh(70000, 12, 0xdeadbeef, 3, 69990);
+		m.pack_req_header(rh);
+		// pack_req_header only fills in the header of a full pdu
+		char *b;
+		int sz;
+		m.take_buf(&b, &sz);
+		VERIFY(rpc_pdu_compact(b) == (compact != 0));
+
+		unmarshall u(b, sz);
+		req_header rh1;
+		u.unpack_req_header(&rh1);
+		VERIFY(u.compact() == (compact != 0));
+		VERIFY(memcmp(&rh, &rh1, sizeof(rh)) == 0);
+		std::vector<int> vi1;
+		std::vector<unsigned long long> vu1;
+		short sh;
+		unsigned short us;
+		std::string str;
+		std::map<std::string, int> mp1;
+		unsigned int ui;
+		u >> vi1 >> vu1 >> sh >> us >> str >> mp1 >> ui;
+		VERIFY(u.okdone());
+		VERIFY(vi1 == vi && vu1 == vu && sh == -300 && us == 65535);
+		VERIFY(str == std::string(200, 's') && mp1 == mp);
+		VERIFY(ui == 0xffffffffu);
+
+		marshall r;
+		r.set_compact(compact);
+		r << (unsigned long long) 5;
+		r.pack_reply_header(reply_header(70000, -4));
+		r.take_buf(&b, &sz);
+		unmarshall ur(b, sz);
+		reply_header h;
+		ur.unpack_reply_header(&h);
+		unsigned long long x;
+		ur >> x;
+		VERIFY(ur.okdone() && h.xid == 70000 && h.ret == -4 && x == 5);
+	}
+
+	// a varint cut short fails the unmarshall
+	marshall m;
+	m.set_compact(true);
+	m << (unsigned long long) 1 << 40;
+	m.pack_reply_header(reply_header(1, 0));
+	char *b;
+	int sz;
+	m.take_buf(&b, &sz);
+	unmarshall u(b, sz - 1);
+	reply_header h;
+	u.unpack_reply_header(&h);
+	unsigned long long x;
+	u >> x;
+	VERIFY(u.ok());
+	u >> x;
+	VERIFY(!u.ok());
+}
+
+enum snap_state { S_FREE, S_LOCKED, S_WAIT, S_RETRY };
+
+// a struct that lists its fields encodes exactly like the
+// field-by-field operators it replaces
+struct refl_fixed {
+	unsigned int a;
+	unsigned long long b;
+	bool c;
+	snap_state d;
+	RPC_FIELDS(a, b, c, d)
+};
+
+struct refl_var {
+	int x;
+	refl_fixed f;
+	std::string s;
+	std::vector<refl_fixed> v;
+	RPC_FIELDS(x, f, s, v)
+};
+
+static_assert(wire_size<refl_fixed>::value == 4 + 8 + 1 + 4, "fixed struct size");
+static_assert(wire_size<refl_var>::value == 0, "variable struct size");
+
+void
+testmarshall_reflect()
+{
+	refl_fixed f = { 7, 1ULL << 40, true, S_RETRY };
+	refl_var r;
+	r.x = -3;
+	r.f = f;
+	r.s = "abc";
+	r.v.assign(3, f);
+
+	for (int compact = 0; compact < 2; compact++) {
+		marshall m, m1;
+		m.set_compact(compact);
+		m1.set_compact(compact);
+		m << r;
+		m1 << r.x << f.a << f.b << f.c << (unsigned int) f.d << r.s
+		   << (unsigned int) r.v.size();
+		for (unsigned i = 0; i < r.v.size(); i++)
+			m1 << f.a << f.b << f.c << (unsigned int) f.d;
+		VERIFY(m.str() == m1.str());
+
+		// decode from a whole pdu, whose header tells the encoding
+		m.pack_reply_header(reply_header(1, 0));
+		char *b;
+		int sz;
+		m.take_buf(&b, &sz);
+		unmarshall u(b, sz);
+		reply_header h;
+		u.unpack_reply_header(&h);
+		refl_var r1;
+		u >> r1;
+		VERIFY(u.okdone());
+		VERIFY(r1.x == r.x && r1.s == r.s && r1.v.size() == 3);
+		VERIFY(r1.f.b == f.b && r1.f.d == S_RETRY && r1.v[2].a == 7);
+	}
+}
+
+// the bulk vector paths: lengths that leave a scalar tail after the
+// SIMD loop, and a count that claims more than the message holds
+void
+testmarshall_bulk()
+{
+	for (unsigned n = 0; n < 20; n++) {
+		std::vector<unsigned int> a;
+		std::vector<int> b;
+		std::vector<unsigned long long> c;
+		for (unsigned i = 0; i < n; i++) {
+			a.push_back(0x01020304u * (i+1));
+			b.push_back(-(int)i * 0x10203);
+			c.push_back(0x0102030405060708ULL * (i+1));
+		}
+		marshall m;
+		m << (char) 'x' << a << b << c;  // leave the words unaligned
+		// same bytes as one word at a time
+		marshall m1;
+		m1 << (char) 'x' << n;
+		for (unsigned i = 0; i < n; i++)
+			m1 << a[i];
+		m1 << n;
+		for (unsigned i = 0; i < n; i++)
+			m1 << b[i];
+		m1 << n;
+		for (unsigned i = 0; i < n; i++)
+			m1 << c[i];
+		VERIFY(m.str() == m1.str());
+
+		unmarshall u(m.str());
+		char x;
+		std::vector<unsigned int> a1;
+		std::vector<int> b1;
+		std::vector<unsigned long long> c1;
+		u >> x >> a1 >> b1 >> c1;
+		VERIFY(u.okdone());
+		VERIFY(a1 == a && b1 == b && c1 == c);
+	}
+
+	marshall m;
+	m << (unsigned int) 1000000 << (unsigned long long) 1;
+	unmarshall u(m.str());
+	std::vector<unsigned long long> v;
+	u >> v;
+	VERIFY(!u.ok() && v.empty());
+}
+
+// encode/decode rate for the kind of message that dominates state
+// transfer: lock_server_cache_rsm::marshal_state() of a big table,
+// plus a plain vector of ids
+struct snap_lock {
+	snap_state state;
+	std::string owner;
+	bool revoked;
+	std::set<std::string> waiters;
+	std::map<std::string, unsigned long long> xids;
+	std::map<std::string, int> acq, rel;
+	RPC_FIELDS(state, owner, revoked, waiters, xids, acq, rel)
+};
+
+static double
+secs_since(const struct timespec &start)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void
+marshall_bench()
+{
+	int nlocks = 200000;
+	int nids = 1 << 20;
+	struct timespec start;
+
+	printf("start marshall_bench ...");
+	std::map<unsigned long long, snap_lock> locks;
+	for (int i = 0; i < nlocks; i++) {
+		snap_lock &l = locks[0x7a00000000ULL + i];
+		l.state = (snap_state) (i % 4);
+		l.owner = "127.0.0.1:" + std::to_string(30000 + i % 64);
+		l.revoked = i % 3 == 0;
+		if (i % 4 == 2)
+			l.waiters.insert("127.0.0.1:" + std::to_string(31000 + i % 64));
+		l.xids[l.owner] = i;
+		l.acq[l.owner] = 0;
+		l.rel[l.owner] = 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	marshall m;
+	m << locks;
+	std::string s = m.str();
+	double enc = secs_since(start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	std::map<unsigned long long, snap_lock> back;
+	unmarshall u(s);
+	u >> back;
+	double dec = secs_since(start);
+	VERIFY(u.okdone() && back.size() == locks.size());
+	VERIFY(back.rbegin()->second.owner == locks.rbegin()->second.owner);
+
+	std::vector<unsigned long long> ids(nids);
+	for (int i = 0; i < nids; i++)
+		ids[i] = 0x7a00000000ULL + i;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	marshall mi;
+	mi << ids;
+	std::string si = mi.str();
+	double ienc = secs_since(start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	std::vector<unsigned long long> ids1;
+	unmarshall ui(si);
+	ui >> ids1;
+	double idec = secs_since(start);
+	VERIFY(ui.okdone() && ids1 == ids);
+
+	printf(" OK\n   -- %d-lock snapshot (%.1f MB): encode %.0f locks/s"
+	       " %.0f MB/s, decode %.0f locks/s %.0f MB/s\n",
+	       nlocks, s.size() / 1e6, nlocks / enc, s.size() / enc / 1e6,
+	       nlocks / dec, s.size() / dec / 1e6);
+	printf("   -- %d u64 ids: encode %.0f MB/s, decode %.0f MB/s\n",
+	       nids, si.size() / ienc / 1e6, si.size() / idec / 1e6);
+}
+
 void *
 client1(void *xx)
 {
@@ -162,12 +520,17 @@ client2(void *xx)
 	while(time(0) - t1 < 10){
 		int arg = (random() % 2000);
 		std::string rep;
+		struct timespec start,end;
+		clock_gettime(CLOCK_REALTIME, &start);
 		int ret = clients[which_cl]->call(25, arg, rep);
+		clock_gettime(CLOCK_REALTIME, &end);
 		if ((int)rep.size()!=arg) {
 			printf("ask for %d reply got %d ret %d\n",
                                arg, (int)rep.size(), ret);
 		}
 		VERIFY((int)rep.size() == arg);
+		ScopedLock ml(&lat_m);
+		latencies.push_back(diff_timespec(end, start));
 	}
 	return 0;
 }
@@ -297,7 +660,7 @@ lossy_test()
 
 	for (int i = 0; i < NUM_CL; i++) {
 		delete clients[i];
-		clients[i] = new rpcc(dst);
+		clients[i] = new rpcc(dst, true, 0, transport);
 		VERIFY(clients[i]->bind()==0);
 	}
 
@@ -311,9 +674,480 @@ lossy_test()
 		VERIFY(pthread_join(th[i], NULL) == 0);
 	}
 	printf(".. OK\n");
+
+	// every dropped message costs one retransmit timeout
+	std::sort(latencies.begin(), latencies.end());
+	rpcc::rtt_stats st = clients[0]->stats();
+	printf("   -- %d calls, latency p99 %d ms max %d ms; srtt %d us rttvar %d us"
+	       " rto %d ms, %lu timeouts %lu retransmits\n",
+	       (int)latencies.size(), latencies[latencies.size() * 99 / 100],
+	       latencies.back(), st.srtt_us, st.rttvar_us, st.rto_ms,
+	       st.timeouts, st.retransmits);
+	latencies.clear();
 	VERIFY(setenv("RPC_LOSSY", "0", 1) == 0);
 }
 
+// more arguments than the old fixed-arity templates took, with and
+// without a timeout
+void
+variadic_test()
+{
+	printf("start variadic_test ...");
+	payload p, r;
+	p.s = std::string(1 << 20, 'p');
+	payload_copies = 0;
+	VERIFY(clients[0]->call(29, 1, 2, 3, 4, 5, 6, 7, p, r) == 0);
+	VERIFY(r.s.size() == (1 << 20) + 28);
+	VERIFY(clients[0]->call(29, 0, 0, 0, 0, 0, 0, 1, p, r,
+				rpcc::to(3000)) == 0);
+	VERIFY(r.s.size() == (1 << 20) + 1);
+	// neither marshalling nor dispatch copied the payload
+	VERIFY(payload_copies == 0);
+	printf(" OK\n");
+}
+
+// head-of-line test: small calls racing big replies on one rpcc
+volatile bool bulk_stop;
+
+void *
+bulk_client(void *xx)
+{
+	rpcc *c = (rpcc *) xx;
+	while(!bulk_stop){
+		std::string rep;
+		VERIFY(c->call(25, 8 << 20, rep) == 0);
+		VERIFY(rep.size() == (8 << 20));
+	}
+	return 0;
+}
+
+void
+hol_test(int nchans)
+{
+	int ret;
+
+	printf("start hol_test (%d connections) ...", nchans);
+
+	rpcc *c = new rpcc(dst, true, nchans, transport);
+	VERIFY(c->bind() == 0);
+	c->set_bulk(25);
+
+	bulk_stop = false;
+	int nt = 1;
+	pthread_t th[nt];
+	for(int i = 0; i < nt; i++){
+		ret = pthread_create(&th[i], &attr, bulk_client, (void *) c);
+		VERIFY(ret == 0);
+	}
+
+	// latency of the small calls, in us
+	std::vector<int> lat;
+	for(int i = 0; i < 500; i++){
+		int rep;
+		struct timespec start,end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		VERIFY(c->call(23, i, rep) == 0);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		VERIFY(rep == i+1);
+		lat.push_back((end.tv_sec - start.tv_sec) * 1000000 +
+				(end.tv_nsec - start.tv_nsec) / 1000);
+	}
+	bulk_stop = true;
+	for(int i = 0; i < nt; i++){
+		VERIFY(pthread_join(th[i], NULL) == 0);
+	}
+	delete c;
+
+	std::sort(lat.begin(), lat.end());
+	printf(" OK\n   -- small call latency p50 %d us p99 %d us max %d us\n",
+	       lat[lat.size() / 2], lat[lat.size() * 99 / 100], lat.back());
+}
+
+// priority test: saturate the data workers with slow calls and
+// compare a small data call with the same call in the control class
+volatile bool prio_stop;
+
+void *
+slow_client(void *xx)
+{
+	rpcc *c = (rpcc *) xx;
+	while(!prio_stop){
+		int rep;
+		VERIFY(c->call(24, 1, rep) == 0);
+		VERIFY(rep == 3);
+	}
+	return 0;
+}
+
+void
+prio_test()
+{
+	int ret;
+	int nt = 40;
+
+	printf("start prio_test (%d slow callers) ...", nt);
+	rpcc *load = new rpcc(dst, true, 1, transport);
+	VERIFY(load->bind() == 0);
+	rpcc *c = new rpcc(dst, true, 1, transport);
+	VERIFY(c->bind() == 0);
+
+	prio_stop = false;
+	pthread_t th[nt];
+	for(int i = 0; i < nt; i++){
+		ret = pthread_create(&th[i], &attr, slow_client, (void *) load);
+		VERIFY(ret == 0);
+	}
+	usleep(100000);
+
+	// latency in us, of proc 23 (data) and proc 26 (control)
+	std::vector<int> lat[2];
+	unsigned int procs[2] = { 23, 26 };
+	for(int i = 0; i < 400; i++){
+		int rep;
+		struct timespec start,end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		VERIFY(c->call(procs[i % 2], i, rep) == 0);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		VERIFY(rep == i+1);
+		lat[i % 2].push_back((end.tv_sec - start.tv_sec) * 1000000 +
+				(end.tv_nsec - start.tv_nsec) / 1000);
+	}
+	prio_stop = true;
+	for(int i = 0; i < nt; i++){
+		VERIFY(pthread_join(th[i], NULL) == 0);
+	}
+	delete c;
+	delete load;
+
+	printf(" OK\n");
+	const char *names[2] = { "data", "control" };
+	for(int k = 0; k < 2; k++){
+		std::sort(lat[k].begin(), lat[k].end());
+		printf("   -- %s call latency p50 %d us p99 %d us max %d us\n",
+		       names[k], lat[k][lat[k].size() / 2],
+		       lat[k][lat[k].size() * 99 / 100], lat[k].back());
+	}
+}
+
+// idempotent procs: no reply kept for retransmission, and no trip
+// through the at-most-once window
+volatile bool idem_stop;
+unsigned int idem_proc;
+pthread_mutex_t idem_m = PTHREAD_MUTEX_INITIALIZER;
+long idem_calls;
+
+void *
+idem_client(void *xx)
+{
+	rpcc *c = (rpcc *) xx;
+	long n = 0;
+	while(!idem_stop){
+		std::string rep;
+		VERIFY(c->call(idem_proc, 4096, rep) == 0);
+		VERIFY(rep.size() == 4096);
+		n++;
+	}
+	ScopedLock ml(&idem_m);
+	idem_calls += n;
+	return 0;
+}
+
+void
+idempotent_test()
+{
+	int ret;
+	int ncl = 16;
+	int nt = 8;
+	int secs = 2;
+
+	printf("start idempotent_test ...");
+
+	// memory: each client's last reply stays in the window until
+	// its next call acknowledges it
+	unsigned int procs[2] = { 25, 28 };
+	size_t held[2];
+	for(int k = 0; k < 2; k++){
+		size_t before = server->reply_window_bytes();
+		std::vector<rpcc *> cls;
+		for(int i = 0; i < ncl; i++){
+			rpcc *c = new rpcc(dst, true, 1, transport);
+			VERIFY(c->bind() == 0);
+			std::string rep;
+			VERIFY(c->call(procs[k], 1 << 20, rep) == 0);
+			VERIFY(rep.size() == (1 << 20));
+			cls.push_back(c);
+		}
+		held[k] = server->reply_window_bytes() - before;
+		for(int i = 0; i < ncl; i++)
+			delete cls[i];
+	}
+	// only the small bind replies are left
+	VERIFY(held[1] < (size_t) ncl * 1024);
+	VERIFY(held[0] >= (size_t) ncl << 20);
+
+	// cpu: 4 KB reads from nt threads
+	double rate[2];
+	for(int k = 0; k < 2; k++){
+		rpcc *c = new rpcc(dst, true, 0, transport);
+		VERIFY(c->bind() == 0);
+		idem_proc = procs[k];
+		idem_stop = false;
+		idem_calls = 0;
+		pthread_t th[nt];
+		for(int i = 0; i < nt; i++){
+			ret = pthread_create(&th[i], &attr, idem_client, (void *) c);
+			VERIFY(ret == 0);
+		}
+		sleep(secs);
+		idem_stop = true;
+		for(int i = 0; i < nt; i++){
+			VERIFY(pthread_join(th[i], NULL) == 0);
+		}
+		delete c;
+		rate[k] = (double) idem_calls / secs;
+	}
+
+	printf(" OK\n   -- %d clients after one 1 MB read: %lu bytes held"
+	       " (at-most-once), %lu bytes held (idempotent)\n",
+	       ncl, (unsigned long) held[0], (unsigned long) held[1]);
+	printf("   -- 4 KB reads: %.0f calls/s (at-most-once), %.0f calls/s"
+	       " (idempotent)\n", rate[0], rate[1]);
+}
+
+#ifdef __GLIBC__
+volatile bool alloc_stop;
+
+void *
+alloc_client(void *xx)
+{
+	rpcc *c = (rpcc *) xx;
+	for(int i = 0; !alloc_stop; i++){
+		int rep;
+		VERIFY(c->call(23, i, rep) == 0);
+		VERIFY(rep == i+1);
+	}
+	return 0;
+}
+
+// global allocator calls per small RPC, client and server side
+// together, once the buffer pool has warmed up
+void
+alloc_test()
+{
+	int ret;
+	int nt = 4;
+	int n = 20000;
+
+	printf("start alloc_test ...");
+	rpcc *c = new rpcc(dst, true, 1, transport);
+	VERIFY(c->bind() == 0);
+	for(int i = 0; i < 2000; i++){
+		int rep;
+		VERIFY(c->call(23, i, rep) == 0);
+	}
+
+	long before = nallocs;
+	for(int i = 0; i < n; i++){
+		int rep;
+		VERIFY(c->call(23, i, rep) == 0);
+		VERIFY(rep == i+1);
+	}
+	double one = (double)(nallocs - before) / n;
+
+	// concurrent callers: blocks now cross threads through the depot
+	alloc_stop = false;
+	pthread_t th[nt];
+	for(int i = 0; i < nt; i++){
+		ret = pthread_create(&th[i], &attr, alloc_client, (void *) c);
+		VERIFY(ret == 0);
+	}
+	usleep(500000);
+	before = nallocs;
+	for(int i = 0; i < n; i++){
+		int rep;
+		VERIFY(c->call(23, i, rep) == 0);
+	}
+	long many = nallocs - before;
+	alloc_stop = true;
+	for(int i = 0; i < nt; i++){
+		VERIFY(pthread_join(th[i], NULL) == 0);
+	}
+	delete c;
+
+	printf(" OK\n   -- %.3f mallocs per call (1 thread), %ld mallocs"
+	       " during %d calls (%d more threads calling)\n",
+	       one, many, n, nt);
+	// a lossy connection is torn down and rebuilt, which allocates
+	char *loss = getenv("RPC_LOSSY");
+	if (!loss || atoi(loss) == 0)
+		VERIFY(one < 0.01);
+}
+#endif
+
+// pdu sizes of an acquire-shaped call in each encoding, and the
+// throughput of a client that negotiated each
+volatile bool acq_stop;
+pthread_mutex_t acq_m = PTHREAD_MUTEX_INITIALIZER;
+long acq_calls;
+
+void *
+acq_client(void *xx)
+{
+	rpcc *c = (rpcc *) xx;
+	long n = 0;
+	while(!acq_stop){
+		int r;
+		unsigned long long lid = n % 100;
+		VERIFY(c->call(30, lid, std::string("127.0.0.1:28341"),
+			       (unsigned long long) n, r) == 0);
+		n++;
+	}
+	ScopedLock ml(&acq_m);
+	acq_calls += n;
+	return 0;
+}
+
+void
+compact_test()
+{
+	int nt = 8;
+	int secs = 2;
+	int reqsz[2], repsz[2];
+	double rate[2];
+
+	printf("start compact_test ...");
+	for (int compact = 0; compact < 2; compact++) {
+		marshall m;
+		m.set_compact(compact);
+		m << (unsigned long long) 17 << std::string("127.0.0.1:28341")
+		  << (unsigned long long) 4242;
+		m.pack_req_header(req_header(4242, 30, random(), random(), 4240));
+		reqsz[compact] = m.size();
+		marshall r;
+		r.set_compact(compact);
+		r << 0;
+		r.pack_reply_header(reply_header(4242, 0));
+		repsz[compact] = r.size();
+
+		VERIFY(setenv("RPC_COMPACT", compact ? "1" : "0", 1) == 0);
+		rpcc *c = new rpcc(dst, true, 0, transport);
+		VERIFY(c->bind() == 0);
+		VERIFY(c->compact() == (compact != 0));
+		acq_stop = false;
+		acq_calls = 0;
+		pthread_t th[nt];
+		for(int i = 0; i < nt; i++){
+			VERIFY(pthread_create(&th[i], &attr, acq_client,
+					      (void *) c) == 0);
+		}
+		sleep(secs);
+		acq_stop = true;
+		for(int i = 0; i < nt; i++){
+			VERIFY(pthread_join(th[i], NULL) == 0);
+		}
+		delete c;
+		rate[compact] = (double) acq_calls / secs;
+	}
+	VERIFY(unsetenv("RPC_COMPACT") == 0);
+	VERIFY(reqsz[1] < reqsz[0] && repsz[1] < repsz[0]);
+	printf(" OK\n   -- request %d -> %d bytes, reply %d -> %d bytes;"
+	       " %.0f -> %.0f calls/s\n", reqsz[0], reqsz[1], repsz[0],
+	       repsz[1], rate[0], rate[1]);
+}
+
+// small-call throughput: both ends share this process, so on one
+// core it is calls per second per core
+volatile bool tput_stop;
+pthread_mutex_t tput_m = PTHREAD_MUTEX_INITIALIZER;
+long tput_calls;
+
+void *
+tput_client(void *xx)
+{
+	rpcc *c = (rpcc *) xx;
+	long n = 0;
+	while(!tput_stop){
+		int rep;
+		VERIFY(c->call(23, (int)n, rep) == 0);
+		VERIFY(rep == (int)n+1);
+		n++;
+	}
+	ScopedLock ml(&tput_m);
+	tput_calls += n;
+	return 0;
+}
+
+void
+throughput_test()
+{
+	int ret;
+	int nt = 8;
+	int secs = 3;
+
+	printf("start throughput_test (%d threads) ...", nt);
+	rpcc *c = new rpcc(dst, true, 0, transport);
+	VERIFY(c->bind() == 0);
+
+	tput_stop = false;
+	tput_calls = 0;
+	pthread_t th[nt];
+	for(int i = 0; i < nt; i++){
+		ret = pthread_create(&th[i], &attr, tput_client, (void *) c);
+		VERIFY(ret == 0);
+	}
+	sleep(secs);
+	tput_stop = true;
+	for(int i = 0; i < nt; i++){
+		VERIFY(pthread_join(th[i], NULL) == 0);
+	}
+	delete c;
+	printf(" OK\n   -- %.0f calls/s\n", (double)tput_calls / secs);
+}
+
+// latency and throughput of each transport to the same server
+void
+transport_test()
+{
+	const char *names[] = { "tcp", "unix", "shm" };
+	rpc_transport ts[] = { TRANSPORT_TCP, TRANSPORT_UNIX, TRANSPORT_SHM };
+
+	printf("start transport_test ...\n");
+	for(int i = 0; i < 3; i++){
+		rpcc *c = new rpcc(dst, true, 1, ts[i]);
+		VERIFY(c->bind() == 0);
+
+		std::vector<int> lat;
+		struct timespec start, end;
+		for(int j = 0; j < 5000; j++){
+			int rep;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			VERIFY(c->call(23, j, rep) == 0);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			VERIFY(rep == j+1);
+			lat.push_back((end.tv_sec - start.tv_sec) * 1000000000 +
+					(end.tv_nsec - start.tv_nsec));
+		}
+		std::sort(lat.begin(), lat.end());
+
+		// 256 MB in 1 MB replies
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(int j = 0; j < 256; j++){
+			std::string rep;
+			VERIFY(c->call(25, 1 << 20, rep) == 0);
+			VERIFY(rep.size() == (1 << 20));
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double secs = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9;
+
+		printf("   -- %-4s: small call p50 %.1f us p99 %.1f us; %.0f MB/s\n",
+		       names[i], lat[lat.size() / 2] / 1000.0,
+		       lat[lat.size() * 99 / 100] / 1000.0, 256 / secs);
+		delete c;
+	}
+	printf("transport_test OK\n");
+}
+
 void
 failure_test()
 {
@@ -324,7 +1158,7 @@ failure_test()
 
 	delete server;
 
-	client1 = new rpcc(dst);
+	client1 = new rpcc(dst, true, 0, transport);
 	VERIFY (client1->bind(rpcc::to(3000)) < 0);
 	printf("   -- create new client and try to bind to failed server .. failed ok\n");
 
@@ -339,7 +1173,7 @@ failure_test()
 
 	delete client;
 
-	clients[0] = client = new rpcc(dst);
+	clients[0] = client = new rpcc(dst, true, 0, transport);
 	VERIFY (client->bind() >= 0);
 	VERIFY (client->bind() < 0);
 
@@ -369,7 +1203,7 @@ failure_test()
 	delete client;
 
 	startserver();
-	clients[0] = client = new rpcc(dst);
+	clients[0] = client = new rpcc(dst, true, 0, transport);
 	VERIFY (client->bind() >= 0);
 	printf("   -- delete existing rpc client and server, create replacements.. ok\n");
 
@@ -402,7 +1236,7 @@ main(int argc, char *argv[])
 	port = 20000 + (getpid() % 10000);
 
 	char ch = 0;
-	while ((ch = getopt(argc, argv, "csd:p:l"))!=-1) {
+	while ((ch = getopt(argc, argv, "csd:p:lt:"))!=-1) {
 		switch (ch) {
 			case 'c':
 				isclient = true;
@@ -416,6 +1250,12 @@ main(int argc, char *argv[])
 			case 'p':
 				port = atoi(optarg);
 				break;
+			case 't':
+				if (strcmp(optarg, "unix") == 0)
+					transport = TRANSPORT_UNIX;
+				else if (strcmp(optarg, "shm") == 0)
+					transport = TRANSPORT_SHM;
+				break;
 			case 'l':
 				VERIFY(setenv("RPC_LOSSY", "5", 1) == 0);
 			default:
@@ -434,6 +1274,9 @@ main(int argc, char *argv[])
 	}
 
 	testmarshall();
+	testmarshall_bulk();
+	testmarshall_compact();
+	testmarshall_reflect();
 
 	pthread_attr_init(&attr);
 	// set stack size to 32K, so we don't run out of memory
@@ -458,12 +1301,26 @@ main(int argc, char *argv[])
 		// be only one rpcc per process. you probably need one
 		// rpcc per server.
 		for (int i = 0; i < NUM_CL; i++) {
-			clients[i] = new rpcc(dst);
+			clients[i] = new rpcc(dst, true, 0, transport);
 			VERIFY (clients[i]->bind() == 0);
 		}
 
 		simple_tests(clients[0]);
 		concurrent_test(10);
+		if (isserver) {
+			variadic_test();
+			marshall_bench();
+			hol_test(1);
+			hol_test(2);
+			prio_test();
+			idempotent_test();
+#ifdef __GLIBC__
+			alloc_test();
+#endif
+			transport_test();
+			compact_test();
+			throughput_test();
+		}
 		lossy_test();
 		if (isserver) {
 			failure_test();
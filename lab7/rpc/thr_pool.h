@@ -5,6 +5,7 @@
 #include <vector>
 
 #include "fifo.h"
+#include "bufpool.h"
 
 class ThrPool {
 
@@ -38,7 +39,7 @@ class ThrPool {
 ThrPool::addObjJob(C *o, void (C::*m)(A), A a)
 {
 
-	class objfunc_wrapper {
+	class objfunc_wrapper : public bufpool_obj {
 		public:
 			C *o;
 			void (C::*m)(A a);
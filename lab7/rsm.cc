@@ -81,6 +81,8 @@
 #include <fstream>
 #include <iostream>
 #include <unistd.h>
+#include <stdlib.h>
+#include <sys/time.h>
 
 #include "handle.h"
 #include "rsm.h"
@@ -97,7 +99,8 @@ recoverythread(void *x)
 }
 
 rsm::rsm(std::string _first, std::string _me) 
-  : stf(0), primary(_first), insync (false), inviewchange (true), vid_commit(0),
+  : stf(0), exec_stamp(0), primary(_first), insync (false), inviewchange (true),
+    vid_commit(0),
     partitioned (false), dopartition(false), break1(false), break2(false)
 {
   pthread_t th;
@@ -121,11 +124,20 @@ rsm::rsm(std::string _first, std::string _me)
   }
   rsmrpc = cfg->get_rpcs();
   rsmrpc->reg(rsm_client_protocol::invoke, this, &rsm::client_invoke);
-  rsmrpc->reg(rsm_client_protocol::members, this, &rsm::client_members);
+  // members and read don't change any state, so retransmissions may
+  // simply run again and their replies need not be kept
+  rsmrpc->reg(rsm_client_protocol::members, this, &rsm::client_members, true);
+  rsmrpc->reg(rsm_client_protocol::read, this, &rsm::client_read, true);
   rsmrpc->reg(rsm_protocol::invoke, this, &rsm::invoke);
   rsmrpc->reg(rsm_protocol::transferreq, this, &rsm::transferreq);
   rsmrpc->reg(rsm_protocol::transferdonereq, this, &rsm::transferdonereq);
   rsmrpc->reg(rsm_protocol::joinreq, this, &rsm::joinreq);
+  // the primary holds invoke_mutex while it waits for the backups'
+  // invoke, so that must not queue behind client requests.
+  // client_invoke blocks on replication and joinreq on paxos, so
+  // they stay in the data class and cannot tie up control workers.
+  rsmrpc->set_prio(rsm_protocol::invoke, rpcs::PRIO_CONTROL);
+  rsmrpc->set_prio(rsm_client_protocol::members, rpcs::PRIO_CONTROL);
 
   // tester must be on different port, otherwise it may partition itself
   testsvr = new rpcs(atoi(_me.c_str()) + 1);
@@ -139,10 +151,19 @@ rsm::rsm(std::string _first, std::string _me)
 }
 
 void
-rsm::reg1(int proc, handler *h)
+rsm::reg1(int proc, handler *h, access a)
 {
   ScopedLock ml(&rsm_mutex);
   procs[proc] = h;
+  if (a != REPLICATED)
+    readonly_procs[proc] = a;
+}
+
+void
+rsm::set_readonly(int proc, access a)
+{
+  ScopedLock ml(&rsm_mutex);
+  readonly_procs[proc] = a;
 }
 
 // The recovery thread runs this function
@@ -153,14 +174,13 @@ rsm::recovery()
   ScopedLock ml(&rsm_mutex);
 
   while (1) {
+    unsigned delay = backoff_min;
     while (!cfg->ismember(cfg->myaddr(), vid_commit)) {
       if (join(primary)) {
 	tprintf("recovery: joined\n");
         commit_change_wo(cfg->vid());
       } else {
-	VERIFY(pthread_mutex_unlock(&rsm_mutex)==0);
-	sleep (5); // XXX make another node in cfg primary?
-	VERIFY(pthread_mutex_lock(&rsm_mutex)==0);
+	backoff_wo(delay); // XXX make another node in cfg primary?
       }
     }
     vid_insync = vid_commit;
@@ -173,17 +193,16 @@ rsm::recovery()
     tprintf("recovery: sync done\n");
 
     // If there was a commited viewchange during the synchronization, restart
-    // the recovery
-    if (vid_insync != vid_commit)
+    // the recovery. Otherwise, if r, the sync already set myvs and
+    // cleared inviewchange: a backup must do that before it tells the
+    // primary, which may send an invoke right after.
+    if (!r || vid_insync != vid_commit)
       continue;
 
-    if (r) { 
-      myvs.vid = vid_commit;
-      myvs.seqno = 1;
-      inviewchange = false;
-    }
     tprintf("recovery: go to sleep %d %d\n", insync, inviewchange);
-    pthread_cond_wait(&recovery_cond, &rsm_mutex);
+    // only a committed view change needs another sync
+    while (vid_insync == vid_commit)
+      pthread_cond_wait(&recovery_cond, &rsm_mutex);
   }
 }
 
@@ -214,9 +233,17 @@ rsm::sync_with_backups()
   backups.insert(members.begin(), members.end());
   backups.erase(cfg->myaddr());
 
-  pthread_cond_wait(&recovery_cond, &rsm_mutex);
+  // transferdonereq and commit_change signal; with no backups at all
+  // there is nothing to wait for
+  while (!backups.empty() && vid_insync == vid_commit)
+    pthread_cond_wait(&recovery_cond, &rsm_mutex);
 
   insync = false;
+  if (vid_insync != vid_commit)
+    return false;
+  myvs.vid = vid_insync;
+  myvs.seqno = 1;
+  inviewchange = false;
   return true;
 }
 
@@ -229,6 +256,7 @@ rsm::sync_with_primary()
   // You fill this in for Lab 7
   // Keep synchronizing with primary until the synchronization succeeds,
   // or there is a commited viewchange
+  unsigned delay = backoff_min;
   while(true)
   {
       if(vid_commit != vid_insync)
@@ -240,17 +268,49 @@ rsm::sync_with_primary()
       {
           break;
       }
+      // the primary may not have started its sync yet
+      backoff_wo(delay);
   }
 
-  if(vid_commit != vid_insync)
+  // Be ready for invokes before telling the primary: it may send one
+  // as soon as it hears from us
+  myvs.vid = vid_insync;
+  myvs.seqno = 1;
+  inviewchange = false;
+
+  // The primary waits for every backup, so it must hear from us
+  delay = backoff_min;
+  while(!statetransferdone(m))
   {
-      return false;
+      if(vid_commit != vid_insync)
+      {
+          return false;
+      }
+      backoff_wo(delay);
   }
-  statetransferdone(m);
 
   return true;
 }
 
+// Waits on recovery_cond for about delay ms, so that a view change or
+// a sync message cuts it short, and doubles delay for the next retry.
+// The jitter keeps backups that retry the same primary apart.
+// caller should hold rsm_mutex
+void
+rsm::backoff_wo(unsigned &delay)
+{
+  struct timeval now;
+  struct timespec until;
+  unsigned ms = delay / 2 + random() % (delay / 2 + 1);
+
+  gettimeofday(&now, NULL);
+  long long ns = (now.tv_usec + ms * 1000LL) * 1000;
+  until.tv_sec = now.tv_sec + ns / 1000000000;
+  until.tv_nsec = ns % 1000000000;
+  pthread_cond_timedwait(&recovery_cond, &rsm_mutex, &until);
+  delay = delay * 2 > backoff_max ? backoff_max : delay * 2;
+}
+
 
 /**
  * Call to transfer state from m to the local node.
@@ -263,23 +323,34 @@ rsm::statetransfer(std::string m)
   rsm_protocol::transferres r;
   handle h(m);
   int ret;
+  unsigned long long cursor = 0;
+  bool started = false;
   tprintf("rsm::statetransfer: contact %s w. my last_myvs(%d,%d)\n", 
 	 m.c_str(), last_myvs.vid, last_myvs.seqno);
-  VERIFY(pthread_mutex_unlock(&rsm_mutex)==0);
-  rpcc *cl = h.safebind();
-  if (cl) {
-    ret = cl->call(rsm_protocol::transferreq, cfg->myaddr(), 
-                             last_myvs, vid_insync, r, rpcc::to(1000));
-  }
-  VERIFY(pthread_mutex_lock(&rsm_mutex)==0);
-  if (cl == 0 || ret != rsm_protocol::OK) {
-    tprintf("rsm::statetransfer: couldn't reach %s %lx %d\n", m.c_str(), 
-	   (long unsigned) cl, ret);
-    return false;
-  }
-  if (stf && last_myvs != r.last) {
-    stf->unmarshal_state(r.state);
-  }
+  do {
+    VERIFY(pthread_mutex_unlock(&rsm_mutex)==0);
+    rpcc *cl = h.safebind();
+    if (cl) {
+      ret = cl->call(rsm_protocol::transferreq, cfg->myaddr(), 
+                               last_myvs, vid_insync, cursor, r, rpcc::to(1000));
+    }
+    VERIFY(pthread_mutex_lock(&rsm_mutex)==0);
+    if (cl == 0 || ret != rsm_protocol::OK) {
+      tprintf("rsm::statetransfer: couldn't reach %s %lx %d\n", m.c_str(), 
+	     (long unsigned) cl, ret);
+      return false;
+    }
+    if (!stf || last_myvs == r.last)
+      break;
+    if (!started) {
+      stf->begin_unmarshal_state();
+      started = true;
+    }
+    stf->unmarshal_state_chunk(r.state);
+    cursor = r.next;
+  } while (!r.done);
+  if (started)
+    stf->end_unmarshal_state();
   last_myvs = r.last;
   tprintf("rsm::statetransfer transfer from %s success, vs(%d,%d)\n", 
 	 m.c_str(), last_myvs.vid, last_myvs.seqno);
@@ -372,6 +443,7 @@ rsm::execute(int procno, std::string req, std::string &r)
   marshall rep;
   std::string reps;
   rsm_protocol::status ret = h->fn(args, rep);
+  VERIFY(ret != rpc_const::unmarshal_args_failure);
   marshall rep1;
   rep1 << ret;
   rep1 << rep.str();
@@ -392,6 +464,10 @@ rsm::client_invoke(int procno, std::string req, std::string &r)
 
   pthread_mutex_lock(&rsm_mutex);
 
+  // r tells the client who we take for the primary, unless it is us
+  if (primary != cfg->myaddr())
+    r = primary;
+
   if (inviewchange) {
     pthread_mutex_unlock(&rsm_mutex);
     return rsm_client_protocol::BUSY;
@@ -402,32 +478,62 @@ rsm::client_invoke(int procno, std::string req, std::string &r)
     return rsm_client_protocol::NOTPRIMARY;
   }
 
+  // a backup that may have missed this request, so that the others
+  // don't wait on it until the heartbeater notices
+  std::string failed;
   {
     ScopedLock ml(&invoke_mutex);
     int dummy_r;
 
     // We are definitely master (primary).
     vs = myvs;
+    viewstamp prev = last_myvs;
     last_myvs = myvs;
     myvs.seqno += 1;
+    // never go back past what an earlier primary handed out
+    unsigned stamp = time(NULL);
+    if (stamp < exec_stamp)
+      stamp = exec_stamp;
 
     members = cfg->get_view(vs.vid);
 
     // Release rsm_mutex once we have got invoke_mutex.
     pthread_mutex_unlock(&rsm_mutex);
     bool first = true;
+    bool ok = true;
     for (const std::string &member : members) {
       if (member == cfg->myaddr()) {
         continue;
       }
 
-      handle h(member);
-      rpcc *cl = h.safebind();
-
-      if (cl == NULL ||
-          cl->call(rsm_protocol::invoke, procno, vs, req, dummy_r, rpcc::to(1000)) != rsm_protocol::OK) {
-        tprintf("client_invoke: failed to invoke slave %s.\n", member.c_str());
-        return rsm_client_protocol::BUSY;
+      int ret;
+      while (1) {
+        handle h(member);
+        rpcc *cl = h.safebind();
+        ret = cl ? cl->call(rsm_protocol::invoke, procno, vs, stamp, req,
+                            dummy_r, rpcc::to(1000))
+                 : rpc_const::bind_failure;
+        // a handle to an earlier incarnation of the backup: the new one
+        // hasn't seen the request, so send it again over a fresh one
+        if (ret != rpc_const::oldsrv_failure &&
+            ret != rpc_const::atmostonce_failure)
+          break;
+        mgr.delete_handle(member);
+      }
+      if (ret != rsm_protocol::OK) {
+        tprintf("client_invoke: failed to invoke slave %s: %d\n",
+                member.c_str(), ret);
+        // Take the sequence number back; backups that already ran the
+        // request differ from us in last_myvs now, so the next sync
+        // transfers our state to them. That sync comes from the view
+        // change a BUSY backup is in, or else from the one we start by
+        // removing the backup; it rejoins once it is up.
+        myvs = vs;
+        last_myvs = prev;
+        if (ret != rsm_protocol::BUSY)
+          failed = member;
+        ok = false;
+        break;
       }
 
       if(first)
@@ -439,9 +545,51 @@ rsm::client_invoke(int procno, std::string req, std::string &r)
       }
     }
 
-    execute(procno, req, r);
+    if (ok) {
+      exec_stamp = stamp;
+      execute(procno, req, r);
+      return rsm_client_protocol::OK;
+    }
   }
 
+  if (!failed.empty() && cfg->remove(failed, vs.vid))
+    tprintf("client_invoke: removed %s from view %d\n", failed.c_str(), vs.vid);
+  return rsm_client_protocol::BUSY;
+}
+
+//
+// Clients call client_read to run a read-only procedure without
+// replicating it. The primary only replies to a write after every
+// backup in the view has executed it, so once the view change is over
+// each member has applied all acknowledged writes and can answer reads
+// itself. Only the primary knows it is still in the latest view, and
+// only while it holds its lease; without one it orders the read like
+// a write.
+//
+rsm_client_protocol::status
+rsm::client_read(int procno, std::string req, std::string &r)
+{
+  bool amprimary;
+  {
+    ScopedLock ml(&rsm_mutex);
+    if (inviewchange || !cfg->ismember(cfg->myaddr(), vid_commit)) {
+      return rsm_client_protocol::BUSY;
+    }
+    std::map<int, access>::iterator it = readonly_procs.find(procno);
+    if (it == readonly_procs.end()) {
+      return rsm_client_protocol::ERR;
+    }
+    amprimary = primary == cfg->myaddr();
+    if (!amprimary && it->second != READ_STALE) {
+      r = primary;
+      return rsm_client_protocol::NOTPRIMARY;
+    }
+  }
+  if (amprimary && !cfg->has_lease())
+    return client_invoke(procno, req, r);
+  // The service protects its state with its own lock, so the read
+  // doesn't need to be ordered against invoke.
+  execute(procno, req, r);
   return rsm_client_protocol::OK;
 }
 
@@ -453,7 +601,8 @@ rsm::client_invoke(int procno, std::string req, std::string &r)
 // according to requests' seqno 
 
 rsm_protocol::status
-rsm::invoke(int proc, viewstamp vs, std::string req, int &dummy)
+rsm::invoke(int proc, viewstamp vs, unsigned stamp, std::string req,
+            int &dummy)
 {
   rsm_protocol::status ret = rsm_protocol::OK;
   // You fill this in for Lab 7
@@ -475,6 +624,7 @@ rsm::invoke(int proc, viewstamp vs, std::string req, int &dummy)
     last_myvs = myvs;
     myvs.seqno++;
     std::string r;
+    exec_stamp = stamp;
     execute(proc, req, r);
 
     // 在从服务器完成执行请求后crash
@@ -489,18 +639,20 @@ rsm::invoke(int proc, viewstamp vs, std::string req, int &dummy)
  */
 rsm_protocol::status
 rsm::transferreq(std::string src, viewstamp last, unsigned vid, 
-rsm_protocol::transferres &r)
+unsigned long long cursor, rsm_protocol::transferres &r)
 {
   ScopedLock ml(&rsm_mutex);
   int ret = rsm_protocol::OK;
   // Code will be provided in Lab 7
-  tprintf("transferreq from %s (%d,%d) vs (%d,%d)\n", src.c_str(), 
-	 last.vid, last.seqno, last_myvs.vid, last_myvs.seqno);
+  tprintf("transferreq from %s (%d,%d) vs (%d,%d) cursor %llu\n", src.c_str(), 
+	 last.vid, last.seqno, last_myvs.vid, last_myvs.seqno, cursor);
   if (!insync || vid != vid_insync) {
      return rsm_protocol::BUSY;
   }
+  r.next = 0;
+  r.done = true;
   if (stf && last != last_myvs) 
-    r.state = stf->marshal_state();
+    r.state = stf->marshal_state_chunk(cursor, transfer_chunk_bytes, r.next, r.done);
   r.last = last_myvs;
   return ret;
 }
@@ -519,6 +671,11 @@ rsm::transferdonereq(std::string m, unsigned vid, int &)
   //   for the same view with me
   // - Remove the slave from the list of unsynchronized backups
   // - Wake up recovery thread if all backups are synchronized
+  // A retry whose first reply was lost: we are already done
+  if(!insync && vid == vid_commit && !inviewchange)
+  {
+      return rsm_protocol::OK;
+  }
   if(!insync || vid != vid_insync )
   {
       return rsm_protocol::BUSY;
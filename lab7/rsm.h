@@ -14,10 +14,20 @@
 
 
 class rsm : public config_view_change {
+ public:
+  // How a proc is served. REPLICATED procs are ordered through the
+  // primary and run on every replica. READONLY ones don't change the
+  // state: the primary answers them itself while it holds its lease
+  // (config::has_lease), so they still see every acknowledged write.
+  // READ_STALE ones may also be answered by any in-sync backup; one
+  // cut off from the rest keeps answering from the view it last knew
+  // until it learns of the next one.
+  enum access { REPLICATED, READONLY, READ_STALE };
  private:
-  void reg1(int proc, handler *);
+  void reg1(int proc, handler *, access);
  protected:
   std::map<int, handler *> procs;
+  std::map<int, access> readonly_procs;
   config *cfg;
   class rsm_state_transfer *stf;
   rpcs *rsmrpc;
@@ -25,6 +35,7 @@ class rsm : public config_view_change {
   // On primary: viewstamp for the next request from rsm_client
   viewstamp myvs;
   viewstamp last_myvs;   // Viewstamp of the last executed request
+  unsigned exec_stamp;   // Time the primary gave the request being executed
   std::string primary;
   bool insync;
   bool inviewchange;
@@ -42,9 +53,10 @@ class rsm : public config_view_change {
 
   rsm_client_protocol::status client_members(int i,
 					     std::vector<std::string> &r);
-  rsm_protocol::status invoke(int proc, viewstamp vs, std::string mreq,
-			      int &dummy);
+  rsm_protocol::status invoke(int proc, viewstamp vs, unsigned stamp,
+			      std::string mreq, int &dummy);
   rsm_protocol::status transferreq(std::string src, viewstamp last, unsigned vid,
+				   unsigned long long cursor,
 				   rsm_protocol::transferres &r);
   rsm_protocol::status transferdonereq(std::string m, unsigned vid, int &);
   rsm_protocol::status joinreq(std::string src, viewstamp last,
@@ -60,6 +72,8 @@ class rsm : public config_view_change {
   void execute(int procno, std::string req, std::string &r);
   rsm_client_protocol::status client_invoke(int procno, std::string req,
               std::string &r);
+  rsm_client_protocol::status client_read(int procno, std::string req,
+              std::string &r);
   bool statetransfer(std::string m);
   bool statetransferdone(std::string m);
   bool join(std::string m);
@@ -67,6 +81,7 @@ class rsm : public config_view_change {
   std::string find_highest(viewstamp &vs, std::string &m, unsigned &vid);
   bool sync_with_backups();
   bool sync_with_primary();
+  void backoff_wo(unsigned &delay);
   void net_repair_wo(bool heal);
   void breakpoint1();
   void breakpoint2();
@@ -78,165 +93,30 @@ class rsm : public config_view_change {
 
   bool amiprimary();
   void set_state_transfer(rsm_state_transfer *_stf) { stf = _stf; };
+  // Wall-clock time the primary picked for the replicated request being
+  // executed. It is the same on every replica, so handlers use it instead
+  // of their own clock; 0 until the first request.
+  unsigned stamp() { return exec_stamp; }
+  // Mark a registered proc as read-only; see access
+  void set_readonly(int proc, access a = READ_STALE);
+  // Max size of one state transfer chunk
+  static const size_t transfer_chunk_bytes = 1 << 20;
+  // retry delays (ms) of recovery when the primary isn't ready
+  static const unsigned backoff_min = 10;
+  static const unsigned backoff_max = 1000;
   void recovery();
   void commit_change(unsigned vid);
 
-  template<class S, class A1, class R>
-    void reg(int proc, S*, int (S::*meth)(const A1 a1, R &));
-  template<class S, class A1, class A2, class R>
-    void reg(int proc, S*, int (S::*meth)(const A1 a1, const A2 a2, R &));
-  template<class S, class A1, class A2, class A3, class R>
-    void reg(int proc, S*, int (S::*meth)(const A1 a1, const A2 a2,
-            const A3 a3, R &));
-  template<class S, class A1, class A2, class A3, class A4, class R>
-    void reg(int proc, S*, int (S::*meth)(const A1 a1, const A2 a2,
-            const A3 a3, const A4 a4, R &));
-  template<class S, class A1, class A2, class A3, class A4, class A5, class R>
-    void reg(int proc, S*, int (S::*meth)(const A1 a1, const A2 a2,
-            const A3 a3, const A4 a4,
-            const A5 a5, R &));
+  // same handler signatures as rpcs::reg
+  template<class S, class... P>
+    void reg(int proc, S *sob, int (S::*meth)(P...),
+             access a = REPLICATED);
 };
 
-template<class S, class A1, class R> void
-  rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, R & r))
-{
-  class h1 : public handler {
-  private:
-    S * sob;
-    int (S::*meth)(const A1 a1, R & r);
-  public:
-  h1(S *xsob, int (S::*xmeth)(const A1 a1, R & r))
-      : sob(xsob), meth(xmeth) { }
-    int fn(unmarshall &args, marshall &ret) {
-      A1 a1;
-      R r;
-      args >> a1;
-      VERIFY(args.okdone());
-      int b = (sob->*meth)(a1,r);
-      ret << r;
-      return b;
-    }
-  };
-  reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class R> void
-  rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, R & r))
-{
- class h1 : public handler {
-  private:
-    S * sob;
-    int (S::*meth)(const A1 a1, const A2 a2, R & r);
-  public:
-  h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, R & r))
-    : sob(xsob), meth(xmeth) { }
-    int fn(unmarshall &args, marshall &ret) {
-      A1 a1;
-      A2 a2;
-      R r;
-      args >> a1;
-      args >> a2;
-      VERIFY(args.okdone());
-      int b = (sob->*meth)(a1,a2,r);
-      ret << r;
-      return b;
-    }
-  };
-  reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class A3, class R> void
-  rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
-             const A3 a3, R & r))
-{
- class h1 : public handler {
-  private:
-    S * sob;
-    int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, R & r);
-  public:
-  h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, R & r))
-    : sob(xsob), meth(xmeth) { }
-    int fn(unmarshall &args, marshall &ret) {
-      A1 a1;
-      A2 a2;
-      A3 a3;
-      R r;
-      args >> a1;
-      args >> a2;
-      args >> a3;
-      VERIFY(args.okdone());
-      int b = (sob->*meth)(a1,a2,a3,r);
-      ret << r;
-      return b;
-    }
-  };
-  reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class A3, class A4, class R> void
-  rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
-             const A3 a3, const A4 a4, R & r))
-{
- class h1 : public handler {
-  private:
-    S * sob;
-    int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, R & r);
-  public:
-  h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3,
-            const A4 a4, R & r))
-    : sob(xsob), meth(xmeth) { }
-    int fn(unmarshall &args, marshall &ret) {
-      A1 a1;
-      A2 a2;
-      A3 a3;
-      A4 a4;
-      R r;
-      args >> a1;
-      args >> a2;
-      args >> a3;
-      args >> a4;
-      VERIFY(args.okdone());
-      int b = (sob->*meth)(a1,a2,a3,a4,r);
-      ret << r;
-      return b;
-    }
-  };
-  reg1(proc, new h1(sob, meth));
-}
-
-
-template<class S, class A1, class A2, class A3, class A4, class A5, class R> void
-  rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
-             const A3 a3, const A4 a4,
-             const A5 a5, R & r))
+template<class S, class... P> void
+  rsm::reg(int proc, S *sob, int (S::*meth)(P...), access a)
 {
- class h1 : public handler {
-  private:
-    S * sob;
-    int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4,
-       const A5 a5, R & r);
-  public:
-  h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3,
-            const A4 a4, const A5 a5, R & r))
-    : sob(xsob), meth(xmeth) { }
-    int fn(unmarshall &args, marshall &ret) {
-      A1 a1;
-      A2 a2;
-      A3 a3;
-      A4 a4;
-      A5 a5;
-      R r;
-      args >> a1;
-      args >> a2;
-      args >> a3;
-      args >> a4;
-      VERIFY(args.okdone());
-      int b = (sob->*meth)(a1,a2,a3,a4,a5,r);
-      ret << r;
-      return b;
-    }
-  };
-  reg1(proc, new h1(sob, meth));
+  reg1(proc, new method_handler<S, P...>(sob, meth), a);
 }
 
 #endif /* rsm_h */
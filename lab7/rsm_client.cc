@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <handle.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include "lang/verify.h"
 
 
@@ -12,6 +13,7 @@ rsm_client::rsm_client(std::string dst)
   printf("create rsm_client\n");
   std::vector<std::string> mems;
 
+  next_replica = 0;
   pthread_mutex_init(&rsm_client_mutex, NULL);
   sockaddr_in dstsock;
   make_sockaddr(dst.c_str(), &dstsock);
@@ -29,24 +31,47 @@ void
 rsm_client::primary_failure()
 {
   // You fill this in for Lab 7
+  if (known_mems.empty())
+    known_mems = members;
+  if (known_mems.empty())
+    return;
   primary = known_mems.back();
   known_mems.pop_back();
 }
 
+// Sleeps about delay ms without the mutex and doubles delay for next
+// time; the jitter keeps clients that retry together from staying in step.
+// Assumes caller holds rsm_client_mutex
+void
+rsm_client::backoff_wo(unsigned &delay)
+{
+  unsigned ms = delay / 2 + random() % (delay / 2 + 1);
+  VERIFY(pthread_mutex_unlock(&rsm_client_mutex)==0);
+  usleep(ms * 1000);
+  VERIFY(pthread_mutex_lock(&rsm_client_mutex)==0);
+  delay = delay * 2 > backoff_max ? backoff_max : delay * 2;
+}
+
 rsm_protocol::status
 rsm_client::invoke(int proc, std::string req, std::string &rep)
 {
   int ret;
+  unsigned delay = backoff_min;
+  bool hinted = false;
+  std::string failed;
   ScopedLock ml(&rsm_client_mutex);
   while (1) {
     printf("rsm_client::invoke proc %x primary %s\n", proc, primary.c_str());
-    handle h(primary);
+    // other threads may switch primary while this call is outstanding
+    std::string p = primary;
+    handle h(p);
 
     VERIFY(pthread_mutex_unlock(&rsm_client_mutex)==0);
     rpcc *cl = h.safebind();
+    rep.clear();
     if (cl) {
       ret = cl->call(rsm_client_protocol::invoke, proc, req, 
-                     rep, rpcc::to(5000));
+                     rep, rpcc::to(5000, true));
     }
     VERIFY(pthread_mutex_lock(&rsm_client_mutex)==0);
 
@@ -55,29 +80,114 @@ rsm_client::invoke(int proc, std::string req, std::string &rep)
     }
 
     printf("rsm_client::invoke proc %x primary %s ret %d\n", proc, 
-           primary.c_str(), ret);
+           p.c_str(), ret);
     if (ret == rsm_client_protocol::OK) {
       break;
     }
+    // on BUSY and NOTPRIMARY, rep names the member p takes for the
+    // primary, if that is not p itself
+    if ((ret == rsm_client_protocol::BUSY ||
+         ret == rsm_client_protocol::NOTPRIMARY) &&
+        !rep.empty() && rep != p && rep != failed) {
+      printf("primary %s isn't the primary--try %s\n", p.c_str(),
+             rep.c_str());
+      // members disagreeing during a view change could bounce us around
+      if (hinted)
+        backoff_wo(delay);
+      hinted = true;
+      if (primary == p)
+        primary = rep;
+      continue;
+    }
     if (ret == rsm_client_protocol::BUSY) {
       printf("rsm is busy %s\n", primary.c_str());
-      sleep(3);
+      backoff_wo(delay);
       continue;
     }
     if (ret == rsm_client_protocol::NOTPRIMARY) {
       printf("primary %s isn't the primary--let's get a complete list of mems\n", 
-             primary.c_str());
-      if (init_members())
+             p.c_str());
+      if (init_members()) {
+        // still the one that failed: wait for the view change
+        if (primary == failed)
+          backoff_wo(delay);
         continue;
+      }
     }
 prim_fail:
-    printf("primary %s failed ret %d\n", primary.c_str(), ret);
+    printf("primary %s failed ret %d\n", p.c_str(), ret);
+    failed = p;
+    if (primary != p)
+      continue;
+    if (known_mems.empty())
+      backoff_wo(delay);
     primary_failure();
     printf ("rsm_client::invoke: retry new primary %s\n", primary.c_str());
   }
   return ret;
 }
 
+rsm_protocol::status
+rsm_client::invoke_read(int proc, std::string req, std::string &rep,
+                        bool stale)
+{
+  std::string m;
+  if (!stale) {
+    std::string p;
+    {
+      ScopedLock ml(&rsm_client_mutex);
+      p = primary;
+    }
+    handle h(p);
+    rpcc *cl = h.safebind();
+    int ret = rsm_client_protocol::ERR;
+    // without a lease the primary orders it, so allow as long as invoke
+    if (cl) {
+      ret = cl->call(rsm_client_protocol::read, proc, req, rep,
+                     rpcc::to(5000, true));
+    }
+    if (cl && ret == rsm_client_protocol::OK)
+      return ret;
+    printf("rsm_client::invoke_read: primary %s failed ret %d\n", p.c_str(),
+           ret);
+    // invoke finds the new primary
+    return invoke(proc, req, rep);
+  }
+
+  {
+    ScopedLock ml(&rsm_client_mutex);
+    if (!replicas.empty())
+      m = replicas[next_replica++ % replicas.size()];
+  }
+
+  if (!m.empty()) {
+    handle h(m);
+    rpcc *cl = h.safebind();
+    int ret = rsm_client_protocol::ERR;
+    if (cl) {
+      ret = cl->call(rsm_client_protocol::read, proc, req, rep,
+                     rpcc::to(1000, true));
+    }
+    if (cl && ret == rsm_client_protocol::OK)
+      return ret;
+    printf("rsm_client::invoke_read: replica %s failed ret %d\n", m.c_str(), ret);
+    ScopedLock ml(&rsm_client_mutex);
+    for (unsigned i = 0; i < replicas.size(); i++) {
+      if (replicas[i] == m) {
+        replicas.erase(replicas.begin() + i);
+        break;
+      }
+    }
+  }
+
+  // No replica could serve it; let the primary order it like a write
+  int ret = invoke(proc, req, rep);
+  ScopedLock ml(&rsm_client_mutex);
+  if (replicas.empty())
+    init_members();
+  return ret;
+}
+
 bool
 rsm_client::init_members()
 {
@@ -89,7 +199,7 @@ rsm_client::init_members()
   rpcc *cl = h.safebind();
   if (cl) {
     ret = cl->call(rsm_client_protocol::members, 0, new_view,  
-                   rpcc::to(1000)); 
+                   rpcc::to(1000, true)); 
   }
   VERIFY(pthread_mutex_lock(&rsm_client_mutex)==0);
   if (cl == 0 || ret != rsm_protocol::OK)
@@ -100,8 +210,10 @@ rsm_client::init_members()
   }
   
   known_mems = new_view;
+  members = new_view;
   primary = known_mems.back();
   known_mems.pop_back();
+  replicas = known_mems;
 
   printf("rsm_client::init_members: primary %s\n", primary.c_str());
 
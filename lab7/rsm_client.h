@@ -20,40 +20,56 @@ class rsm_client {
  protected:
   std::string primary;
   std::vector<std::string> known_mems;
+  // the last complete list from init_members; primary_failure starts
+  // over from it once known_mems runs out
+  std::vector<std::string> members;
+  // members that read() rotates over; a member is dropped when a read
+  // to it fails and the list is refreshed once it runs empty
+  std::vector<std::string> replicas;
+  unsigned next_replica;
   pthread_mutex_t rsm_client_mutex;
+  // retry delays (ms) while the rsm is busy or no member answers
+  static const unsigned backoff_min = 10;
+  static const unsigned backoff_max = 1000;
+  void backoff_wo(unsigned &delay);
   void primary_failure();
   bool init_members();
  public:
   rsm_client(std::string dst);
   rsm_protocol::status invoke(int proc, std::string req, std::string &rep);
-
-  template<class R, class A1>
-    int call(unsigned int proc, const A1 & a1, R &r);
-
-  template<class R, class A1, class A2>
-    int call(unsigned int proc, const A1 & a1, const A2 & a2, R &r);
-
-  template<class R, class A1, class A2, class A3>
-    int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-	     R &r);
-
-  template<class R, class A1, class A2, class A3, class A4>
-    int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-	     const A4 & a4, R &r);
-
-  template<class R, class A1, class A2, class A3, class A4, class A5>
-    int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-	     const A4 & a4, const A5 & a5, R &r);
+  rsm_protocol::status invoke_read(int proc, std::string req, std::string &rep,
+                                   bool stale);
+
+  // call(proc, a1, ..., an, r), like rpcc::call
+  template<class... Args>
+    int call(unsigned int proc, Args &&... args);
+
+  // Like call, for procs the servers registered as rsm::READONLY or
+  // rsm::READ_STALE. The primary answers without replicating them.
+  template<class... Args>
+    int read(unsigned int proc, Args &&... args);
+  // Like read, for rsm::READ_STALE procs only: any in-sync backup may
+  // answer, spreading the load; falls back to the primary.
+  template<class... Args>
+    int read_stale(unsigned int proc, Args &&... args);
  private:
-  template<class R> int call_m(unsigned int proc, marshall &req, R &r);
+  enum route { INVOKE, READ, READ_STALE };
+  template<class R> int call_m(unsigned int proc, marshall &req, R &r,
+                               route how = INVOKE);
+  template<class R>
+    int call_pack(unsigned int proc, route how, marshall &m, R &r);
+  template<class A, class B, class... Rest>
+    int call_pack(unsigned int proc, route how, marshall &m,
+                  const A &a, B &&b, Rest &&... rest);
 };
 
 template<class R> int
-rsm_client::call_m(unsigned int proc, marshall &req, R &r)
+rsm_client::call_m(unsigned int proc, marshall &req, R &r, route how)
 {
 	std::string rep;
         std::string res;
-	int intret = invoke(proc, req.str(), rep);
+	int intret = how == INVOKE ? invoke(proc, req.str(), rep)
+	    : invoke_read(proc, req.str(), rep, how == READ_STALE);
         VERIFY( intret == rsm_client_protocol::OK );
         unmarshall u(rep);
 	u >> intret;
@@ -79,64 +95,40 @@ rsm_client::call_m(unsigned int proc, marshall &req, R &r)
 	return intret;
 }
 
-template<class R, class A1> int
-  rsm_client::call(unsigned int proc, const A1 & a1, R & r)
+template<class... Args> int
+  rsm_client::call(unsigned int proc, Args &&... args)
 {
   marshall m;
-  m << a1;
-  return call_m(proc, m, r);
+  return call_pack(proc, INVOKE, m, std::forward<Args>(args)...);
 }
 
-template<class R, class A1, class A2> int
-  rsm_client::call(unsigned int proc, const A1 & a1, const A2 & a2, R & r)
+template<class... Args> int
+  rsm_client::read(unsigned int proc, Args &&... args)
 {
   marshall m;
-  m << a1;
-  m << a2;
-  return call_m(proc, m, r);
+  return call_pack(proc, READ, m, std::forward<Args>(args)...);
 }
 
-template<class R, class A1, class A2, class A3> int
-  rsm_client::call(unsigned int proc, const A1 & a1, 
-		const A2 & a2, const A3 & a3, R & r)
+template<class... Args> int
+  rsm_client::read_stale(unsigned int proc, Args &&... args)
 {
   marshall m;
-  std::string rep;
-  std::string res;
-  m << a1;
-  m << a2;
-  m << a3;
-  return call_m(proc, m, r);
+  return call_pack(proc, READ_STALE, m, std::forward<Args>(args)...);
 }
 
-template<class R, class A1, class A2, class A3, class A4> int
-  rsm_client::call(unsigned int proc, const A1 & a1, 
-		   const A2 & a2, const A3 & a3, const A4 & a4, R & r)
+template<class R> int
+  rsm_client::call_pack(unsigned int proc, route how, marshall &m, R &r)
 {
-  marshall m;
-  std::string rep;
-  std::string res;
-  m << a1;
-  m << a2;
-  m << a3;
-  m << a4;
-  return call_m(proc, m, r);
+  return call_m(proc, m, r, how);
 }
 
-template<class R, class A1, class A2, class A3, class A4, class A5> int
-  rsm_client::call(unsigned int proc, const A1 & a1, 
-		   const A2 & a2, const A3 & a3, const A4 & a4, const A5 & a5,
-		   R & r)
+template<class A, class B, class... Rest> int
+  rsm_client::call_pack(unsigned int proc, route how, marshall &m,
+                        const A &a, B &&b, Rest &&... rest)
 {
-  marshall m;
-  std::string rep;
-  std::string res;
-  m << a1;
-  m << a2;
-  m << a3;
-  m << a4;
-  m << a5;
-  return call_m(proc, m, r);
+  m << a;
+  return call_pack(proc, how, m, std::forward<B>(b),
+                   std::forward<Rest>(rest)...);
 }
 
 #endif 
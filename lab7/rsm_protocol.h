@@ -11,6 +11,7 @@ class rsm_client_protocol {
   enum rpc_numbers {
     invoke = 0x9001,
     members,
+    read,       // read-only procedure, served by any in-sync replica
   };
 };
 
@@ -22,6 +23,7 @@ struct viewstamp {
   };
   unsigned int vid;
   unsigned int seqno;
+  RPC_FIELDS(vid, seqno)
 };
 
 class rsm_protocol {
@@ -38,10 +40,14 @@ class rsm_protocol {
   struct transferres {
     std::string state;
     viewstamp last;
+    unsigned long long next;   // cursor of the next chunk
+    bool done;                 // this was the last chunk
+    RPC_FIELDS(state, last, next, done)
   };
   
   struct joinres {
     std::string log;
+    RPC_FIELDS(log)
   };
 };
 
@@ -57,49 +63,6 @@ inline bool operator!=(viewstamp a, viewstamp b) {
   return a.vid != b.vid || a.seqno != b.seqno;
 }
 
-inline marshall& operator<<(marshall &m, viewstamp v)
-{
-  m << v.vid;
-  m << v.seqno;
-  return m;
-}
-
-inline unmarshall& operator>>(unmarshall &u, viewstamp &v) {
-  u >> v.vid;
-  u >> v.seqno;
-  return u;
-}
-
-inline marshall &
-operator<<(marshall &m, rsm_protocol::transferres r)
-{
-  m << r.state;
-  m << r.last;
-  return m;
-}
-
-inline unmarshall &
-operator>>(unmarshall &u, rsm_protocol::transferres &r)
-{
-  u >> r.state;
-  u >> r.last;
-  return u;
-}
-
-inline marshall &
-operator<<(marshall &m, rsm_protocol::joinres r)
-{
-  m << r.log;
-  return m;
-}
-
-inline unmarshall &
-operator>>(unmarshall &u, rsm_protocol::joinres &r)
-{
-  u >> r.log;
-  return u;
-}
-
 class rsm_test_protocol {
  public:
   enum xxstatus { OK, ERR};
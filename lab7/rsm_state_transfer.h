@@ -1,10 +1,35 @@
 #ifndef rsm_state_transfer_h
 #define rsm_state_transfer_h
 
+#include <string>
+
 class rsm_state_transfer {
  public:
   virtual std::string marshal_state() = 0;
   virtual void unmarshal_state(std::string) = 0;
+
+  // Chunked state transfer, so a large state does not have to fit in
+  // a single string/RPC.  The backup asks for chunks starting at
+  // cursor 0, passing back the returned next cursor, until done is
+  // set.  The default sends the whole state as one chunk.
+  virtual std::string marshal_state_chunk(unsigned long long cursor,
+                                          size_t max_bytes,
+                                          unsigned long long &next,
+                                          bool &done) {
+    next = 0;
+    done = true;
+    return marshal_state();
+  }
+  // Called on the backup around the chunks of one transfer.  If the
+  // transfer fails half-way, begin is called again for the retry, so
+  // an implementation should stage the chunks and only install them
+  // in end_unmarshal_state.
+  virtual void begin_unmarshal_state() {};
+  virtual void unmarshal_state_chunk(std::string chunk) {
+    unmarshal_state(chunk);
+  }
+  virtual void end_unmarshal_state() {};
+
   virtual ~rsm_state_transfer() {};
 };
 
@@ -2,6 +2,7 @@
 
 use POSIX ":sys_wait_h";
 use Getopt::Std;
+use Time::HiRes;
 use strict;
 
 
@@ -216,6 +217,43 @@ sub wait_and_check_expected_view($) {
   }
 }
 
+sub ms_since {
+  my $t0 = shift;
+  return int((Time::HiRes::time() - $t0) * 1000);
+}
+
+# like wait_and_check_expected_view, but polls every 10ms and returns
+# the ms from $t0 until every node of the view has logged it
+sub time_view_change {
+  my ($v, $t0) = @_;
+  foreach my $port (@$v) {
+    while (get_num_views(paxos_log($port), $port) < $in_views{$port} + 1) {
+      if (ms_since($t0) > 20000) {
+        mydie( "Failed: Timed out waiting for a new view in ".paxos_log($port) );
+      }
+      Time::HiRes::sleep(0.01);
+    }
+  }
+  my $ms = ms_since($t0);
+  wait_and_check_expected_view($v);
+  return $ms;
+}
+
+# proposer-side time of each decided instance, from the server logs
+sub paxos_times {
+  my %t;
+  foreach my $l (glob("lock_server-*.log")) {
+    open( L, "<$l" ) or next;
+    while (my $line = <L>) {
+      if ($line =~ /instance (\d+) decided in (\d+) ms \((\w+)\)/) {
+        $t{$1} = "$2 ms ($3)";
+      }
+    }
+    close(L);
+  }
+  return %t;
+}
+
 sub start_nodes ($$){
 
   @pid = ();
@@ -258,7 +296,7 @@ if (defined($options{k})) {
 print_config( @p[0..4] );
 
 my @do_run = ();
-my $NUM_TESTS = 17;
+my $NUM_TESTS = 26;
 
 # see which tests are set
 if( $#ARGV > -1 ) {
@@ -907,6 +945,273 @@ if ($do_run[16]) {
   sleep 2;
 }
 
+if ($do_run[17]) {
+
+  print "test17: failover benchmark, 5-process rsm, kill a backup then the primary\n";
+
+  my %summary;
+  foreach my $multi (1, 0) {
+    $ENV{PAXOS_MULTI} = $multi;
+    print "PAXOS_MULTI=$multi\n";
+    start_nodes(5, "ls");
+
+    # the primary notices and removes a dead backup
+    print "Kill backup (PID: $pid[4]) on port $p[4]\n";
+    my $t0 = Time::HiRes::time();
+    kill "TERM", $pid[4];
+    my $backup_ms = time_view_change([@p[0..3]], $t0);
+
+    # the backups notice and remove a dead primary
+    print "Kill primary (PID: $pid[0]) on port $p[0]\n";
+    $t0 = Time::HiRes::time();
+    kill "TERM", $pid[0];
+    my $primary_ms = time_view_change([@p[1..3]], $t0);
+
+    my %px = paxos_times();
+    foreach my $i (sort { $a <=> $b } keys %px) {
+      print "   view $i: paxos $px{$i}\n";
+    }
+    print "   backup failover: $backup_ms ms, primary failover: $primary_ms ms\n";
+    $summary{$multi} = "backup failover $backup_ms ms (paxos " . ($px{6} // "n/a") . "), " .
+      "primary failover $primary_ms ms (paxos " . ($px{7} // "n/a") . ")";
+
+    cleanup();
+    sleep 2;
+  }
+  delete $ENV{PAXOS_MULTI};
+
+  print "   multi-paxos: $summary{1}\n";
+  print "   full rounds: $summary{0}\n";
+}
+
+if ($do_run[18]) {
+
+  print "test18: failover benchmark, 3-process rsm, kill the primary under a steady acquire load\n";
+
+  start_nodes(3, "ls");
+
+  print "Start lock_tester $p[0] 6 (a new lock every 10ms for 20s)\n";
+  $t = spawn("./lock_tester", $p[0], 6, 20);
+
+  sleep 3;
+
+  print "Kill primary (PID: $pid[0]) on port $p[0]\n";
+  my $t0 = Time::HiRes::time();
+  kill "TERM", $pid[0];
+  my $view_ms = time_view_change([@p[1..2]], $t0);
+
+  print "   Wait for lock_tester to finish (waitpid $t)\n";
+  waitpid_to($t, 60);
+
+  my $first;
+  my $log = "lock_tester-$p[0]-6-20.log";
+  open( L, "<$log" ) or mydie( "Failed: couldn't read $log" );
+  while (my $line = <L>) {
+    if ($line =~ /acquired \d+ at (\d+)/ && $1 > $t0 * 1000) {
+      $first = $1;
+      last;
+    }
+  }
+  close(L);
+  mydie( "Failed: no acquire after the primary died" ) if (!defined $first);
+
+  my $acquire_ms = int($first - $t0 * 1000);
+  print "   primary killed -> new view: $view_ms ms, -> first acquire: $acquire_ms ms\n";
+
+  cleanup();
+  sleep 2;
+}
+
+if ($do_run[19]) {
+
+  print "test19: start 3-process rsm, kill primary while lock_tester is running stat\n";
+
+  start_nodes(3, "ls");
+
+  print "Start lock_tester $p[0] 7 (stat from all clients for 8s)\n";
+  $t = spawn("./lock_tester", $p[0], 7, 8);
+
+  sleep 3;
+
+  print "Kill primary (PID: $pid[0]) on port $p[0]\n";
+  kill "TERM", $pid[0];
+
+  print "   Wait for lock_tester to finish (waitpid $t)\n";
+  waitpid_to($t, 60);
+
+  my $stats;
+  my $log = "lock_tester-$p[0]-7-8.log";
+  open( L, "<$log" ) or mydie( "Failed: couldn't read $log" );
+  while (my $line = <L>) {
+    $stats = $1 if ($line =~ /test7: (\d+ stats, \d+ per second)/);
+  }
+  close(L);
+  mydie( "Failed: lock_tester didn't finish" ) if (!defined $stats);
+  print "   $stats\n";
+
+  cleanup();
+  sleep 2;
+}
+
+if ($do_run[20]) {
+
+  print "test20: lock throughput benchmark, one 2-process rsm group vs two\n";
+
+  # 1ms per message, or the single CPU rather than the primary limits it
+  $ENV{RPC_DELAY} = 1000;
+  start_nodes(2, "ls");
+  push( @pid, spawn_ls($p[2], $p[2]) );
+  sleep 1;
+  push( @pid, spawn_ls($p[2], $p[3]) );
+  sleep 3;
+
+  my (%rate, %p50);
+  foreach my $dst ("$p[0]", "$p[0],$p[2]") {
+    print "Start lock_tester $dst 8 (new locks from all clients for 5s)\n";
+    $t = spawn("./lock_tester", $dst, 8, 5);
+    waitpid_to($t, 60);
+    my $log = "lock_tester-$dst-8-5.log";
+    open( L, "<$log" ) or mydie( "Failed: couldn't read $log" );
+    while (my $line = <L>) {
+      $rate{$dst} = $1 if ($line =~ /test8: \d+ acquires, (\d+) per second/);
+    }
+    close(L);
+    mydie( "Failed: lock_tester $dst didn't finish" ) if (!defined $rate{$dst});
+  }
+  delete $ENV{RPC_DELAY};
+
+  print "   one group: $rate{$p[0]} acquires/s, two groups: $rate{\"$p[0],$p[2]\"} acquires/s\n";
+
+  cleanup();
+  sleep 2;
+}
+
+if ($do_run[21]) {
+  print "test21: lock table benchmark, 1M locks each taken by 4 clients in-process\n";
+
+  my $out = `./lock_server -bench 1000000 4 2>&1`;
+  mydie( "Failed: lock_server -bench: $out" )
+    if ($? != 0 || $out !~ /^bench: (.*)$/m);
+  print "   $1\n";
+}
+
+if ($do_run[22]) {
+  print "test22: idle lock expiry, take over 100 locks cached by another client\n";
+
+  $ENV{RPC_DELAY} = 1000;
+  start_nodes(2, "ls");
+
+  my %ms;
+  foreach my $idle (0, 300) {
+    print "Start lock_tester 9 with LOCK_IDLE_MS=$idle\n";
+    $ENV{LOCK_IDLE_MS} = $idle;
+    my $log = "lock_tester-$p[0]-9-1000.log";
+    unlink($log);
+    $t = spawn("./lock_tester", $p[0], 9, 1000);
+    waitpid_to($t, 60);
+    open( L, "<$log" ) or mydie( "Failed: couldn't read $log" );
+    while (my $line = <L>) {
+      $ms{$idle} = $1 if ($line =~ /test9: \d+ locks taken over in (\d+) ms/);
+    }
+    close(L);
+    mydie( "Failed: lock_tester 9 didn't finish" ) if (!defined $ms{$idle});
+  }
+  delete $ENV{LOCK_IDLE_MS};
+  delete $ENV{RPC_DELAY};
+
+  print "   cached: $ms{0} ms, expired after 300 ms idle: $ms{300} ms\n";
+
+  cleanup();
+  sleep 2;
+}
+
+if ($do_run[23]) {
+  print "test23: take over 100 cached locks one by one vs with acquire_many\n";
+
+  $ENV{RPC_DELAY} = 1000;
+  start_nodes(2, "ls");
+
+  print "Start lock_tester 10\n";
+  $t = spawn("./lock_tester", $p[0], 10);
+  waitpid_to($t, 60);
+  my $res;
+  my $log = "lock_tester-$p[0]-10.log";
+  open( L, "<$log" ) or mydie( "Failed: couldn't read $log" );
+  while (my $line = <L>) {
+    $res = $1 if ($line =~ /test10: (one by one \d+ ms, acquire_many \d+ ms)/);
+  }
+  close(L);
+  mydie( "Failed: lock_tester 10 didn't finish" ) if (!defined $res);
+  delete $ENV{RPC_DELAY};
+
+  print "   $res\n";
+
+  cleanup();
+  sleep 2;
+}
+
+if ($do_run[24]) {
+  print "test24: acquire latency of 6 clients contending for one lock\n";
+
+  start_nodes(2, "ls");
+
+  print "Start lock_tester 11\n";
+  $t = spawn("./lock_tester", $p[0], 11, 5);
+  waitpid_to($t, 60);
+  my @n;
+  my $log = "lock_tester-$p[0]-11-5.log";
+  open( L, "<$log" ) or mydie( "Failed: couldn't read $log" );
+  while (my $line = <L>) {
+    if ($line =~ /test11: client \d+: (\d+) acquires(.*)/) {
+      push( @n, $1 );
+      print "   $1 acquires$2\n";
+    }
+  }
+  close(L);
+  mydie( "Failed: lock_tester 11 didn't finish" ) if (@n == 0);
+  my @s = sort { $a <=> $b } @n;
+  mydie( "Failed: unfair, a client got $s[0] acquires and another $s[-1]" )
+    if ($s[0] * 2 < $s[-1]);
+
+  cleanup();
+  sleep 2;
+}
+
+if ($do_run[25]) {
+  print "test25: contended handoff rate, retry then acquire vs direct grant\n";
+
+  $ENV{RPC_DELAY} = 1000;
+  my (%rate, %p50);
+  foreach my $direct (0, 1) {
+    # every replica of the group has to use the same mode
+    $ENV{LOCK_DIRECT_GRANT} = $direct;
+    start_nodes(2, "ls");
+
+    print "Start lock_tester 11 with LOCK_DIRECT_GRANT=$direct\n";
+    my $log = "lock_tester-$p[0]-11-5.log";
+    unlink($log);
+    $t = spawn("./lock_tester", $p[0], 11, 5);
+    waitpid_to($t, 60);
+    open( L, "<$log" ) or mydie( "Failed: couldn't read $log" );
+    while (my $line = <L>) {
+      if ($line =~ /test11: \d+ acquires, \d+ handoffs, (\d+) handoffs per second, p50 (\d+) us/) {
+        $rate{$direct} = $1;
+        $p50{$direct} = $2;
+      }
+    }
+    close(L);
+    mydie( "Failed: lock_tester 11 didn't finish" ) if (!defined $rate{$direct});
+
+    cleanup();
+    sleep 2;
+  }
+  delete $ENV{LOCK_DIRECT_GRANT};
+  delete $ENV{RPC_DELAY};
+
+  print "   retry: $rate{0} handoffs/s, p50 $p50{0} us; " .
+        "direct grant: $rate{1} handoffs/s, p50 $p50{1} us\n";
+}
+
 print "tests done OK\n";
 
 unlink("config");
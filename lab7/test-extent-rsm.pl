@@ -0,0 +1,125 @@
+#!/usr/bin/perl -w
+
+#
+# Replicated extent server test: start three extent_server replicas
+# as one rsm group, run extent_tester's read/write workload against
+# the group, and kill the primary while the workload is running.
+# Every read must return the value just written, before and after
+# the failover.
+#
+
+use POSIX ":sys_wait_h";
+use strict;
+
+my @pid;
+my @logs = ();
+
+use sigtrap 'handler' => \&killprocess, 'HUP', 'INT', 'ABRT', 'QUIT', 'TERM';
+
+sub paxos_log {
+  my $port = shift;
+  return "paxos-$port.log";
+}
+
+sub killprocess {
+  print "killprocess: forcestop all spawned processes...@pid \n";
+  kill 9, @pid;
+}
+
+sub mydie {
+  my ($s) = @_;
+  killprocess();
+  die $s;
+}
+
+sub spawn {
+  my ($p, @a) = @_;
+  my $aa = join("-", @a);
+  if (my $pid = fork) {
+# parent
+    push( @logs, "$p-$aa.log" );
+    return $pid;
+  } elsif (defined $pid) {
+# child
+    open(STDOUT, ">>$p-$aa.log")
+      or mydie "Couln't redirect stout\n";
+    open(STDERR, ">&STDOUT")
+      or mydie "Couln't redirect stderr\n";
+    $| = 1;
+    print "$p @a\n";
+    exec "$p @a"
+      or mydie "Cannot start new $p @a $!\n";
+  } else {
+    mydie "Cannot  fork: $!\n";
+  }
+}
+
+sub get_num_views {
+  my $log = shift;
+  my $including = shift;
+  my $nv = `grep "done " $log 2>/dev/null | grep "$including" | wc -l`;
+  chomp $nv;
+  return $nv;
+}
+
+sub wait_for_view_change {
+  my $log = shift;
+  my $num_views = shift;
+  my $including = shift;
+  my $timeout = shift;
+
+  my $start = time();
+  while( (get_num_views( $log, $including ) < $num_views) and
+      ($start + $timeout > time()) ) {
+    sleep 1;
+  }
+  if( get_num_views( $log, $including ) < $num_views) {
+    mydie( "Failed: Timed out waiting for $including to be in >=$num_views in log $log" );
+  }
+}
+
+# rsm uses port+1 for its test server, so leave a gap between replicas
+my $base = int(rand(40000)) + 20000;
+my @p = ($base, $base + 2, $base + 4);
+unlink(map { paxos_log($_) } @p);
+
+for (my $i = 0; $i <= $#p; $i++) {
+  push( @pid, spawn( "./extent_server", $p[0], $p[$i] ) );
+  print "Start extent_server on $p[$i]\n";
+  sleep 1;
+  wait_for_view_change( paxos_log($p[$i]), 1, $p[$i], 30 );
+}
+# let the last replica finish syncing
+sleep 3;
+
+my $secs = 30;
+my $tester = spawn( "./extent_tester", "-w", $secs, "rsm:$p[0]" );
+sleep 10;
+
+print "Kill primary $p[0]\n";
+kill 9, $pid[0];
+
+# the two remaining replicas form a view without the old primary
+wait_for_view_change( paxos_log($p[1]), 1, "$p[1] $p[2] *\$", 60 );
+
+my $start = time();
+my $done_pid;
+do {
+  sleep 1;
+  $done_pid = waitpid($tester, POSIX::WNOHANG);
+} while( $done_pid <= 0 and (time() - $start) < $secs + 60 );
+if( $done_pid <= 0 ) {
+  kill 9, $tester;
+  mydie( "Failed: extent_tester timed out\n" );
+}
+my $status = $?;
+
+my $log = "./extent_tester--w-$secs-rsm:$p[0].log";
+print `tail -n 2 '$log'`;
+if( $status != 0 or system("grep -q 'passed all tests' '$log'") != 0 ) {
+  mydie( "Failed: extent_tester failed, see $log\n" );
+}
+
+kill 9, @pid;
+unlink(@logs, map { paxos_log($_) } @p);
+print "test-extent-rsm: Passed all tests\n";
@@ -131,13 +131,13 @@ yfs_client::create(inum parent, const char* name, inum& inum)
   }
 
   inum = random_inum(true);
-  if(ec->put(inum, std::string()) != extent_protocol::OK)
-  {
-    return IOERR;
-  }
-
   data.append(file_name + filename(inum) + "/");
-  if(ec->put(parent, data) != extent_protocol::OK)
+
+  // 新的inode和父目录在一个multiput中写入
+  std::map<extent_protocol::extentid_t, std::string> bufs;
+  bufs[inum] = std::string();
+  bufs[parent] = data;
+  if(ec->put_many(bufs) != extent_protocol::OK)
   {
     return IOERR;
   }
@@ -315,13 +315,13 @@ yfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &inum)
   }
 
   inum = random_inum(false);
-  if (ec->put(inum, std::string()) != extent_protocol::OK)
-  {
-    return IOERR;
-  }
-
   data.append(dir_name + filename(inum) + "/");
-  if (ec->put(parent, data) != extent_protocol::OK)
+
+  // 新的inode和父目录在一个multiput中写入
+  std::map<extent_protocol::extentid_t, std::string> bufs;
+  bufs[inum] = std::string();
+  bufs[parent] = data;
+  if (ec->put_many(bufs) != extent_protocol::OK)
   {
     return IOERR;
   }